@@ -3,11 +3,22 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iterator>
 #include <memory>
+#include <new>
 #include <optional>
 #include <sstream>
+#include <string_view>
+#include <type_traits>
+
+using namespace std::literals;
 
 namespace ASTImpl {
 
@@ -80,231 +91,346 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
   {PR_NONE,  PR_NONE,  PR_NONE,  PR_NONE,  PR_NONE, PR_NONE}, // EP_ATOM
 };
 
-class Expr {
-  public:
-  virtual ~Expr() = default;
-  virtual void Print(std::ostream& out) const = 0;
-  virtual void DoPrintFormula(
-      std::ostream& out, ExprPrecedence precedence) const = 0;
-  virtual double Evaluate(
-      const std::function<double(Position)>& args) const = 0;
-
-  // higher is tighter
-  virtual ExprPrecedence GetPrecedence() const = 0;
-
-  void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-      bool right_child = false) const {
-    auto precedence = GetPrecedence();
-    auto mask = right_child ? PR_RIGHT : PR_LEFT;
-    bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-    if (parens_needed) { out << '('; }
-    DoPrintFormula(out, precedence);
-    if (parens_needed) { out << ')'; }
+namespace {
+
+// higher is tighter
+ExprPrecedence GetPrecedence(Node::Kind kind) {
+  switch (kind) {
+    case Node::Kind::Add:
+      return EP_ADD;
+    case Node::Kind::Subtract:
+      return EP_SUB;
+    case Node::Kind::Multiply:
+      return EP_MUL;
+    case Node::Kind::Divide:
+      return EP_DIV;
+    case Node::Kind::UnaryPlus:
+    case Node::Kind::UnaryMinus:
+      return EP_UNARY;
+    case Node::Kind::Number:
+    case Node::Kind::Cell:
+    case Node::Kind::Range:
+    case Node::Kind::Sum:
+    case Node::Kind::Min:
+    case Node::Kind::Max:
+    case Node::Kind::Average:
+    case Node::Kind::Count:
+      return EP_ATOM;
+  }
+  assert(false);
+  return EP_ATOM;
+}
+
+char GetSign(Node::Kind kind) {
+  switch (kind) {
+    case Node::Kind::UnaryPlus:
+    case Node::Kind::Add:
+      return '+';
+    case Node::Kind::UnaryMinus:
+    case Node::Kind::Subtract:
+      return '-';
+    case Node::Kind::Multiply:
+      return '*';
+    case Node::Kind::Divide:
+      return '/';
+    default:
+      assert(false);
+      return '?';
   }
+}
+
+// Names of the aggregate functions as formulas spell them
+constexpr std::pair<std::string_view, Node::Kind> FUNCTIONS[] = {
+  { "SUM"sv, Node::Kind::Sum },
+  { "MIN"sv, Node::Kind::Min },
+  { "MAX"sv, Node::Kind::Max },
+  { "AVERAGE"sv, Node::Kind::Average },
+  { "COUNT"sv, Node::Kind::Count },
 };
 
-namespace {
+bool IsFunction(Node::Kind kind) {
+  return kind >= Node::Kind::Sum && kind <= Node::Kind::Count;
+}
+
+std::optional<Node::Kind> FindFunction(std::string_view name) {
+  for (const auto& [function_name, kind] : FUNCTIONS) {
+    if (function_name == name) { return kind; }
+  }
+  return std::nullopt;
+}
 
-class BinaryOpExpr final : public Expr {
+std::string_view GetFunctionName(Node::Kind kind) {
+  for (const auto& [function_name, function_kind] : FUNCTIONS) {
+    if (function_kind == kind) { return function_name; }
+  }
+  assert(false);
+  return {};
+}
+
+// The range between two corners given in any order
+Range MakeRange(Position corner, Position opposite_corner) {
+  return { { std::min(corner.row, opposite_corner.row),
+             std::min(corner.col, opposite_corner.col) },
+           { std::max(corner.row, opposite_corner.row),
+             std::max(corner.col, opposite_corner.col) } };
+}
+
+// Prints the tree of a formula, node by node
+class Printer {
   public:
 
-  enum Type : char {
-    Add = '+',
-    Subtract = '-',
-    Multiply = '*',
-    Divide   = '/',
-  };
+  Printer(ArrayView<Node> nodes, ArrayView<std::uint32_t> arguments,
+          ArrayView<Range> ranges, const Program& program, Position anchor,
+          std::ostream& out)
+    : nodes_(nodes),
+      arguments_(arguments),
+      ranges_(ranges),
+      program_(program),
+      anchor_(anchor),
+      out_(out) {
+  }
 
-  explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs,
-                        std::unique_ptr<Expr> rhs)
-    : type_(type),
-      lhs_(std::move(lhs)),
-      rhs_(std::move(rhs)) {
-  }
-
-  void Print(std::ostream& out) const override {
-    out << '(' << static_cast<char>(type_) << ' ';
-    lhs_->Print(out);
-    out << ' ';
-    rhs_->Print(out);
-    out << ')';
-  }
-
-  void DoPrintFormula(std::ostream& out,
-                      ExprPrecedence precedence) const override {
-    lhs_->PrintFormula(out, precedence);
-    out << static_cast<char>(type_);
-    rhs_->PrintFormula(out, precedence, /* right_child = */ true);
-  }
-
-  ExprPrecedence GetPrecedence() const override {
-    switch (type_) {
-      case Add:
-        return EP_ADD;
-      case Subtract:
-        return EP_SUB;
-      case Multiply:
-        return EP_MUL;
-      case Divide:
-        return EP_DIV;
+  // Prints the subtree in prefix notation, every operation in parentheses
+  void Print(std::uint32_t index) const {
+    const Node& node = nodes_[index];
+    switch (node.kind) {
+      case Node::Kind::Number:
+      case Node::Kind::Cell:
+      case Node::Kind::Range:
+        PrintLeaf(node);
+        return;
+      case Node::Kind::Sum:
+      case Node::Kind::Min:
+      case Node::Kind::Max:
+      case Node::Kind::Average:
+      case Node::Kind::Count:
+        out_ << '(' << GetFunctionName(node.kind);
+        for (std::uint32_t i = 0; i < node.rhs; ++i) {
+          out_ << ' ';
+          Print(arguments_[node.lhs + i]);
+        }
+        out_ << ')';
+        return;
+      case Node::Kind::UnaryPlus:
+      case Node::Kind::UnaryMinus:
+        out_ << '(' << GetSign(node.kind) << ' ';
+        Print(node.lhs);
+        out_ << ')';
+        return;
       default:
-        assert(false);
-        return static_cast<ExprPrecedence>(INT_MAX);
+        out_ << '(' << GetSign(node.kind) << ' ';
+        Print(node.lhs);
+        out_ << ' ';
+        Print(node.rhs);
+        out_ << ')';
+        return;
     }
   }
 
-  double Evaluate(const std::function<double(Position)>& args) const override {
-    double result = 0.0;
-    switch (type_) {
-      case Add:
-        // Evaluate the left-hand side and right-hand
-        // side expressions and perform addition
-        result = lhs_->Evaluate(args) + rhs_->Evaluate(args);
+  // Prints the subtree as a formula, with only the parentheses
+  // without which it would be parsed differently
+  void PrintFormula(std::uint32_t index, ExprPrecedence parent_precedence,
+                    bool right_child = false) const {
+    const Node& node = nodes_[index];
+    const auto precedence = GetPrecedence(node.kind);
+    const auto mask = right_child ? PR_RIGHT : PR_LEFT;
+    const bool parens_needed =
+        PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+    if (parens_needed) { out_ << '('; }
+    switch (node.kind) {
+      case Node::Kind::Number:
+      case Node::Kind::Cell:
+      case Node::Kind::Range:
+        PrintLeaf(node);
         break;
-      case Subtract:
-        // Evaluate the left-hand side and right-hand
-        // side expressions and perform subtraction
-        result = lhs_->Evaluate(args) - rhs_->Evaluate(args);
+      case Node::Kind::Sum:
+      case Node::Kind::Min:
+      case Node::Kind::Max:
+      case Node::Kind::Average:
+      case Node::Kind::Count:
+        // The arguments are separated by the parentheses of the call
+        out_ << GetFunctionName(node.kind) << '(';
+        for (std::uint32_t i = 0; i < node.rhs; ++i) {
+          if (i != 0) { out_ << ','; }
+          PrintFormula(arguments_[node.lhs + i], EP_ATOM);
+        }
+        out_ << ')';
         break;
-      case Multiply:
-        // Evaluate the left-hand side and right-hand
-        // side expressions and perform multiplication
-        result = lhs_->Evaluate(args) * rhs_->Evaluate(args);
+      case Node::Kind::UnaryPlus:
+      case Node::Kind::UnaryMinus:
+        out_ << GetSign(node.kind);
+        PrintFormula(node.lhs, precedence);
         break;
-      case Divide:
-        // Evaluate the left-hand side and right-hand
-        // side expressions and perform division
-        result = lhs_->Evaluate(args) / rhs_->Evaluate(args);
+      default:
+        PrintFormula(node.lhs, precedence);
+        out_ << GetSign(node.kind);
+        PrintFormula(node.rhs, precedence, /* right_child = */ true);
         break;
     }
-    // Check if the result is finite
-    if (!std::isfinite(result)) {
-      // If the result is not finite throw a FormulaError
-      throw FormulaError{ FormulaError::Category::Div0 };
-    }
-
-  return result;
+    if (parens_needed) { out_ << ')'; }
   }
 
   private:
 
-  Type type_;
-  std::unique_ptr<Expr> lhs_;
-  std::unique_ptr<Expr> rhs_;
-};
-
-class UnaryOpExpr final : public Expr {
-  public:
-
-  enum Type : char {
-    UnaryPlus = '+',
-    UnaryMinus = '-',
-  };
-
-  public:
-
-  explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-    : type_(type),
-      operand_(std::move(operand)) {
+  void PrintLeaf(const Node& node) const {
+    if (node.kind == Node::Kind::Number) {
+      out_ << program_.numbers[node.lhs];
+      return;
+    }
+    if (node.kind == Node::Kind::Range) {
+      const Range range{ Translate(ranges_[node.lhs].first),
+                         Translate(ranges_[node.lhs].last) };
+      if (!range.first.IsValid() || !range.last.IsValid()) {
+        out_ << FormulaError::Category::Ref;
+      }
+      else { out_ << range.ToString(); }
+      return;
+    }
+    const Position cell = Translate(program_.cells[node.lhs]);
+    if (!cell.IsValid()) { out_ << FormulaError::Category::Ref; }
+    else { out_ << cell.ToString(); }
   }
 
-  void Print(std::ostream& out) const override {
-    out << '(' << static_cast<char>(type_) << ' ';
-    operand_->Print(out);
-    out << ')';
+  Position Translate(Position offset) const {
+    return { anchor_.row + offset.row, anchor_.col + offset.col };
   }
 
-  void DoPrintFormula(std::ostream& out,
-                      ExprPrecedence precedence) const override {
-    out << static_cast<char>(type_);
-    operand_->PrintFormula(out, precedence);
-  }
+  ArrayView<Node> nodes_;
+  ArrayView<std::uint32_t> arguments_;
+  ArrayView<Range> ranges_;
+  const Program& program_;
+  Position anchor_;
+  std::ostream& out_;
+};
+
+// Number of instructions the nodes compile into
+std::size_t CountInstructions(const std::vector<Node>& nodes) {
+  return nodes.size() - std::count_if(nodes.begin(), nodes.end(),
+                                      [](const Node& node) {
+                                        return node.kind == Node::Kind::UnaryPlus
+                                               || node.kind == Node::Kind::Range;
+                                      });
+}
 
-  ExprPrecedence GetPrecedence() const override { return EP_UNARY; }
+std::size_t CountCalls(const std::vector<Node>& nodes) {
+  return std::count_if(nodes.begin(), nodes.end(), [](const Node& node) {
+    return IsFunction(node.kind);
+  });
+}
 
-  double Evaluate(const std::function<double(Position)>& args) const override {
-    switch (type_) {
-      case UnaryMinus:
-        // Evaluate the operand and return its negation
-        return -(operand_->Evaluate(args));
-      case UnaryPlus:
-        // Evaluate the operand and return ist positive value
-        return operand_->Evaluate(args);
+// Writes the instructions of the nodes to the code and the calls of
+// the functions with their ranges to calls and ranges, returns the depth
+// of the stack they need. Post-order is exactly the order the instructions
+// run in, so the nodes are compiled one by one
+std::size_t Compile(ArrayView<Node> nodes, ArrayView<std::uint32_t> arguments,
+                    ArrayView<Range> tree_ranges, Instruction* code,
+                    Range* ranges, Call* calls) {
+  std::size_t stack_depth = 0;
+  std::size_t max_stack_depth = 0;
+  std::uint32_t range_count = 0;
+  std::uint32_t call_count = 0;
+  for (const Node& node : nodes) {
+    if (IsFunction(node.kind)) {
+      // Scalar arguments are on the stack already,
+      // ranges are only read by the call
+      Call call{ node.kind, 0, range_count, 0 };
+      for (std::uint32_t i = 0; i < node.rhs; ++i) {
+        const Node& argument = nodes[arguments[node.lhs + i]];
+        if (argument.kind == Node::Kind::Range) {
+          new (ranges + range_count++) Range(tree_ranges[argument.lhs]);
+          ++call.range_count;
+        }
+        else { ++call.scalar_count; }
+      }
+      new (calls + call_count) Call(call);
+      new (code++) Instruction{ Instruction::Code::Call, call_count++ };
+      stack_depth = stack_depth - call.scalar_count + 1;
+      max_stack_depth = std::max(max_stack_depth, stack_depth);
+      continue;
+    }
+    switch (node.kind) {
+      case Node::Kind::Number:
+        new (code++) Instruction{ Instruction::Code::PushNumber, node.lhs };
+        ++stack_depth;
+        break;
+      case Node::Kind::Cell:
+        new (code++) Instruction{ Instruction::Code::LoadCell, node.lhs };
+        ++stack_depth;
+        break;
+      case Node::Kind::Range:
+        // Read by the function it is an argument of
+        break;
+      case Node::Kind::UnaryPlus:
+        // The operand is already the result
+        break;
+      case Node::Kind::UnaryMinus:
+        // Negate the operand on top of the stack
+        new (code++) Instruction{ Instruction::Code::Negate };
+        break;
+      case Node::Kind::Add:
+        new (code++) Instruction{ Instruction::Code::Add };
+        --stack_depth;
+        break;
+      case Node::Kind::Subtract:
+        new (code++) Instruction{ Instruction::Code::Subtract };
+        --stack_depth;
+        break;
+      case Node::Kind::Multiply:
+        new (code++) Instruction{ Instruction::Code::Multiply };
+        --stack_depth;
+        break;
+      case Node::Kind::Divide:
+        new (code++) Instruction{ Instruction::Code::Divide };
+        --stack_depth;
+        break;
       default:
-        // Handle unexpected cases by throwing
-        // an exception or returning a default value
-        throw std::logic_error("Error: unexpected unary operator type");
+        assert(false);
+        break;
     }
+    max_stack_depth = std::max(max_stack_depth, stack_depth);
   }
+  return max_stack_depth;
+}
 
-  private:
-
-  Type type_;
-  std::unique_ptr<Expr> operand_;
-};
-
-class CellExpr final : public Expr {
+// Lays out arrays one after another in a memory block
+class BlockLayout {
   public:
 
-  explicit CellExpr(const Position* cell) : cell_(cell) {}
-
-  void Print(std::ostream& output) const override {
-    if (!cell_->IsValid()) { output << FormulaError::Category::Ref; }
-    else { output << cell_->ToString(); }
+  // Reserves room for an array, returns its offset in the block
+  template <typename T>
+  std::size_t Reserve(std::size_t count) {
+    static_assert(std::is_trivially_copyable_v<T>
+                  && std::is_trivially_destructible_v<T>);
+    static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+    size_ = (size_ + alignof(T) - 1) / alignof(T) * alignof(T);
+    const std::size_t offset = size_;
+    size_ += count * sizeof(T);
+    return offset;
   }
 
-  void DoPrintFormula(std::ostream& output,
-                      ExprPrecedence precedence) const override {
-    Print(output);
-  }
-
-  ExprPrecedence GetPrecedence() const override { return EP_ATOM; }
-
-  double Evaluate(const std::function<double(Position)>& args) const override {
-      return args(*cell_);
-  }
+  std::size_t GetSize() const { return size_; }
 
   private:
 
-  const Position* cell_;
+  std::size_t size_ = 0;
 };
 
-class NumberExpr final : public Expr {
-  public:
-
-  explicit NumberExpr(double value) : value_(value) {}
-
-  void Print(std::ostream& output) const override { output << value_; }
-
-  void DoPrintFormula(std::ostream& out,
-                      ExprPrecedence precedence) const override {
-    out << value_;
-  }
-
-  ExprPrecedence GetPrecedence() const override { return EP_ATOM; }
-
-  double Evaluate(const std::function<double(Position)>& args) const override {
-    return value_;
-  }
-
-  private:
-
-  double value_;
-};
+// Copies the values to the block at the offset
+template <typename T>
+T* CopyTo(std::byte* block, std::size_t offset, const std::vector<T>& values) {
+  T* data = reinterpret_cast<T*>(block + offset);
+  std::uninitialized_copy(values.begin(), values.end(), data);
+  return data;
+}
 
 class ParseASTListener final : public FormulaBaseListener {
   public:
 
-  std::unique_ptr<Expr> MoveRoot() {
+  Tree MoveTree() {
     assert(args_.size() == 1);
-    auto root = std::move(args_.front());
     args_.clear();
 
-    return root;
-  }
-
-  std::forward_list<Position> MoveCells() {
-    return std::move(cells_);
+    return std::move(tree_);
   }
 
   public:
@@ -312,17 +438,14 @@ class ParseASTListener final : public FormulaBaseListener {
   void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
     assert(args_.size() >= 1);
 
-    auto operand = std::move(args_.back());
-
-    UnaryOpExpr::Type type;
-    if (ctx->SUB()) { type = UnaryOpExpr::UnaryMinus; }
+    Node::Kind kind;
+    if (ctx->SUB()) { kind = Node::Kind::UnaryMinus; }
     else {
       assert(ctx->ADD() != nullptr);
-      type = UnaryOpExpr::UnaryPlus;
+      kind = Node::Kind::UnaryPlus;
     }
 
-    auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-    args_.back() = std::move(node);
+    args_.back() = tree_.AddNode({ kind, args_.back() });
   }
 
   void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -332,8 +455,9 @@ class ParseASTListener final : public FormulaBaseListener {
     in >> value;
     if (!in) { throw ParsingError("Invalid number: " + valueStr); }
 
-    auto node = std::make_unique<NumberExpr>(value);
-    args_.push_back(std::move(node));
+    tree_.numbers.push_back(value);
+    const auto number = static_cast<std::uint32_t>(tree_.numbers.size() - 1);
+    args_.push_back(tree_.AddNode({ Node::Kind::Number, number }));
   }
 
   void exitCell(FormulaParser::CellContext* ctx) override {
@@ -343,31 +467,60 @@ class ParseASTListener final : public FormulaBaseListener {
       throw FormulaException("Invalid position: " + value_str);
     }
 
-    cells_.push_front(value);
-    auto node = std::make_unique<CellExpr>(&cells_.front());
-    args_.push_back(std::move(node));
+    tree_.cells.push_back(value);
+    const auto cell = static_cast<std::uint32_t>(tree_.cells.size() - 1);
+    args_.push_back(tree_.AddNode({ Node::Kind::Cell, cell }));
+  }
+
+  void exitRange(FormulaParser::RangeContext* ctx) override {
+    Position corners[2];
+    for (std::size_t i = 0; i < 2; ++i) {
+      const auto value_str = ctx->CELL(i)->getSymbol()->getText();
+      corners[i] = Position::FromString(value_str);
+      if (!corners[i].IsValid()) {
+        throw FormulaException("Invalid position: " + value_str);
+      }
+    }
+
+    tree_.ranges.push_back(MakeRange(corners[0], corners[1]));
+    const auto range = static_cast<std::uint32_t>(tree_.ranges.size() - 1);
+    args_.push_back(tree_.AddNode({ Node::Kind::Range, range }));
+  }
+
+  void exitCall(FormulaParser::CallContext* ctx) override {
+    const auto name = ctx->FUNCTION()->getSymbol()->getText();
+    const auto function = FindFunction(name);
+    if (!function) { throw ParsingError("Unknown function: " + name); }
+
+    // Every argument has left the index of its node on the stack
+    const std::size_t count = ctx->arg().size();
+    assert(args_.size() >= count);
+    const auto first = static_cast<std::uint32_t>(tree_.arguments.size());
+    tree_.arguments.insert(tree_.arguments.end(), args_.end() - count,
+                           args_.end());
+    args_.resize(args_.size() - count);
+    args_.push_back(tree_.AddNode({ *function, first,
+                                    static_cast<std::uint32_t>(count) }));
   }
 
   void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
     assert(args_.size() >= 2);
 
-    auto rhs = std::move(args_.back());
+    const std::uint32_t rhs = args_.back();
     args_.pop_back();
 
-    auto lhs = std::move(args_.back());
+    const std::uint32_t lhs = args_.back();
 
-    BinaryOpExpr::Type type;
-    if (ctx->ADD()) { type = BinaryOpExpr::Add; }
-    else if (ctx->SUB()) { type = BinaryOpExpr::Subtract; }
-    else if (ctx->MUL()) { type = BinaryOpExpr::Multiply; }
+    Node::Kind kind;
+    if (ctx->ADD()) { kind = Node::Kind::Add; }
+    else if (ctx->SUB()) { kind = Node::Kind::Subtract; }
+    else if (ctx->MUL()) { kind = Node::Kind::Multiply; }
     else {
       assert(ctx->DIV() != nullptr);
-      type = BinaryOpExpr::Divide;
+      kind = Node::Kind::Divide;
     }
 
-    auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs),
-                                             std::move(rhs));
-    args_.back() = std::move(node);
+    args_.back() = tree_.AddNode({ kind, lhs, rhs });
   }
 
   void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -376,8 +529,266 @@ class ParseASTListener final : public FormulaBaseListener {
 
   private:
 
-  std::vector<std::unique_ptr<Expr>> args_;
-  std::forward_list<Position> cells_;
+  // Indices of the nodes of the subtrees not yet attached to their parents
+  std::vector<std::uint32_t> args_;
+  Tree tree_;
+};
+
+// Lexing rules of Formula.g4 shared by the parser and the shape keys
+
+bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+bool IsLetter(char c) { return c >= 'A' && c <= 'Z'; }
+
+// WS : [ \t\n\r]+ -> skip
+bool IsSpace(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+
+std::size_t SkipDigits(std::string_view text, std::size_t pos) {
+  while (pos < text.size() && IsDigit(text[pos])) { ++pos; }
+  return pos;
+}
+
+// NUMBER : UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+// Returns the end of the number starting at pos, npos if it is not one
+std::size_t ScanNumber(std::string_view text, std::size_t pos) {
+  pos = SkipDigits(text, pos);
+  if (pos < text.size() && text[pos] == '.') {
+    const std::size_t fraction = pos + 1;
+    pos = SkipDigits(text, fraction);
+    if (pos == fraction) { return std::string_view::npos; }
+  }
+  // The exponent is a part of the number only if it has digits
+  if (pos < text.size() && (text[pos] == 'e' || text[pos] == 'E')) {
+    std::size_t exponent = pos + 1;
+    if (exponent < text.size()
+        && (text[exponent] == '+' || text[exponent] == '-')) {
+      ++exponent;
+    }
+    if (exponent < text.size() && IsDigit(text[exponent])) {
+      pos = SkipDigits(text, exponent);
+    }
+  }
+  return pos;
+}
+
+// CELL : [A-Z]+[0-9]+
+// Returns the end of the cell starting at pos, npos if it is not one
+std::size_t ScanCell(std::string_view text, std::size_t pos) {
+  while (pos < text.size() && IsLetter(text[pos])) { ++pos; }
+  const std::size_t digits = pos;
+  pos = SkipDigits(text, digits);
+  return pos == digits ? std::string_view::npos : pos;
+}
+
+// Recursive descent parser of the grammar of Formula.g4 that reads
+// the text directly, without a token stream and a parse tree in between.
+// Builds the same tree as ParseASTListener and fails on the same texts
+class Parser {
+  public:
+
+  Parser(std::string_view text, Tree& tree) : text_(text), tree_(tree) {}
+
+  // main : expr EOF
+  void ParseMain() {
+    ParseExpr(LEVEL_ADD);
+    SkipSpaces();
+    if (pos_ != text_.size()) {
+      throw ParsingError("Error when parsing: "s + text_[pos_]);
+    }
+    // The listener meets cells only once the text is known to be well formed
+    if (!invalid_cell_.empty()) {
+      throw FormulaException("Invalid position: " + invalid_cell_);
+    }
+  }
+
+  private:
+
+  // Binding levels of the binary operators, the grammar lists
+  // the alternatives of higher levels first
+  static constexpr int LEVEL_ADD = 0;
+  static constexpr int LEVEL_MUL = 1;
+
+  // Binary operations of at least min_level, left associative;
+  // the parse functions return the index of the node they add
+  std::uint32_t ParseExpr(int min_level) {
+    std::uint32_t lhs = ParseOperand();
+    while (true) {
+      SkipSpaces();
+      if (pos_ == text_.size()) { return lhs; }
+      Node::Kind kind;
+      int level;
+      switch (text_[pos_]) {
+        case '+': kind = Node::Kind::Add;      level = LEVEL_ADD; break;
+        case '-': kind = Node::Kind::Subtract; level = LEVEL_ADD; break;
+        case '*': kind = Node::Kind::Multiply; level = LEVEL_MUL; break;
+        case '/': kind = Node::Kind::Divide;   level = LEVEL_MUL; break;
+        default: return lhs;
+      }
+      if (level < min_level) { return lhs; }
+      ++pos_;
+      const std::uint32_t rhs = ParseExpr(level + 1);
+      lhs = tree_.AddNode({ kind, lhs, rhs });
+    }
+  }
+
+  // Parentheses, unary operations, cells and numbers; a unary operation
+  // binds tighter than any binary one, as its alternative comes first
+  std::uint32_t ParseOperand() {
+    SkipSpaces();
+    if (pos_ == text_.size()) {
+      throw ParsingError("Error when parsing: unexpected end");
+    }
+    const char c = text_[pos_];
+    if (c == '+' || c == '-') {
+      ++pos_;
+      const std::uint32_t operand = ParseOperand();
+      return tree_.AddNode({ c == '+' ? Node::Kind::UnaryPlus
+                                      : Node::Kind::UnaryMinus, operand });
+    }
+    if (c == '(') {
+      ++pos_;
+      const std::uint32_t expr = ParseExpr(LEVEL_ADD);
+      Expect(')');
+      return expr;
+    }
+    if (IsDigit(c) || c == '.') { return ParseNumber(); }
+    if (IsLetter(c)) {
+      if (ScanCell(text_, pos_) != std::string_view::npos) {
+        return ParseCell();
+      }
+      return ParseCall();
+    }
+    throw ParsingError("Error when lexing: "s + c);
+  }
+
+  // FUNCTION '(' arg (',' arg)* ')'; names of functions are letters
+  // without the digits that would make them cells
+  std::uint32_t ParseCall() {
+    const std::size_t start = pos_;
+    while (pos_ < text_.size() && IsLetter(text_[pos_])) { ++pos_; }
+    const auto function = FindFunction(text_.substr(start, pos_ - start));
+    if (!function) {
+      throw ParsingError("Error when lexing: "s + text_[start]);
+    }
+    Expect('(');
+    // Arguments of nested calls are added to the tree before the ones
+    // of this call, so these wait on the stack until the call ends
+    const std::size_t first_pending = pending_arguments_.size();
+    do {
+      pending_arguments_.push_back(ParseArgument());
+    } while (Accept(','));
+    Expect(')');
+
+    const auto first = static_cast<std::uint32_t>(tree_.arguments.size());
+    const auto count =
+        static_cast<std::uint32_t>(pending_arguments_.size() - first_pending);
+    tree_.arguments.insert(tree_.arguments.end(),
+                           pending_arguments_.begin() + first_pending,
+                           pending_arguments_.end());
+    pending_arguments_.resize(first_pending);
+    return tree_.AddNode({ *function, first, count });
+  }
+
+  // arg : CELL ':' CELL | expr
+  std::uint32_t ParseArgument() {
+    SkipSpaces();
+    const std::size_t start = pos_;
+    if (start < text_.size() && IsLetter(text_[start])) {
+      const std::size_t end = ScanCell(text_, start);
+      if (end != std::string_view::npos) {
+        pos_ = end;
+        if (Accept(':')) {
+          const Position corner = ReadCell(start, end);
+          SkipSpaces();
+          const std::size_t opposite_start = pos_;
+          if (pos_ == text_.size() || !IsLetter(text_[pos_])) {
+            throw ParsingError("Error when parsing: range");
+          }
+          pos_ = ScanCell(text_, opposite_start);
+          if (pos_ == std::string_view::npos) {
+            throw ParsingError("Error when parsing: range");
+          }
+          const Position opposite_corner = ReadCell(opposite_start, pos_);
+          tree_.ranges.push_back(MakeRange(corner, opposite_corner));
+          const auto index =
+              static_cast<std::uint32_t>(tree_.ranges.size() - 1);
+          return tree_.AddNode({ Node::Kind::Range, index });
+        }
+        pos_ = start;
+      }
+    }
+    return ParseExpr(LEVEL_ADD);
+  }
+
+  std::uint32_t ParseNumber() {
+    const std::size_t start = pos_;
+    pos_ = ScanNumber(text_, start);
+    if (pos_ == std::string_view::npos) {
+      throw ParsingError("Error when lexing: .");
+    }
+    const std::string_view number = text_.substr(start, pos_ - start);
+    double value = 0.0;
+    const auto [end, error] =
+        std::from_chars(number.data(), number.data() + number.size(), value);
+    if (error == std::errc::result_out_of_range) {
+      // std::istream, which the listener reads numbers with,
+      // accepts numbers too small to represent and rejects too big ones
+      value = std::strtod(std::string(number).c_str(), nullptr);
+      if (!std::isfinite(value)) {
+        throw ParsingError("Invalid number: " + std::string(number));
+      }
+    }
+    else if (error != std::errc() || end != number.data() + number.size()) {
+      throw ParsingError("Invalid number: " + std::string(number));
+    }
+    tree_.numbers.push_back(value);
+    const auto index = static_cast<std::uint32_t>(tree_.numbers.size() - 1);
+    return tree_.AddNode({ Node::Kind::Number, index });
+  }
+
+  std::uint32_t ParseCell() {
+    const std::size_t start = pos_;
+    pos_ = ScanCell(text_, start);
+    if (pos_ == std::string_view::npos) {
+      throw ParsingError("Error when lexing: "s + text_[start]);
+    }
+    tree_.cells.push_back(ReadCell(start, pos_));
+    const auto index = static_cast<std::uint32_t>(tree_.cells.size() - 1);
+    return tree_.AddNode({ Node::Kind::Cell, index });
+  }
+
+  // Reads the cell between start and end, remembering the first invalid one
+  Position ReadCell(std::size_t start, std::size_t end) {
+    const std::string_view cell = text_.substr(start, end - start);
+    const Position value = Position::FromString(cell);
+    if (!value.IsValid() && invalid_cell_.empty()) {
+      invalid_cell_ = cell;
+    }
+    return value;
+  }
+
+  void SkipSpaces() {
+    while (pos_ < text_.size() && IsSpace(text_[pos_])) { ++pos_; }
+  }
+
+  // Skips the character with the spaces before it if it is the next one
+  bool Accept(char c) {
+    SkipSpaces();
+    if (pos_ == text_.size() || text_[pos_] != c) { return false; }
+    ++pos_;
+    return true;
+  }
+
+  void Expect(char c) {
+    if (!Accept(c)) { throw ParsingError("Error when parsing: missing "s + c); }
+  }
+
+  std::string_view text_;
+  std::size_t pos_ = 0;
+  Tree& tree_;
+  std::string invalid_cell_;
+  // Arguments of the calls being parsed, innermost last
+  std::vector<std::uint32_t> pending_arguments_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -396,7 +807,84 @@ class BailErrorListener : public antlr4::BaseErrorListener {
 } // end of namespace
 } // end of namespace ASTImpl
 
+FormulaAST ParseFormulaAST(std::string_view in, Position anchor) {
+  // The scratch tree keeps its capacity from formula to formula,
+  // so parsing allocates nothing once it has grown to typical sizes
+  thread_local ASTImpl::Tree tree;
+  tree.Clear();
+  ASTImpl::Parser parser(in, tree);
+  parser.ParseMain();
+  const auto to_offset = [anchor](Position& cell) {
+    cell = { cell.row - anchor.row, cell.col - anchor.col };
+  };
+  for (Position& cell : tree.cells) { to_offset(cell); }
+  for (Range& range : tree.ranges) {
+    to_offset(range.first);
+    to_offset(range.last);
+  }
+  return FormulaAST(tree);
+}
+
+std::optional<std::string> GetFormulaShape(std::string_view in,
+                                           Position anchor) {
+  using namespace ASTImpl;
+
+  std::string shape;
+  shape.reserve(in.size() + 8);
+  const auto append_offset = [&shape](int offset) {
+    char digits[16];
+    const auto end = std::to_chars(std::begin(digits), std::end(digits),
+                                   offset).ptr;
+    shape.append(digits, end);
+  };
+  for (std::size_t pos = 0; pos < in.size();) {
+    const char c = in[pos];
+    if (IsDigit(c) || c == '.') {
+      const std::size_t end = ScanNumber(in, pos);
+      if (end == std::string_view::npos) { return std::nullopt; }
+      shape.append(in.substr(pos, end - pos));
+      pos = end;
+    }
+    else if (IsLetter(c)) {
+      const std::size_t end = ScanCell(in, pos);
+      if (end == std::string_view::npos) {
+        // Names of functions are kept as they are
+        std::size_t name_end = pos;
+        while (name_end < in.size() && IsLetter(in[name_end])) { ++name_end; }
+        if (!FindFunction(in.substr(pos, name_end - pos))) {
+          return std::nullopt;
+        }
+        shape.append(in.substr(pos, name_end - pos));
+        pos = name_end;
+        continue;
+      }
+      const Position cell = Position::FromString(in.substr(pos, end - pos));
+      if (!cell.IsValid()) { return std::nullopt; }
+      // The brackets never occur in formulas, so the offsets
+      // cannot be confused with the rest of the text
+      shape += '[';
+      append_offset(cell.row - anchor.row);
+      shape += ',';
+      append_offset(cell.col - anchor.col);
+      shape += ']';
+      pos = end;
+    }
+    else if (IsSpace(c) || c == '+' || c == '-' || c == '*' || c == '/'
+             || c == '(' || c == ')' || c == ':' || c == ',') {
+      shape += c;
+      ++pos;
+    }
+    else { return std::nullopt; }
+  }
+  return shape;
+}
+
 FormulaAST ParseFormulaAST(std::istream& in) {
+  const std::string in_str(std::istreambuf_iterator<char>(in), {});
+  return ParseFormulaAST(std::string_view(in_str));
+}
+
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in) {
   using namespace antlr4;
 
   ANTLRInputStream input(in);
@@ -417,34 +905,269 @@ FormulaAST ParseFormulaAST(std::istream& in) {
   ASTImpl::ParseASTListener listener;
   tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-  return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+  return FormulaAST(listener.MoveTree());
+}
+
+void FormulaAST::PrintCells(std::ostream& out, Position anchor) const {
+  for (auto cell : cells_) {
+    out << Position{ anchor.row + cell.row, anchor.col + cell.col }.ToString()
+        << ' ';
+  }
+}
+
+void FormulaAST::Print(std::ostream& out, Position anchor) const {
+  ASTImpl::Printer(nodes_, arguments_, ranges_, program_, anchor, out)
+      .Print(nodes_.size() - 1);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position anchor) const {
+  ASTImpl::Printer(nodes_, arguments_, ranges_, program_, anchor, out)
+      .PrintFormula(nodes_.size() - 1, ASTImpl::EP_ATOM);
+}
+
+
+namespace ASTImpl {
+namespace {
+
+// Kernels folding the values of the arguments of a function. Independent
+// accumulators break the chain of dependencies between the operations,
+// so that the compiler may keep them in the lanes of a vector register
+constexpr std::size_t LANES = 4;
+
+template <typename Op>
+double Reduce(const double* values, std::size_t count, double init, Op op) {
+  double lanes[LANES] = { init, init, init, init };
+  std::size_t i = 0;
+  for (; i + LANES <= count; i += LANES) {
+    for (std::size_t lane = 0; lane < LANES; ++lane) {
+      lanes[lane] = op(lanes[lane], values[i + lane]);
+    }
+  }
+  double result = op(op(lanes[0], lanes[1]), op(lanes[2], lanes[3]));
+  for (; i < count; ++i) { result = op(result, values[i]); }
+  return result;
+}
+
+double Sum(const double* values, std::size_t count) {
+  return Reduce(values, count, 0.0, [](double lhs, double rhs) {
+    return lhs + rhs;
+  });
+}
+
+// The values are finite, so infinities are neutral for the minimum
+// and the maximum
+double Min(const double* values, std::size_t count) {
+  return Reduce(values, count, HUGE_VAL, [](double lhs, double rhs) {
+    return rhs < lhs ? rhs : lhs;
+  });
+}
+
+double Max(const double* values, std::size_t count) {
+  return Reduce(values, count, -HUGE_VAL, [](double lhs, double rhs) {
+    return rhs > lhs ? rhs : lhs;
+  });
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-  std::istringstream in(in_str);
-  return ParseFormulaAST(in);
+// Buffer for the values of the arguments of a call. Reading a range may
+// evaluate the formulas of its cells, so every call in progress
+// on a thread takes a buffer of its own; the buffers keep their capacity
+class ValuesBuffer {
+  public:
+
+  ValuesBuffer() {
+    if (buffers_.size() == depth_) { buffers_.emplace_back(); }
+    ++depth_;
+  }
+
+  ValuesBuffer(const ValuesBuffer&) = delete;
+  ValuesBuffer& operator=(const ValuesBuffer&) = delete;
+
+  ~ValuesBuffer() { --depth_; }
+
+  std::vector<double>& Get() { return buffers_[depth_ - 1]; }
+
+  private:
+
+  // A deque keeps the buffers in place as it grows
+  static thread_local std::deque<std::vector<double>> buffers_;
+  static thread_local std::size_t depth_;
+};
+
+thread_local std::deque<std::vector<double>> ValuesBuffer::buffers_;
+thread_local std::size_t ValuesBuffer::depth_ = 0;
+
+// Returns the value of the function of the call or a boxed error.
+// The values of the ranges are collected into one array
+// and folded by the kernels
+double Aggregate(const Program& program, const Call& call,
+                 const double* scalars, RangeArgs range_args) {
+  ValuesBuffer buffer;
+  std::vector<double>& values = buffer.Get();
+  values.assign(scalars, scalars + call.scalar_count);
+  for (std::uint32_t i = 0; i < call.range_count; ++i) {
+    const double error = range_args(program.ranges[call.first_range + i],
+                                    values);
+    if (std::isnan(error)) { return error; }
+  }
+
+  const double* data = values.data();
+  const std::size_t count = values.size();
+  switch (call.function) {
+    case Node::Kind::Sum:
+      return Sum(data, count);
+    case Node::Kind::Min:
+      return count == 0 ? 0.0 : Min(data, count);
+    case Node::Kind::Max:
+      return count == 0 ? 0.0 : Max(data, count);
+    case Node::Kind::Average:
+      if (count == 0) { return BoxFormulaError(FormulaError::Category::Div0); }
+      return Sum(data, count) / static_cast<double>(count);
+    case Node::Kind::Count:
+      return static_cast<double>(count);
+    default:
+      assert(false);
+      return 0.0;
+  }
 }
 
-void FormulaAST::PrintCells(std::ostream& out) const {
-  for (auto cell : cells_) { out << cell.ToString() << ' '; }
+// Runs the program on a stack with room for max_stack_depth values
+double Run(const Program& program, CellArgs cell_args, RangeArgs range_args,
+           double* stack) {
+  // Points past the top value of the stack
+  double* top = stack;
+  for (const Instruction& instruction : program.code) {
+    switch (instruction.code) {
+      case Instruction::Code::PushNumber:
+        *top++ = program.numbers[instruction.operand];
+        continue;
+      case Instruction::Code::LoadCell:
+        *top++ = cell_args(program.cells[instruction.operand]);
+        // A boxed error of a referenced cell is the result
+        if (std::isnan(top[-1])) { return top[-1]; }
+        continue;
+      case Instruction::Code::Add:
+        --top;
+        top[-1] += top[0];
+        break;
+      case Instruction::Code::Subtract:
+        --top;
+        top[-1] -= top[0];
+        break;
+      case Instruction::Code::Multiply:
+        --top;
+        top[-1] *= top[0];
+        break;
+      case Instruction::Code::Divide:
+        --top;
+        top[-1] /= top[0];
+        break;
+      case Instruction::Code::Negate:
+        top[-1] = -top[-1];
+        continue;
+      case Instruction::Code::Call: {
+        const Call& call = program.calls[instruction.operand];
+        top -= call.scalar_count;
+        *top = Aggregate(program, call, top, range_args);
+        ++top;
+        if (std::isnan(top[-1])) { return top[-1]; }
+        // A sum may overflow just as an addition
+        break;
+      }
+    }
+    // Operands are always finite, so a binary
+    // operation that is not has overflowed
+    if (!std::isfinite(top[-1])) {
+      return BoxFormulaError(FormulaError::Category::Div0);
+    }
+  }
+  assert(top == stack + 1);
+  return stack[0];
 }
 
-void FormulaAST::Print(std::ostream& out) const { root_expr_->Print(out); }
+} // end of namespace
+} // end of namespace ASTImpl
+
+namespace {
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-  root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+// Quiet NaN, the low bits of the payload hold the error category
+constexpr std::uint64_t BOXED_ERROR_BITS = 0x7FF8'0000'0000'0000;
+constexpr std::uint64_t BOXED_CATEGORY_MASK = 0xFF;
+
+} // end of namespace
+
+double BoxFormulaError(FormulaError error) {
+  const std::uint64_t bits =
+      BOXED_ERROR_BITS | static_cast<std::uint64_t>(error.GetCategory());
+  double value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
 }
 
-double FormulaAST::Execute(const std::function<double(Position)>& args) const {
-  return root_expr_->Evaluate(args);
+FormulaError UnboxFormulaError(double value) {
+  std::uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const std::uint64_t category = bits & BOXED_CATEGORY_MASK;
+  // Any other NaN can only come from arithmetic
+  if ((bits & ~BOXED_CATEGORY_MASK) != BOXED_ERROR_BITS
+      || category > static_cast<std::uint64_t>(FormulaError::Category::Div0)) {
+    return FormulaError::Category::Div0;
+  }
+  return static_cast<FormulaError::Category>(category);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                       std::forward_list<Position> cells)
-  : root_expr_(std::move(root_expr)),
-    cells_(std::move(cells)) {
+double FormulaAST::Execute(CellArgs cell_args, RangeArgs range_args) const {
+  // Typical formulas fit into a stack on the native one
+  constexpr std::size_t INLINE_STACK_DEPTH = 64;
+  if (program_.max_stack_depth <= INLINE_STACK_DEPTH) {
+    double stack[INLINE_STACK_DEPTH];
+    return ASTImpl::Run(program_, cell_args, range_args, stack);
+  }
+  std::vector<double> stack(program_.max_stack_depth);
+  return ASTImpl::Run(program_, cell_args, range_args, stack.data());
+}
 
-  cells_.sort();
+FormulaAST::FormulaAST(const ASTImpl::Tree& tree) {
+  using namespace ASTImpl;
+
+  const std::size_t code_size = CountInstructions(tree.nodes);
+  const std::size_t call_count = CountCalls(tree.nodes);
+  BlockLayout layout;
+  const std::size_t numbers_offset = layout.Reserve<double>(tree.numbers.size());
+  const std::size_t code_offset = layout.Reserve<Instruction>(code_size);
+  const std::size_t program_cells_offset =
+      layout.Reserve<Position>(tree.cells.size());
+  const std::size_t program_ranges_offset =
+      layout.Reserve<Range>(tree.ranges.size());
+  const std::size_t calls_offset = layout.Reserve<Call>(call_count);
+  const std::size_t cells_offset = layout.Reserve<Position>(tree.cells.size());
+  const std::size_t ranges_offset = layout.Reserve<Range>(tree.ranges.size());
+  const std::size_t nodes_offset = layout.Reserve<Node>(tree.nodes.size());
+  const std::size_t arguments_offset =
+      layout.Reserve<std::uint32_t>(tree.arguments.size());
+  memory_size_ = layout.GetSize();
+  memory_.reset(new std::byte[memory_size_]);
+  std::byte* block = memory_.get();
+
+  nodes_ = { CopyTo(block, nodes_offset, tree.nodes), tree.nodes.size() };
+  Position* cells = CopyTo(block, cells_offset, tree.cells);
+  std::sort(cells, cells + tree.cells.size());
+  cells_ = { cells, tree.cells.size() };
+  ranges_ = { CopyTo(block, ranges_offset, tree.ranges), tree.ranges.size() };
+  arguments_ = { CopyTo(block, arguments_offset, tree.arguments),
+                 tree.arguments.size() };
+
+  program_.numbers = { CopyTo(block, numbers_offset, tree.numbers),
+                       tree.numbers.size() };
+  program_.cells = { CopyTo(block, program_cells_offset, tree.cells),
+                     tree.cells.size() };
+  auto* code = reinterpret_cast<Instruction*>(block + code_offset);
+  auto* program_ranges = reinterpret_cast<Range*>(block + program_ranges_offset);
+  auto* calls = reinterpret_cast<Call*>(block + calls_offset);
+  program_.max_stack_depth = Compile(nodes_, arguments_, ranges_, code,
+                                     program_ranges, calls);
+  program_.code = { code, code_size };
+  program_.ranges = { program_ranges, tree.ranges.size() };
+  program_.calls = { calls, call_count };
 }
 
 FormulaAST::~FormulaAST() = default;
@@ -3,14 +3,160 @@
 #include "FormulaLexer.h"
 #include "common.h"
 
-#include <forward_list>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace ASTImpl {
-  class Expr;
+  // Node of a syntax tree. The nodes of a formula are stored in one
+  // array in post-order: the children of a node precede it, the root
+  // is the last one
+  struct Node {
+    enum class Kind : std::uint8_t {
+      Number,
+      Cell,
+      Range,
+      UnaryPlus,
+      UnaryMinus,
+      Add,
+      Subtract,
+      Multiply,
+      Divide,
+      // Aggregate functions
+      Sum,
+      Min,
+      Max,
+      Average,
+      Count,
+    };
+
+    Kind kind;
+    // Index into the numbers of the tree for Number, into its cells
+    // for Cell, into its ranges for Range, of the operand node for unary
+    // operations, of the left operand node for binary ones and into
+    // the arguments of the tree for the first argument of a function
+    std::uint32_t lhs = 0;
+    // Index of the right operand node for binary operations,
+    // number of the arguments for functions
+    std::uint32_t rhs = 0;
+  };
+
+  // Syntax tree as the parsers build it; numbers, cells and ranges
+  // are listed in the order they appear in the text
+  struct Tree {
+    std::vector<Node> nodes;
+    std::vector<double> numbers;
+    std::vector<Position> cells;
+    std::vector<Range> ranges;
+    // Indices of the argument nodes of the functions, the arguments
+    // of a function follow each other
+    std::vector<std::uint32_t> arguments;
+
+    // Appends the node, returns its index
+    std::uint32_t AddNode(Node node) {
+      nodes.push_back(node);
+      return static_cast<std::uint32_t>(nodes.size() - 1);
+    }
+
+    void Clear() {
+      nodes.clear();
+      numbers.clear();
+      cells.clear();
+      ranges.clear();
+      arguments.clear();
+    }
+  };
+
+  // Instruction of a formula compiled for the stack machine
+  struct Instruction {
+    enum class Code : std::uint8_t {
+      PushNumber,
+      LoadCell,
+      Add,
+      Subtract,
+      Multiply,
+      Divide,
+      Negate,
+      Call,
+    };
+
+    Code code;
+    // Index into Program::numbers for PushNumber,
+    // into Program::cells for LoadCell, into Program::calls for Call
+    std::uint32_t operand = 0;
+  };
+
+  // Call of an aggregate function: its scalar arguments are on top
+  // of the stack, its ranges follow each other in Program::ranges
+  struct Call {
+    // One of the function kinds of Node
+    Node::Kind function;
+    std::uint32_t scalar_count = 0;
+    std::uint32_t first_range = 0;
+    std::uint32_t range_count = 0;
+  };
+
+  // Formula compiled into a linear sequence of
+  // instructions executed in reverse Polish order
+  struct Program {
+    ArrayView<Instruction> code;
+    ArrayView<double> numbers;
+    ArrayView<Position> cells;
+    ArrayView<Range> ranges;
+    ArrayView<Call> calls;
+    std::size_t max_stack_depth = 0;
+  };
 }
 
+// Evaluation errors travel through the evaluator as NaNs with the error
+// category in the payload, so that no exception is thrown on the hot path
+double BoxFormulaError(FormulaError error);
+
+// Returns the error carried by a NaN produced by the evaluator
+FormulaError UnboxFormulaError(double value);
+
+// Non-owning reference to a callable, for the callbacks
+// that supply cell values to the evaluator
+template <typename Signature>
+class FunctionRef;
+
+template <typename R, typename... Args>
+class FunctionRef<R(Args...)> {
+  public:
+
+  template <typename Func>
+  FunctionRef(const Func& func)
+    : object_(&func),
+      call_([](const void* object, Args... args) -> R {
+        return (*static_cast<const Func*>(object))(std::forward<Args>(args)...);
+      }) {
+  }
+
+  R operator()(Args... args) const {
+    return call_(object_, std::forward<Args>(args)...);
+  }
+
+  private:
+
+  const void* object_;
+  R (*call_)(const void*, Args...);
+};
+
+// Gets the offset of a cell, returns its value or a boxed error
+using CellArgs = FunctionRef<double(Position)>;
+
+// Gets a range with the offsets of its corners and appends the values
+// of its cells the way SheetInterface::GetRangeValues does.
+// Returns zero or a boxed error
+using RangeArgs = FunctionRef<double(Range, std::vector<double>&)>;
+
 class ParsingError : public std::runtime_error {
   using std::runtime_error::runtime_error;
 };
@@ -18,27 +164,63 @@ class ParsingError : public std::runtime_error {
 class FormulaAST {
   public:
 
-  explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                      std::forward_list<Position> cells_at_positions);
+  // Copies the tree into a memory block of exactly its size
+  explicit FormulaAST(const ASTImpl::Tree& tree);
   FormulaAST(FormulaAST&&) = default;
   FormulaAST& operator=(FormulaAST&&) = default;
   ~FormulaAST();
 
-  double Execute(const std::function<double(Position)>& args) const;
-  void PrintCells(std::ostream& out) const;
-  void Print(std::ostream& out) const;
-  void PrintFormula(std::ostream& out) const;
+  // The cells of the formula are kept as offsets from the cell it is
+  // parsed for, the anchor; printing puts them back relative to an anchor
+
+  // Returns the value of the formula or an error boxed by BoxFormulaError.
+  // The args get the offsets of the cells and of the ranges; a boxed error
+  // they return stops the evaluation and is passed on
+  double Execute(CellArgs cell_args, RangeArgs range_args) const;
+  void PrintCells(std::ostream& out, Position anchor = {}) const;
+  void Print(std::ostream& out, Position anchor = {}) const;
+  void PrintFormula(std::ostream& out, Position anchor = {}) const;
+
+  // Offsets of the referenced cells from the anchor,
+  // sorted, with repetitions
+  ArrayView<Position> GetCells() const { return cells_; }
 
-  std::forward_list<Position>& GetCells() { return cells_; }
-  const std::forward_list<Position>& GetCells() const { return cells_; }
+  // Ranges of the formula with the offsets of their corners,
+  // in the order of the text, with repetitions
+  ArrayView<Range> GetRanges() const { return ranges_; }
+
+  // Bytes of heap memory the formula holds
+  std::size_t GetMemoryUsage() const { return memory_size_; }
 
   private:
 
-  std::unique_ptr<ASTImpl::Expr> root_expr_;
+  // The only allocation of the formula: the arrays below all point into it
+  std::unique_ptr<std::byte[]> memory_;
+  std::size_t memory_size_ = 0;
+  // The tree is kept only to print the formula back, its leaves
+  // refer to the numbers and the cells of the program and to the ranges
+  ArrayView<ASTImpl::Node> nodes_;
   // Physically stores cells so that they
   // can be efficiently traversed without going through the whole AST
-  std::forward_list<Position> cells_;
+  ArrayView<Position> cells_;
+  ArrayView<Range> ranges_;
+  // Indices of the argument nodes of the functions
+  ArrayView<std::uint32_t> arguments_;
+  // What Execute actually runs
+  ASTImpl::Program program_;
 };
 
+// Parses the formula of the cell at the anchor
+FormulaAST ParseFormulaAST(std::string_view in, Position anchor = {});
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+
+// Shape of the formula of the cell at the anchor: its text with every cell
+// replaced by the offset from the anchor. Formulas of equal shapes parse
+// into equal trees, with the same offsets. Returns nothing for texts
+// that are certainly not formulas
+std::optional<std::string> GetFormulaShape(std::string_view in,
+                                           Position anchor);
+
+// Parses with the parser ANTLR generates from Formula.g4; slower,
+// kept as the reference the hand-written parser is checked against
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in);
@@ -0,0 +1,62 @@
+#include "allocation_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace {
+
+std::atomic<std::size_t> allocation_count{ 0 };
+
+}  // namespace
+
+std::size_t GetAllocationCount() {
+  return allocation_count.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void* memory = std::malloc(size == 0 ? 1 : size)) { return memory; }
+  throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  const std::size_t align = static_cast<std::size_t>(alignment);
+  // A request for zero bytes must still get a distinct block
+  if (size == 0) { size = 1; }
+#ifdef _WIN32
+  // MSVC has no aligned_alloc, its aligned blocks need _aligned_free
+  if (void* memory = _aligned_malloc(size, align)) {
+    return memory;
+  }
+#else
+  // aligned_alloc wants a multiple of the alignment
+  if (void* memory = std::aligned_alloc(
+          align, (size + align - 1) / align * align)) {
+    return memory;
+  }
+#endif
+  throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept { std::free(memory); }
+
+void operator delete(void* memory, std::size_t) noexcept { std::free(memory); }
+
+void operator delete(void* memory, std::align_val_t) noexcept {
+#ifdef _WIN32
+  _aligned_free(memory);
+#else
+  std::free(memory);
+#endif
+}
+
+void operator delete(void* memory, std::size_t,
+                     std::align_val_t alignment) noexcept {
+  ::operator delete(memory, alignment);
+}
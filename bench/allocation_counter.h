@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstddef>
+
+// Requests to operator new made so far by all threads. The bench replaces
+// the global operator new to count them; the counting is kept in its own
+// file so that the replacement is not inlined into the measured code
+std::size_t GetAllocationCount();
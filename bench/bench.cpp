@@ -0,0 +1,938 @@
+#include "../FormulaAST.h"
+#include "../common.h"
+#include "../formula.h"
+#include "../position_map.h"
+#include "../sheet.h"
+#include "allocation_counter.h"
+#include "bench_runner_p.h"
+
+#include <functional>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+using namespace std::literals;
+
+namespace {
+
+// Keeps the results of the measured code alive
+volatile double sink = 0.0;
+
+void Consume(const FormulaInterface::Value& value) {
+  if (std::holds_alternative<double>(value)) {
+    sink = sink + std::get<double>(value);
+  }
+}
+
+void Consume(const CellInterface::Value& value) {
+  if (std::holds_alternative<double>(value)) {
+    sink = sink + std::get<double>(value);
+  }
+}
+
+// Position of the i-th cell of a long sequence laid out column by column
+Position NthCell(int i) {
+  return { i % Position::MAX_ROWS, i / Position::MAX_ROWS };
+}
+
+// Fills a block of the sheet: numbers in the first column,
+// formulas over the number of their row in the other ones
+void LoadBlock(SheetInterface& sheet, int rows, int cols) {
+  for (int row = 0; row < rows; ++row) {
+    sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+    const std::string leaf = Position{ row, 0 }.ToString();
+    for (int col = 1; col < cols; ++col) {
+      sheet.SetCell(Position{ row, col },
+                    "=" + leaf + "*" + std::to_string(col) + "+1");
+    }
+  }
+}
+
+// Loads cells one by one and as a batch
+void BenchBulkLoad(BenchReport& report) {
+  const int rows = 16000;
+  const int cols = 20;
+  {
+    Sheet sheet;
+    Samples samples;
+    std::size_t allocations = 0;
+    for (int row = 0; row < rows; ++row) {
+      for (int col = 0; col < cols; ++col) {
+        const std::string text = std::to_string(row + col);
+        const std::size_t before = GetAllocationCount();
+        samples.Measure([&] { sheet.SetCell(Position{ row, col }, text); });
+        allocations += GetAllocationCount() - before;
+      }
+    }
+    report.Add("numbers", samples,
+               { { "allocations_per_cell",
+                   static_cast<double>(allocations) / (rows * cols) } });
+  }
+  {
+    Sheet sheet;
+    Samples samples;
+    for (int row = 0; row < rows; ++row) {
+      sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+    }
+    std::size_t allocations = 0;
+    for (int row = 0; row < rows; ++row) {
+      const std::string leaf = Position{ row, 0 }.ToString();
+      for (int col = 1; col < cols; ++col) {
+        const std::string text = "=" + leaf + "*" + std::to_string(col) + "+1";
+        const std::size_t before = GetAllocationCount();
+        samples.Measure([&] { sheet.SetCell(Position{ row, col }, text); });
+        allocations += GetAllocationCount() - before;
+      }
+    }
+    // Every column holds copies of one formula
+    report.Add("formulas", samples,
+               { { "formula_shapes", static_cast<double>(
+                     sheet.GetFormulaTable().GetShapeCount()) },
+                 { "allocations_per_cell",
+                   static_cast<double>(allocations) / (rows * (cols - 1)) } });
+  }
+
+  // A chain loaded from its end: every new cell is referenced
+  // by the whole chain loaded before it. Loading it cell by cell
+  // is quadratic, keep it short
+  const int chain = 5000;
+  std::vector<std::pair<Position, std::string>> texts;
+  texts.reserve(chain);
+  for (int i = chain - 1; i > 0; --i) {
+    texts.emplace_back(NthCell(i), "=" + NthCell(i - 1).ToString() + "+1");
+  }
+  texts.emplace_back(NthCell(0), "1");
+  {
+    Sheet sheet;
+    Samples samples;
+    for (const auto& [pos, text] : texts) {
+      samples.Measure([&] { sheet.SetCell(pos, text); });
+    }
+    report.Add("reverse_chain_set_cell", samples);
+  }
+  {
+    Sheet sheet;
+    Samples samples;
+    samples.Measure([&] { sheet.SetCells(texts); }, chain);
+    report.Add("reverse_chain_set_cells", samples);
+  }
+}
+
+// Parses formulas of different shapes without putting them into a sheet
+void BenchFormulaParse(BenchReport& report) {
+  const int parses = 100000;
+  std::string references = "A1";
+  for (int row = 2; row <= 20; ++row) {
+    references += "+" + Position{ row - 1, row % 5 }.ToString();
+  }
+  const std::pair<std::string, std::string> formulas[] = {
+    { "single_reference", "A1+1" },
+    { "arithmetic", "1+2*3-4/5+(6-7)*8" },
+    { "twenty_references", references },
+  };
+  for (const auto& [name, expression] : formulas) {
+    Samples samples;
+    for (int i = 0; i < parses; ++i) {
+      samples.Measure([&] {
+        sink = sink + ParseFormula(expression)->GetReferencedCells().size();
+      });
+    }
+    report.Add(name, samples);
+
+    // The syntax trees alone, built by the hand-written parser
+    // and by the one ANTLR generates from the grammar
+    Samples ast;
+    Samples antlr_ast;
+    for (int i = 0; i < parses; ++i) {
+      ast.Measure([&] {
+        sink = sink + ParseFormulaAST(std::string_view(expression))
+                          .GetCells().empty();
+      });
+      antlr_ast.Measure([&] {
+        std::istringstream in(expression);
+        sink = sink + ParseFormulaASTWithAntlr(in).GetCells().empty();
+      });
+    }
+    report.Add(name + "_ast", ast);
+    report.Add(name + "_antlr_ast", antlr_ast);
+  }
+}
+
+// Keeps the syntax trees of many formulas alive and reports
+// how much memory a formula of each shape takes
+void BenchFormulaMemory(BenchReport& report) {
+  const int formulas = 100000;
+  const std::pair<std::string, std::string> shapes[] = {
+    { "single_reference", "A1+1" },
+    { "arithmetic", "1+2*3-4/5+(6-7)*8" },
+    { "row_product", "(A1*B1+C1)/-D1" },
+  };
+  for (const auto& [name, expression] : shapes) {
+    std::vector<FormulaAST> asts;
+    asts.reserve(formulas);
+    Samples samples;
+    std::size_t memory = 0;
+    for (int i = 0; i < formulas; ++i) {
+      samples.Measure([&] {
+        asts.push_back(ParseFormulaAST(std::string_view(expression)));
+      });
+      memory += asts.back().GetMemoryUsage();
+    }
+    report.Add(name, samples,
+               { { "heap_bytes_per_formula",
+                   static_cast<double>(memory) / formulas } });
+  }
+}
+
+// Fills sheets of a million cells and reports the memory a cell takes
+// with its storage, its contents and its edges
+void BenchSheetMemory(BenchReport& report) {
+  const int rows = 16000;
+  const int cols = 64;
+  const double cells = static_cast<double>(rows) * cols;
+  const std::pair<std::string, std::function<std::string(int, int)>>
+      layouts[] = {
+    { "numbers", [](int row, int col) { return std::to_string(row + col); } },
+    // Numbers in the first column, formulas over their row in the others
+    { "row_formulas", [](int row, int col) {
+        return col == 0 ? std::to_string(row)
+                        : "=" + Position{ row, 0 }.ToString() + "*"
+                              + std::to_string(col) + "+1";
+      } },
+  };
+  for (const auto& [name, text_of] : layouts) {
+    Sheet sheet;
+    Samples samples;
+    for (int row = 0; row < rows; ++row) {
+      for (int col = 0; col < cols; ++col) {
+        const std::string text = text_of(row, col);
+        samples.Measure([&] { sheet.SetCell(Position{ row, col }, text); });
+      }
+    }
+    report.Add(name, samples,
+               { { "bytes_per_cell", sheet.GetMemoryUsage() / cells },
+                 { "cell_object_bytes", static_cast<double>(sizeof(Cell)) } });
+  }
+}
+
+// Fills sheets of a million cells with a few repeated labels, with the
+// texts kept by the cells and interned by the sheet, and reports the
+// memory a cell and its text take, the load and print throughput and
+// a scan comparing every text with one label
+void BenchTextInterning(BenchReport& report) {
+  const int rows = 16000;
+  const int cols = 64;
+  const double cells = static_cast<double>(rows) * cols;
+  const std::pair<std::string, std::vector<std::string>> label_sets[] = {
+    { "short_labels", { "USD", "EUR", "GBP", "JPY", "N/A", "-" } },
+    { "long_labels", { "Settled by bank transfer", "Awaiting confirmation",
+                       "Cancelled by the customer", "Refunded in full" } },
+  };
+  for (const auto& [labels_name, labels] : label_sets) {
+    for (const bool interning : { false, true }) {
+      const std::string name =
+          labels_name + (interning ? "_interned" : "_plain");
+      Sheet sheet;
+      sheet.SetTextInterning(interning);
+      Samples load;
+      for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+          const std::string& text = labels[(row * 7 + col) % labels.size()];
+          load.Measure([&] { sheet.SetCell(Position{ row, col }, text); });
+        }
+      }
+      // The texts alone: the contents of the cells, their heap memory
+      // and the text table, without the cell objects and their storage
+      std::size_t content_bytes = sheet.GetAllocator().GetMemoryUsage()
+                                  + sheet.GetTextTable().GetMemoryUsage();
+      for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+          content_bytes +=
+              sheet.GetConcreteCell(Position{ row, col })->GetMemoryUsage();
+        }
+      }
+      report.Add(name + "_load", load,
+                 { { "bytes_per_cell", sheet.GetMemoryUsage() / cells },
+                   { "text_bytes_per_cell", content_bytes / cells } });
+
+      Samples print;
+      Samples compare;
+      for (int round = 0; round < 3; ++round) {
+        std::ostringstream output;
+        print.Measure([&] { sheet.PrintTexts(output); }, rows * cols);
+        sink = sink + output.str().size();
+        compare.Measure([&] {
+          std::size_t equal = 0;
+          for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+              equal += sheet.GetConcreteCell(Position{ row, col })
+                           ->GetTextView() == labels.front();
+            }
+          }
+          sink = sink + equal;
+        }, rows * cols);
+      }
+      report.Add(name + "_print_texts", print);
+      report.Add(name + "_compare", compare);
+    }
+  }
+}
+
+// Fills temporary areas with formulas and clears them again, moving over
+// the sheet. Every cycle is a SetCell and a ClearCell; the formulas
+// reference cells outside the area and aggregate ranges, so clearing them
+// has to drop their edges, the cells created for the references and the
+// ranges. The memory of the sheet after the first and the last round
+// shows whether anything is left behind
+void BenchSheetChurn(BenchReport& report) {
+  const int rows = 64;
+  const int cols = 16;
+  const int rounds = 2000;
+  for (auto make_storage : { CreateHashCellStorage, CreateTiledCellStorage }) {
+    Sheet sheet(make_storage());
+    Samples samples;
+    double first_round_bytes = 0.0;
+    double first_round_rss_kb = 0.0;
+    for (int round = 0; round < rounds; ++round) {
+      const Position corner{ (round * rows) % (Position::MAX_ROWS - rows),
+                             (round % 8) * cols };
+      samples.Measure([&] {
+        for (int row = 0; row < rows; ++row) {
+          for (int col = 0; col < cols; ++col) {
+            const Position pos{ corner.row + row, corner.col + col };
+            const Position referenced{ pos.row, pos.col + 2 * cols };
+            sheet.SetCell(pos, "=" + referenced.ToString() + "+SUM("
+                                   + referenced.ToString() + ":"
+                                   + Position{ pos.row + 1, referenced.col }
+                                         .ToString() + ")");
+          }
+        }
+        for (int row = 0; row < rows; ++row) {
+          for (int col = 0; col < cols; ++col) {
+            sheet.ClearCell({ corner.row + row, corner.col + col });
+          }
+        }
+      }, rows * cols);
+      if (round == 0) {
+        first_round_bytes = static_cast<double>(sheet.GetMemoryUsage());
+        first_round_rss_kb = static_cast<double>(PeakRssKb());
+      }
+    }
+    const double last_round_bytes =
+        static_cast<double>(sheet.GetMemoryUsage());
+    sheet.ShrinkToFit();
+    report.Add(make_storage == CreateHashCellStorage ? "hash_storage"
+                                                     : "tiled_storage",
+               samples,
+               { { "first_round_bytes", first_round_bytes },
+                 { "last_round_bytes", last_round_bytes },
+                 { "shrunk_bytes",
+                   static_cast<double>(sheet.GetMemoryUsage()) },
+                 { "first_round_rss_kb", first_round_rss_kb } });
+  }
+}
+
+// Evaluates parsed formulas directly, without the cell cache in between
+void BenchFormulaEvaluation(BenchReport& report) {
+  const int batches = 1000;
+  const int batch = 1000;
+  auto sheet = CreateSheet();
+  sheet->SetCell(Position::FromString("A1"), "=1.5");
+  sheet->SetCell(Position::FromString("B1"), "=2.5");
+  sheet->SetCell(Position::FromString("C1"), "=-3");
+  sheet->SetCell(Position::FromString("D1"), "=4");
+  // Text cells holding numbers, the way sheets imported from CSV look
+  sheet->SetCell(Position::FromString("A2"), "123.25");
+  sheet->SetCell(Position::FromString("B2"), "-7");
+  sheet->SetCell(Position::FromString("C2"), "1e3");
+  sheet->SetCell(Position::FromString("D2"), "'42");
+  const std::pair<std::string, std::string> formulas[] = {
+    { "constants", "1+2*3-4/5+(6-7)*8" },
+    { "references", "(A1+B1)*(C1-2)/4+-D1" },
+    { "products", "A1*A1+B1*B1+C1*C1+D1*D1-A1*B1*C1*D1" },
+    { "text_operands", "A2+B2*C2-D2" },
+  };
+  for (const auto& [name, expression] : formulas) {
+    const auto formula = ParseFormula(expression);
+    Samples samples;
+    for (int i = 0; i < batches; ++i) {
+      samples.Measure([&] {
+        for (int j = 0; j < batch; ++j) { Consume(formula->Evaluate(*sheet)); }
+      }, batch);
+    }
+    report.Add(name, samples);
+  }
+}
+
+// Aggregates a column of numbers: the functions over a range, which
+// read the column straight from the storage, against the same sum spelled
+// as a reference per cell. Throughput is in cells read per second
+void BenchAggregates(BenchReport& report) {
+  const int rows = 10000;
+  const int evaluations = 200;
+  auto sheet = CreateSheet();
+  std::string references;
+  for (int row = 0; row < rows; ++row) {
+    const Position pos{ row, 0 };
+    sheet->SetCell(pos, std::to_string(row % 97));
+    if (row != 0) { references += '+'; }
+    references += pos.ToString();
+  }
+  const std::string range = "A1:" + Position{ rows - 1, 0 }.ToString();
+  const std::pair<std::string, std::string> formulas[] = {
+    { "sum_range", "SUM(" + range + ")" },
+    { "min_range", "MIN(" + range + ")" },
+    { "average_range", "AVERAGE(" + range + ")" },
+    { "sum_of_references", references },
+  };
+  for (const auto& [name, expression] : formulas) {
+    const auto formula = ParseFormula(expression);
+    Samples samples;
+    for (int i = 0; i < evaluations; ++i) {
+      samples.Measure([&] { Consume(formula->Evaluate(*sheet)); }, rows);
+    }
+    report.Add(name, samples);
+  }
+}
+
+// Loads many formulas over long overlapping ranges of a sparse column,
+// then edits cells inside the ranges: the edit finds the formulas
+// through the range index, the ranges create no cells and no edges
+void BenchRangeDependencies(BenchReport& report) {
+  const int rows = 16384;
+  const int formulas = 2000;
+  const int window = 8192;
+  const int edits = 200;
+  Sheet sheet;
+  for (int row = 0; row < rows; row += 16) {
+    sheet.SetCell(Position{ row, 0 }, std::to_string(row % 97));
+  }
+  Samples load;
+  for (int i = 0; i < formulas; ++i) {
+    const int first = i * (rows - window) / formulas;
+    const std::string range = Position{ first, 0 }.ToString() + ":"
+        + Position{ first + window - 1, 0 }.ToString();
+    const std::string text = "=SUM(" + range + ")";
+    load.Measure([&] { sheet.SetCell(Position{ i, 2 }, text); });
+  }
+  sheet.Recalculate();
+  report.Add("load_range_formulas", load,
+             { { "cells", static_cast<double>(
+                     sheet.GetRecalculationOrder().size()) } });
+
+  std::mt19937 generator(3);
+  std::uniform_int_distribution<int> row_dist(0, rows - 1);
+  Samples edit_inside;
+  Samples recalculate;
+  for (int i = 0; i < edits; ++i) {
+    const Position pos{ row_dist(generator), 0 };
+    edit_inside.Measure([&] { sheet.SetCell(pos, std::to_string(i)); });
+    recalculate.Measure([&] { sheet.Recalculate(); });
+  }
+  report.Add("edit_inside_ranges", edit_inside);
+  report.Add("recalculate_after_edit", recalculate);
+}
+
+// Reads the tail of a deep chain A1 <- A2 <- ... where every cell adds
+// one to the previous one: the first read evaluates the whole chain,
+// the following ones are served from the cache
+void BenchDeepChain(BenchReport& report) {
+  const int depth = 100000;
+  const int rounds = 10;
+  Sheet sheet;
+  sheet.SetCell(NthCell(0), "1");
+  for (int i = 1; i < depth; ++i) {
+    sheet.SetCell(NthCell(i), "=" + NthCell(i - 1).ToString() + "+1");
+  }
+  const Position tail = NthCell(depth - 1);
+
+  Samples first_read;
+  first_read.Measure([&] { Consume(sheet.GetCell(tail)->GetValue()); }, depth);
+  report.Add("first_read", first_read);
+
+  Samples cached_reads;
+  const int batch = 1000;
+  for (int i = 0; i < 100; ++i) {
+    cached_reads.Measure([&] {
+      for (int j = 0; j < batch; ++j) {
+        Consume(sheet.GetCell(tail)->GetValue());
+      }
+    }, batch);
+  }
+  report.Add("cached_read", cached_reads);
+
+  Samples edits;
+  for (int round = 0; round < rounds; ++round) {
+    edits.Measure([&] {
+      sheet.SetCell(NthCell(0), std::to_string(round));
+      sheet.Recalculate();
+    }, depth);
+  }
+  report.Add("edit_root_and_recalculate", edits);
+}
+
+// Edits the cell every other formula of the sheet references:
+// each edit invalidates the cached values of all of them
+void BenchFanOutInvalidation(BenchReport& report) {
+  const int cells = 100000;
+  const int rounds = 20;
+  Sheet sheet;
+  sheet.SetCell(NthCell(0), "1");
+  for (int i = 1; i < cells; ++i) { sheet.SetCell(NthCell(i), "=A1*2"); }
+  sheet.Recalculate();
+
+  Samples edits;
+  Samples recalculations;
+  for (int round = 0; round < rounds; ++round) {
+    edits.Measure([&] { sheet.SetCell(NthCell(0), std::to_string(round)); });
+    recalculations.Measure([&] { sheet.Recalculate(); }, cells);
+  }
+  report.Add("edit_root", edits);
+  report.Add("recalculate", recalculations);
+}
+
+// Loads a dependency graph of the given shape, then recalculates it
+// from scratch and after an edit of a cell
+void ReportRecalculation(BenchReport& report, const std::string& shape,
+                         int cells, int edited,
+                         const std::function<std::string(int)>& text_of) {
+  const int rounds = 5;
+  Sheet sheet;
+  for (int i = 0; i < cells; ++i) { sheet.SetCell(NthCell(i), text_of(i)); }
+  Samples full;
+  full.Measure([&] { sheet.Recalculate(); }, cells);
+  report.Add(shape + "_full", full);
+
+  Samples after_edit;
+  for (int round = 0; round < rounds; ++round) {
+    sheet.SetCell(NthCell(edited), std::to_string(round + 2));
+    after_edit.Measure([&] { sheet.Recalculate(); });
+  }
+  report.Add(shape + "_after_edit", after_edit);
+}
+
+void BenchRecalculation(BenchReport& report) {
+  const int cells = 100000;
+  // A1 <- A2 <- ... every cell references the previous one
+  ReportRecalculation(report, "chain", cells, 0, [](int i) {
+    return i == 0 ? "1"s : "=" + NthCell(i - 1).ToString() + "+1";
+  });
+  // Every cell references A1
+  ReportRecalculation(report, "fan_out", cells, 0, [](int i) {
+    return i == 0 ? "1"s : "=A1*2"s;
+  });
+  // Reduction tree: every inner cell sums up the ten cells below it
+  const int fan_in = 10;
+  ReportRecalculation(report, "fan_in", cells, cells - 1, [&](int i) {
+    if (i * fan_in + 1 >= cells) { return "1"s; }
+    std::string formula = "=0";
+    for (int j = i * fan_in + 1; j <= i * fan_in + fan_in && j < cells; ++j) {
+      formula += "+" + NthCell(j).ToString();
+    }
+    return formula;
+  });
+  // Rows of a number and a formula doubling it, the edit reaches one row
+  ReportRecalculation(report, "rows", cells, cells - 2, [](int i) {
+    return i % 2 == 0 ? std::to_string(i)
+                      : "=" + NthCell(i - 1).ToString() + "*2";
+  });
+}
+
+// Recalculates a block of independent formulas with 1 to N threads
+void BenchParallelRecalculation(BenchReport& report) {
+  const int rows = Position::MAX_ROWS;
+  const int cols = 32;
+  const int rounds = 3;
+  Sheet sheet;
+  LoadBlock(sheet, rows, cols);
+  const int formulas = rows * (cols - 1);
+  const std::size_t max_threads =
+      std::max(1u, std::thread::hardware_concurrency());
+  for (std::size_t threads = 1; threads <= max_threads; threads *= 2) {
+    sheet.SetRecalculationThreads(threads);
+    Samples samples;
+    for (int round = 0; round < rounds; ++round) {
+      // Touch every leaf so that all the formulas become dirty
+      for (int row = 0; row < rows; ++row) {
+        sheet.SetCell(Position{ row, 0 }, std::to_string(row + round));
+      }
+      samples.Measure([&] { sheet.Recalculate(); }, formulas);
+    }
+    report.Add("threads_" + std::to_string(threads), samples);
+  }
+}
+
+// Recalculates a sheet where an error in one cell
+// spreads to every formula that depends on it
+void BenchErrorPropagation(BenchReport& report) {
+  const int cells = 100000;
+  const int rounds = 5;
+  Sheet sheet;
+  sheet.SetCell(NthCell(0), "=1/0");
+  sheet.SetCell(NthCell(1), "not a number");
+  for (int i = 2; i < cells; ++i) {
+    // Half of the dependents reach the error through another dependent
+    sheet.SetCell(NthCell(i), i % 2 == 0
+                                  ? "=A1+" + NthCell(i - 1).ToString()
+                                  : "=A2*2");
+  }
+  sheet.Recalculate();
+  Samples samples;
+  for (int round = 0; round < rounds; ++round) {
+    sheet.SetCell(NthCell(0), round % 2 == 0 ? "=2/0" : "=1/0");
+    sheet.SetCell(NthCell(1), round % 2 == 0 ? "NaN" : "not a number");
+    samples.Measure([&] { sheet.Recalculate(); }, cells);
+  }
+  report.Add("recalculate", samples);
+}
+
+// Reads values at random positions of a large evaluated sheet,
+// a quarter of them outside of the populated block
+void BenchRandomReads(BenchReport& report) {
+  const int rows = 16000;
+  const int cols = 20;
+  const int batches = 2000;
+  const int batch = 256;
+  Sheet sheet;
+  LoadBlock(sheet, rows, cols);
+  sheet.Recalculate();
+
+  std::mt19937 generator(42);
+  std::uniform_int_distribution<int> row_dist(0, rows - 1);
+  std::uniform_int_distribution<int> col_dist(0, cols * 4 / 3);
+  std::vector<Position> positions(batch);
+  Samples samples;
+  for (int i = 0; i < batches; ++i) {
+    for (Position& pos : positions) {
+      pos = { row_dist(generator), col_dist(generator) };
+    }
+    samples.Measure([&] {
+      for (const Position pos : positions) {
+        if (const CellInterface* cell = sheet.GetCell(pos)) {
+          Consume(cell->GetValue());
+        }
+      }
+    }, batch);
+  }
+  report.Add("get_value", samples);
+}
+
+// Hasher the sheet storage used before PositionMap
+class StringPositionHasher {
+  public:
+  size_t operator()(const Position pos) const {
+    return std::hash<std::string>()(pos.ToString());
+  }
+};
+
+template <typename Map, typename Find>
+void ReportLookups(BenchReport& report, const std::string& name,
+                   const std::vector<Position>& keys,
+                   const Map& map, Find find) {
+  const std::size_t batch = 1000;
+  const int rounds = 10;
+  Samples samples;
+  for (int round = 0; round < rounds; ++round) {
+    for (std::size_t begin = 0; begin < keys.size(); begin += batch) {
+      const std::size_t end = std::min(keys.size(), begin + batch);
+      samples.Measure([&] {
+        std::size_t found = 0;
+        for (std::size_t i = begin; i < end; ++i) {
+          found += find(map, keys[i]);
+        }
+        sink = sink + found;
+      }, end - begin);
+    }
+  }
+  report.Add(name, samples);
+}
+
+// Compares lookup throughput of the sheet cell storage with
+// std::unordered_map keyed the way the sheet used to key it
+void BenchCellStorageLookup(BenchReport& report) {
+  const int cells = 200000;
+  Sheet sheet;
+  std::mt19937 generator(42);
+  std::uniform_int_distribution<int> row_dist(0, Position::MAX_ROWS - 1);
+  std::uniform_int_distribution<int> col_dist(0, 63);
+
+  std::unordered_map<Position, std::unique_ptr<Cell>,
+                     StringPositionHasher> string_keyed;
+  std::unordered_map<Position, std::unique_ptr<Cell>,
+                     PositionHasher> int_keyed;
+  PositionMap<std::unique_ptr<Cell>> packed;
+
+  std::vector<Position> keys;
+  keys.reserve(cells);
+  for (int i = 0; i < cells; ++i) {
+    const Position pos{ row_dist(generator), col_dist(generator) };
+    keys.push_back(pos);
+    string_keyed[pos] = std::make_unique<Cell>(sheet, pos);
+    int_keyed[pos] = std::make_unique<Cell>(sheet, pos);
+    packed[pos] = std::make_unique<Cell>(sheet, pos);
+  }
+  // Mix hits with misses the way print loops and formulas probe the sheet
+  for (int i = 0; i < cells; ++i) {
+    keys.push_back({ row_dist(generator), col_dist(generator) });
+  }
+  std::shuffle(keys.begin(), keys.end(), generator);
+
+  const auto find_std = [](const auto& map, Position pos) {
+    return map.find(pos) != map.end();
+  };
+  ReportLookups(report, "unordered_map_string_hash", keys, string_keyed,
+                find_std);
+  ReportLookups(report, "unordered_map_position_hasher", keys, int_keyed,
+                find_std);
+  ReportLookups(report, "position_map", keys, packed,
+                [](const auto& map, Position pos) {
+                  return map.Find(pos) != nullptr;
+                });
+}
+
+// Prints values and texts of a large evaluated sheet
+// with each of the storage backends, and of a sparse sheet
+// with a few cells scattered over a large area. The printable size
+// is asked for on its own as well
+void BenchPrintLargeSheet(BenchReport& report) {
+  const int rows = 16000;
+  const int cols = 20;
+  const int rounds = 5;
+  const auto run = [&](const std::string& name,
+                       std::unique_ptr<CellStorage> storage) {
+    auto sheet = CreateSheet(std::move(storage));
+    LoadBlock(*sheet, rows, cols);
+    Samples values;
+    Samples texts;
+    Samples sizes;
+    for (int round = 0; round < rounds; ++round) {
+      sizes.Measure([&] {
+        for (int i = 0; i < 1000; ++i) {
+          sink = sink + sheet->GetPrintableSize().rows;
+        }
+      }, 1000);
+      std::ostringstream output;
+      values.Measure([&] { sheet->PrintValues(output); }, rows * cols);
+      output.str({});
+      texts.Measure([&] { sheet->PrintTexts(output); }, rows * cols);
+      sink = sink + output.str().size();
+    }
+    report.Add(name + "_values", values);
+    report.Add(name + "_texts", texts);
+    report.Add(name + "_size", sizes);
+  };
+  run("hash_storage", CreateHashCellStorage());
+  run("tiled_storage", CreateTiledCellStorage());
+
+  const int sparse_cells = 1000;
+  Sheet sparse;
+  std::mt19937 generator(42);
+  std::uniform_int_distribution<int> row_of(0, rows - 1);
+  std::uniform_int_distribution<int> col_of(0, 999);
+  for (int i = 0; i < sparse_cells; ++i) {
+    sparse.SetCell(Position{ row_of(generator), col_of(generator) },
+                   i % 2 == 0 ? "=" + std::to_string(i) + "/7" : "text");
+  }
+  Samples values;
+  Samples texts;
+  for (int round = 0; round < rounds; ++round) {
+    std::ostringstream output;
+    values.Measure([&] { sparse.PrintValues(output); }, sparse_cells);
+    output.str({});
+    texts.Measure([&] { sparse.PrintTexts(output); }, sparse_cells);
+    sink = sink + output.str().size();
+  }
+  report.Add("sparse_values", values);
+  report.Add("sparse_texts", texts);
+}
+
+// Scans the values of whole columns: cell by cell through GetValue,
+// which copies every text, and through GetValueView, which does not,
+// and as the columnar arrays of the sheet,
+// both when they are cached and right after an edit, which only
+// the edited cell and the formula over it are read again for
+void BenchColumnScan(BenchReport& report) {
+  const int rows = 16000;
+  const int rounds = 20;
+  const std::string words[] = { "north", "south", "east", "west",
+                                "a label longer than the inline buffer" };
+  Sheet sheet;
+  for (int row = 0; row < rows; ++row) {
+    sheet.SetCell(Position{ row, 0 }, std::to_string(row % 100));
+    sheet.SetCell(Position{ row, 1 }, words[row % 5]);
+    sheet.SetCell(Position{ row, 2 },
+                  "=" + Position{ row, 0 }.ToString() + "*2");
+  }
+  sheet.Recalculate();
+
+  Samples cells;
+  Samples cell_views;
+  Samples columns;
+  Samples columns_after_edit;
+  for (int round = 0; round < rounds; ++round) {
+    cells.Measure([&] {
+      for (int col = 0; col < 3; ++col) {
+        for (int row = 0; row < rows; ++row) {
+          const auto value = sheet.GetCell(Position{ row, col })->GetValue();
+          if (const auto* text = std::get_if<std::string>(&value)) {
+            sink = sink + text->size();
+          }
+          else if (const double* number = std::get_if<double>(&value)) {
+            sink = sink + *number;
+          }
+        }
+      }
+    }, rows * 3);
+    cell_views.Measure([&] {
+      for (int col = 0; col < 3; ++col) {
+        for (int row = 0; row < rows; ++row) {
+          const auto value =
+              sheet.GetCell(Position{ row, col })->GetValueView();
+          if (const auto* text = std::get_if<std::string_view>(&value)) {
+            sink = sink + text->size();
+          }
+          else if (const double* number = std::get_if<double>(&value)) {
+            sink = sink + *number;
+          }
+        }
+      }
+    }, rows * 3);
+    const auto scan = [&] {
+      for (int col = 0; col < 3; ++col) {
+        const ColumnValues values = sheet.GetColumnValues(col, 0, rows);
+        for (std::size_t row = 0; row < values.size(); ++row) {
+          if (values.types[row] == ValueType::Text) {
+            sink = sink + values.GetText(row).size();
+          }
+          else { sink = sink + values.numbers[row]; }
+        }
+      }
+    };
+    columns.Measure(scan, rows * 3);
+    sheet.SetCell(Position{ round, 0 }, std::to_string(round));
+    sheet.Recalculate();
+    columns_after_edit.Measure(scan, rows * 3);
+  }
+  report.Add("get_value_per_cell", cells);
+  report.Add("get_value_view_per_cell", cell_views);
+  report.Add("column_values_cached", columns);
+  report.Add("column_values_after_edit", columns_after_edit);
+}
+
+// Tries to close a cycle in large dependency graphs: every attempt
+// has to search the cells depending on the edited one
+void BenchCycleDetection(BenchReport& report) {
+  const int cells = 100000;
+  const int rounds = 20;
+  const auto run = [&](const std::string& name,
+                       const std::function<std::string(int)>& text_of) {
+    Sheet sheet;
+    for (int i = 0; i < cells; ++i) { sheet.SetCell(NthCell(i), text_of(i)); }
+    // Every cell reaches the first one through its references,
+    // so the first cell referencing the last one closes a cycle
+    const std::string closing = "=" + NthCell(cells - 1).ToString() + "+1";
+    Samples samples;
+    for (int round = 0; round < rounds; ++round) {
+      samples.Measure([&] {
+        try {
+          sheet.SetCell(NthCell(0), closing);
+          throw std::runtime_error("cycle is not detected");
+        }
+        catch (const CircularDependencyException&) {
+        }
+      });
+    }
+    report.Add(name, samples);
+  };
+  run("chain", [](int i) {
+    return i == 0 ? "1"s : "=" + NthCell(i - 1).ToString() + "+1";
+  });
+  // Every cell references two random cells loaded before it
+  std::mt19937 generator(42);
+  run("random_dag", [&](int i) {
+    if (i == 0) { return "1"s; }
+    std::uniform_int_distribution<int> earlier(0, i - 1);
+    return "=" + NthCell(earlier(generator)).ToString()
+        + "+" + NthCell(earlier(generator)).ToString();
+  });
+}
+
+// Inserts a million edges of a random DAG in random order, so that
+// most of them disagree with the topological order built so far
+void BenchEdgeInsertion(BenchReport& report) {
+  const int cells = 100000;
+  const int references = 10;
+  const int batch = 1000;
+  std::mt19937 generator(42);
+  // The DAG is acyclic in the order of ranks: a cell references
+  // only cells of lower ranks
+  std::vector<int> cell_of_rank(cells);
+  std::iota(cell_of_rank.begin(), cell_of_rank.end(), 0);
+  std::shuffle(cell_of_rank.begin(), cell_of_rank.end(), generator);
+  std::vector<std::pair<Position, std::string>> texts;
+  texts.reserve(cells);
+  texts.emplace_back(NthCell(cell_of_rank[0]), "1");
+  for (int rank = 1; rank < cells; ++rank) {
+    std::uniform_int_distribution<int> lower_rank(0, rank - 1);
+    std::string text = "=0";
+    for (int i = 0; i < references; ++i) {
+      text += "+" + NthCell(cell_of_rank[lower_rank(generator)]).ToString();
+    }
+    texts.emplace_back(NthCell(cell_of_rank[rank]), std::move(text));
+  }
+  std::shuffle(texts.begin(), texts.end(), generator);
+
+  Sheet sheet;
+  Samples samples;
+  for (auto begin = texts.begin(); begin != texts.end();) {
+    const auto end = begin + std::min<std::ptrdiff_t>(batch, texts.end() - begin);
+    std::vector<std::pair<Position, std::string>> cells_batch(begin, end);
+    samples.Measure([&] { sheet.SetCells(std::move(cells_batch)); },
+                    (end - begin) * references);
+    begin = end;
+  }
+  // A batch of that many cells carries about ten thousand edges against
+  // the order, far past the incremental limit: it measures the pass
+  // over the whole graph
+  report.Add("random_order_1m_edges", samples);
+
+  // Cell by cell every edge against the order goes through the
+  // incremental reordering on its own
+  Sheet one_by_one;
+  Samples set_cell;
+  for (const auto& [pos, text] : texts) {
+    set_cell.Measure([&] { one_by_one.SetCell(pos, text); }, references);
+  }
+  report.Add("random_order_1m_edges_set_cell", set_cell);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  BenchRunner br(argc, argv);
+  RUN_BENCH(br, BenchBulkLoad);
+  RUN_BENCH(br, BenchFormulaParse);
+  RUN_BENCH(br, BenchFormulaMemory);
+  RUN_BENCH(br, BenchSheetMemory);
+  RUN_BENCH(br, BenchSheetChurn);
+  RUN_BENCH(br, BenchTextInterning);
+  RUN_BENCH(br, BenchFormulaEvaluation);
+  RUN_BENCH(br, BenchAggregates);
+  RUN_BENCH(br, BenchRangeDependencies);
+  RUN_BENCH(br, BenchDeepChain);
+  RUN_BENCH(br, BenchFanOutInvalidation);
+  RUN_BENCH(br, BenchRecalculation);
+  RUN_BENCH(br, BenchParallelRecalculation);
+  RUN_BENCH(br, BenchErrorPropagation);
+  RUN_BENCH(br, BenchRandomReads);
+  RUN_BENCH(br, BenchCellStorageLookup);
+  RUN_BENCH(br, BenchPrintLargeSheet);
+  RUN_BENCH(br, BenchColumnScan);
+  RUN_BENCH(br, BenchCycleDetection);
+  RUN_BENCH(br, BenchEdgeInsertion);
+  return 0;
+}
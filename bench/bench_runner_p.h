@@ -0,0 +1,167 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace BenchRunnerPrivate {
+
+using Clock = std::chrono::steady_clock;
+
+}  // namespace BenchRunnerPrivate
+
+// Measures the wall time of a callable in nanoseconds
+template <class Func>
+long long MeasureNs(Func func) {
+  const auto start = BenchRunnerPrivate::Clock::now();
+  func();
+  const auto finish = BenchRunnerPrivate::Clock::now();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      finish - start).count();
+}
+
+// Peak resident set size of the process so far, in kilobytes
+inline long long PeakRssKb() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+    return 0;
+  }
+  return static_cast<long long>(counters.PeakWorkingSetSize / 1024);
+#else
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// Latencies of the operations of one benchmark case.
+// A sample may cover a batch of operations that are too short
+// to be timed one by one, it then counts as ops operations
+// of the average latency
+class Samples {
+  public:
+  void Add(long long ns, std::size_t ops = 1) {
+    latencies_.push_back(static_cast<double>(ns) / ops);
+    total_ns_ += ns;
+    total_ops_ += ops;
+  }
+
+  template <class Func>
+  void Measure(Func func, std::size_t ops = 1) { Add(MeasureNs(func), ops); }
+
+  bool Empty() const { return latencies_.empty(); }
+
+  std::size_t GetOps() const { return total_ops_; }
+
+  double GetThroughput() const {
+    return total_ns_ > 0 ? total_ops_ * 1e9 / total_ns_ : 0.0;
+  }
+
+  // Latency below which the given share of the samples falls
+  double GetPercentile(double share) const {
+    if (latencies_.empty()) { return 0.0; }
+    std::vector<double> sorted = latencies_;
+    const auto rank = static_cast<std::size_t>(share * (sorted.size() - 1));
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return sorted[rank];
+  }
+
+  private:
+  std::vector<double> latencies_;
+  long long total_ns_ = 0;
+  std::size_t total_ops_ = 0;
+};
+
+// Writes the results of the cases of one benchmark as JSON lines
+class BenchReport {
+  public:
+  explicit BenchReport(std::string bench_name)
+    : bench_name_(std::move(bench_name)) {
+  }
+
+  // Metrics are extra named numbers the case reports, such as sizes
+  void Add(const std::string& case_name, const Samples& samples,
+           const std::vector<std::pair<std::string, double>>& metrics = {}) {
+    std::cout << "{\"bench\":\"" << bench_name_
+              << "\",\"case\":\"" << case_name
+              << "\",\"ops\":" << samples.GetOps()
+              << ",\"throughput_ops_per_s\":" << samples.GetThroughput()
+              << ",\"p50_ns\":" << samples.GetPercentile(0.5)
+              << ",\"p90_ns\":" << samples.GetPercentile(0.9)
+              << ",\"p99_ns\":" << samples.GetPercentile(0.99)
+              << ",\"max_ns\":" << samples.GetPercentile(1.0);
+    for (const auto& [name, value] : metrics) {
+      std::cout << ",\"" << name << "\":" << value;
+    }
+    std::cout << ",\"peak_rss_kb\":" << PeakRssKb() << "}" << std::endl;
+  }
+
+  private:
+  std::string bench_name_;
+};
+
+// Runs the benchmarks whose names contain any of the command line
+// arguments, or all of them if there are none
+class BenchRunner {
+  public:
+  BenchRunner(int argc, char** argv) : filters_(argv + 1, argv + argc) {}
+
+  template <class BenchFunc>
+  void RunBench(BenchFunc func, const std::string& bench_name) {
+    if (!filters_.empty()
+        && std::none_of(filters_.begin(), filters_.end(),
+                        [&](const std::string& filter) {
+                          return bench_name.find(filter) != std::string::npos;
+                        })) {
+      return;
+    }
+    try {
+      std::cerr << bench_name << "..." << std::endl;
+      BenchReport report(bench_name);
+      func(report);
+    }
+    catch (std::exception& e) {
+      ++fail_count;
+      std::cerr << bench_name << " fail: " << e.what() << std::endl;
+    }
+    catch (...) {
+      ++fail_count;
+      std::cerr << "Unknown exception caught" << std::endl;
+    }
+  }
+
+  ~BenchRunner() {
+    std::cerr.flush();
+    if (fail_count > 0) {
+      std::cerr << fail_count << " benchmarks failed. Terminate" << std::endl;
+      exit(1);
+    }
+  }
+
+  private:
+
+  std::vector<std::string> filters_;
+  int fail_count = 0;
+};
+
+#define RUN_BENCH(br, func) br.RunBench(func, #func)
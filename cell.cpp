@@ -1,57 +1,164 @@
 #include "cell.h"
 #include "sheet.h"
 
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <new>
+
+namespace {
+
+// Destroys an object made in the allocator and gives its memory back
+template <typename T>
+void DestroyIn(SlabAllocator& allocator, T* object) {
+  object->~T();
+  allocator.Deallocate(object, sizeof(T));
+}
+
+// Bytes of heap memory the string holds; short texts live inside the object
+std::size_t GetStringMemoryUsage(const std::string& text) {
+  const char* object = reinterpret_cast<const char*>(&text);
+  const bool is_inline = text.data() >= object
+                         && text.data() < object + sizeof(text);
+  return is_inline ? 0 : text.capacity() + 1;
+}
+
+}  // namespace
+
 class Cell::Impl {
   public:
 
   virtual ~Impl() = default;
-  virtual Value GetValue() const = 0;
-  virtual std::string GetText() const = 0;
+  virtual ValueView GetValueView() const = 0;
+  virtual std::string_view GetTextView() const = 0;
+  virtual bool HasText() const { return true; }
+  virtual NumericValue GetNumericValue() const = 0;
   virtual std::vector<Position> GetReferencedCells() const { return {}; }
+  virtual const std::vector<Range>& GetReferencedRanges() const {
+    static const std::vector<Range> no_ranges;
+    return no_ranges;
+  }
+  // The value as aggregate functions read it from a range
+  virtual std::optional<NumericValue> GetRangeValue() const {
+    return GetNumericValue();
+  }
   virtual bool IsCacheValid() const { return true; }
-  virtual void InvalidateOneCellCache() {}
+  // Drops the cached value, returns false if there was none
+  virtual bool InvalidateOneCellCache() { return false; }
+  // Bytes of heap memory the implementation holds besides the object
+  virtual std::size_t GetMemoryUsage() const = 0;
+  // Destroys the object and gives its memory back
+  virtual void Destroy() = 0;
 };
 
 class Cell::EmptyImpl : public Impl {
   public:
-  Value GetValue() const override { return EMPTY_SIGN; }
-  std::string GetText() const override { return EMPTY_SIGN; }
+  ValueView GetValueView() const override { return std::string_view(); }
+  std::string_view GetTextView() const override { return {}; }
+  bool HasText() const override { return false; }
+  NumericValue GetNumericValue() const override { return 0.0; }
+  std::optional<NumericValue> GetRangeValue() const override {
+    return std::nullopt;
+  }
+  std::size_t GetMemoryUsage() const override { return 0; }
+  // The object is shared and lives as long as the program
+  void Destroy() override {}
 };
 
 class Cell::TextImpl : public Impl {
   public:
-  TextImpl(std::string text) : text_(std::move(text)) {}
+  TextImpl(std::string text, Sheet& sheet)
+    : text_(std::move(text)),
+      number_(ParseTextNumber(GetVisibleText(text_))),
+      sheet_(sheet) {
+  }
+
+  ValueView GetValueView() const override { return GetVisibleText(text_); }
+
+  std::string_view GetTextView() const override { return text_; }
 
-  Value GetValue() const override {
-      return text_[0] == ESCAPE_SIGN
-             ? text_.substr(1)
-             : text_;
+  bool HasText() const override { return !text_.empty(); }
+
+  NumericValue GetNumericValue() const override { return number_; }
+
+  // Aggregate functions skip texts that are not numbers
+  std::optional<NumericValue> GetRangeValue() const override {
+    if (std::holds_alternative<double>(number_)) { return number_; }
+    return std::nullopt;
   }
 
-  std::string GetText() const override { return text_; }
+  std::size_t GetMemoryUsage() const override {
+    return GetStringMemoryUsage(text_);
+  }
+
+  void Destroy() override { DestroyIn(sheet_.GetAllocator(), this); }
 
   private:
 
   std::string text_;
+  // The number the text is read as by formulas, parsed once
+  NumericValue number_;
+  // Whose allocator holds the object
+  Sheet& sheet_;
+};
+
+// A text kept once per sheet in its text table, the cell holds the id
+class Cell::InternedTextImpl : public Impl {
+  public:
+  InternedTextImpl(std::string_view text, Sheet& sheet)
+    : sheet_(sheet), id_(sheet.GetTextTable().Intern(text)) {
+  }
+
+  ~InternedTextImpl() { sheet_.GetTextTable().Release(id_); }
+
+  ValueView GetValueView() const override {
+    return GetVisibleText(GetTextView());
+  }
+
+  std::string_view GetTextView() const override {
+    return sheet_.GetTextTable().GetText(id_);
+  }
+
+  NumericValue GetNumericValue() const override {
+    return sheet_.GetTextTable().GetNumber(id_);
+  }
+
+  // Aggregate functions skip texts that are not numbers
+  std::optional<NumericValue> GetRangeValue() const override {
+    const NumericValue& number = sheet_.GetTextTable().GetNumber(id_);
+    if (std::holds_alternative<double>(number)) { return number; }
+    return std::nullopt;
+  }
+
+  // The text belongs to the table
+  std::size_t GetMemoryUsage() const override { return 0; }
+
+  void Destroy() override { DestroyIn(sheet_.GetAllocator(), this); }
+
+  private:
+
+  // Holds the text and the object
+  Sheet& sheet_;
+  std::uint32_t id_;
 };
 
 class Cell::FormulaImpl : public Impl {
   public:
 
-  explicit FormulaImpl(std::string expression, const SheetInterface& sheet)
+  explicit FormulaImpl(std::string expression, Position pos, Sheet& sheet)
     : sheet_(sheet) {
     expression.empty() || expression[0] != FORMULA_SIGN
     ? throw std::logic_error(EMPTY_SIGN)
-    : formula_ptr_ = ParseFormula(expression.substr(1));
+    : formula_ptr_ = sheet.GetFormulaTable().Parse(
+        std::string_view(expression).substr(1), pos);
+    referenced_ranges_ = formula_ptr_->GetReferencedRanges();
   }
 
-  Value GetValue() const override {
-    // If the value is not cached, evaluate the formula and cache the result
-    if (!cache_) { cache_ = formula_ptr_->Evaluate(sheet_); }
-    // Retrieve the value from the evaluated formula
-    auto value = formula_ptr_->Evaluate(sheet_);
-    // Check the type of the value and return accordingly,
-    //if the value is a double, return it
+  ValueView GetValueView() const override {
+    const auto value = GetNumericValue();
+    // Check the type of the cached value and return accordingly,
+    // if the value is a double, return it
     if (std::holds_alternative<double>(value)) {
         return std::get<double>(value);
     }
@@ -59,129 +166,612 @@ class Cell::FormulaImpl : public Impl {
     return std::get<FormulaError>(value);
   }
 
-  std::string GetText() const override {
-      return FORMULA_SIGN + formula_ptr_->GetExpression();
+  std::string_view GetTextView() const override {
+    // Printing the expression walks the whole tree, so it is done once,
+    // on the first request. Loading a sheet would take twice as long
+    // if it was done for every formula set; the once flag keeps
+    // readers of one cell on several threads from racing on the text
+    std::call_once(text_printed_, [this] {
+      text_ = FORMULA_SIGN + formula_ptr_->GetExpression();
+    });
+    return text_;
+  }
+
+  NumericValue GetNumericValue() const override {
+    // If the value is not cached, evaluate the formula and cache the result;
+    // the cache is dropped only by InvalidateIncomingCellsCache
+    if (!cache_) { cache_ = formula_ptr_->Evaluate(sheet_); }
+    return *cache_;
   }
 
   bool IsCacheValid() const override { return cache_.has_value(); }
 
-  void InvalidateOneCellCache() override { cache_.reset(); }
+  bool InvalidateOneCellCache() override {
+    const bool was_cached = cache_.has_value();
+    cache_.reset();
+    return was_cached;
+  }
 
   std::vector<Position> GetReferencedCells() const {
       return formula_ptr_->GetReferencedCells();
   }
 
+  const std::vector<Range>& GetReferencedRanges() const override {
+      return referenced_ranges_;
+  }
+
+  std::size_t GetMemoryUsage() const override {
+    return formula_ptr_->GetMemoryUsage()
+           + referenced_ranges_.capacity() * sizeof(Range)
+           + GetStringMemoryUsage(text_);
+  }
+
+  void Destroy() override { DestroyIn(sheet_.GetAllocator(), this); }
+
   private:
 
   std::unique_ptr<FormulaInterface> formula_ptr_;
-  const SheetInterface& sheet_;
+  // Kept at hand for the traversals of the dependency graph
+  std::vector<Range> referenced_ranges_;
+  // Evaluates the formula, and its allocator holds the object
+  Sheet& sheet_;
+  // Filled by at most one thread at a time: parallel recalculation hands
+  // every dirty cell to a single worker and publishes the results
+  // before the dependent cells are evaluated
   mutable std::optional<FormulaInterface::Value> cache_;
+  // The canonical text of the formula, empty until it is asked for
+  mutable std::string text_;
+  mutable std::once_flag text_printed_;
 };
 
-bool Cell::CheckForCircularDependencies(const Impl& impl_being_checked) const {
-  // If there are no references to other cells,
-  // there are no circular dependencies
-  if (impl_being_checked.GetReferencedCells().empty()) { return false; }
-  // Create a set of cells referenced by the current cell
-  std::unordered_set<const Cell*> referenced_cells;
-  for (const auto& pos : impl_being_checked.GetReferencedCells()) {
-    referenced_cells.insert(sheet_.GetConcreteCell(pos));
-  }
-  // Set for checked cells
-  std::unordered_set<const Cell*> checked_cells;
-  // Set for checked and unchecked cells
-  std::unordered_set<const Cell*> unchecked_cells;
-
-  // Add the current cell to unchecked cells
-  unchecked_cells.insert(this);
-
-  // While there are unchecked cells
-  while (!unchecked_cells.empty()) {
-    // Take a cell to be checked
-    const Cell* cell_being_checked = *unchecked_cells.begin();
-    unchecked_cells.erase(cell_being_checked);
-    checked_cells.insert(cell_being_checked);
-
-    // If the current cell is a reference to a cell referenced
-    // by the checked cell, there is a circular dependency
-    if (referenced_cells.count(cell_being_checked)) { return true; }
-
-    // Check all incoming cells for the current one
-    for (const Cell* incoming_cell : cell_being_checked->incoming_cells_) {
-      // If the cell hasn't been checked yet, add it to the list for checking
-      if (!checked_cells.count(incoming_cell)) {
-        unchecked_cells.insert(incoming_cell);
+bool Cell::PlaceAfter(Cell& referenced) {
+  // A cell referencing itself is a cycle of one cell
+  if (&referenced == this) { return false; }
+  if (referenced.topological_index_ < topological_index_) { return true; }
+  // A cell nothing depends on may move to the end of the order,
+  // a cell referencing nothing to its beginning
+  if (!HasDependents()) {
+    topological_index_ = sheet_.TakeLastTopologicalIndex();
+    return true;
+  }
+  if (!referenced.HasDependencies()) {
+    referenced.topological_index_ = sheet_.TakeFirstTopologicalIndex();
+    return true;
+  }
+
+  // Only the cells placed between the two may have to move (Pearce-Kelly).
+  // Cells depending on this one and placed before the referenced one:
+  const std::int64_t lower = topological_index_;
+  const std::int64_t upper = referenced.topological_index_;
+  const std::uint64_t mark = sheet_.TakeVisitMark();
+  std::vector<Cell*> dependents{ this };
+  visit_mark_ = mark;
+  bool reached_referenced = false;
+  for (std::size_t i = 0; i < dependents.size(); ++i) {
+    dependents[i]->ForEachDependent([&](Cell& dependent) {
+      // Reaching the referenced cell means it depends on this one
+      if (&dependent == &referenced) { reached_referenced = true; }
+      if (dependent.topological_index_ < upper
+          && dependent.visit_mark_ != mark) {
+        dependent.visit_mark_ = mark;
+        dependents.push_back(&dependent);
       }
+    });
+    if (reached_referenced) { return false; }
+  }
+  // Cells the referenced one depends on and placed after this one
+  std::vector<Cell*> dependencies{ &referenced };
+  referenced.visit_mark_ = mark;
+  for (std::size_t i = 0; i < dependencies.size(); ++i) {
+    dependencies[i]->ForEachDependency([&](Cell& dependency) {
+      if (dependency.topological_index_ > lower
+          && dependency.visit_mark_ != mark) {
+        dependency.visit_mark_ = mark;
+        dependencies.push_back(&dependency);
+      }
+    });
+  }
+
+  // Give the indices the two groups occupy to the dependencies first,
+  // keeping the relative order within each group
+  const auto by_index = [](const Cell* lhs, const Cell* rhs) {
+    return lhs->topological_index_ < rhs->topological_index_;
+  };
+  std::sort(dependents.begin(), dependents.end(), by_index);
+  std::sort(dependencies.begin(), dependencies.end(), by_index);
+  std::vector<std::int64_t> indices;
+  indices.reserve(dependents.size() + dependencies.size());
+  for (const Cell* cell : dependencies) {
+    indices.push_back(cell->topological_index_);
+  }
+  for (const Cell* cell : dependents) {
+    indices.push_back(cell->topological_index_);
+  }
+  std::sort(indices.begin(), indices.end());
+  auto index = indices.begin();
+  for (Cell* cell : dependencies) { cell->topological_index_ = *index++; }
+  for (Cell* cell : dependents) { cell->topological_index_ = *index++; }
+  return true;
+}
+
+bool Cell::SortTopologically(std::vector<Cell*>& cells) {
+  if (cells.empty()) { return true; }
+  Sheet& sheet = cells.front()->sheet_;
+  const std::uint64_t in_progress = sheet.TakeVisitMark();
+  const std::uint64_t done = sheet.TakeVisitMark();
+  std::vector<Cell*> order;
+  order.reserve(cells.size());
+  // Explicit DFS stack: a cell and whether the cells it depends on
+  // are pushed above it already. A cell is in progress from then on
+  // until it is done, so the cells in progress form the current path
+  std::vector<std::pair<Cell*, bool>> stack;
+  bool has_cycle = false;
+  for (Cell* root : cells) {
+    if (root->visit_mark_ == done) { continue; }
+    stack.emplace_back(root, false);
+    while (!stack.empty()) {
+      const auto [cell, expanded] = stack.back();
+      if (expanded) {
+        cell->visit_mark_ = done;
+        order.push_back(cell);
+        stack.pop_back();
+        continue;
+      }
+      // A cell may be pushed by several dependents before it is reached
+      if (cell->visit_mark_ == done) {
+        stack.pop_back();
+        continue;
+      }
+      stack.back().second = true;
+      cell->visit_mark_ = in_progress;
+      cell->ForEachDependency([&](Cell& dependency) {
+        // Reaching a cell on the current path closes a cycle
+        if (dependency.visit_mark_ == in_progress) { has_cycle = true; }
+        else if (dependency.visit_mark_ != done) {
+          stack.emplace_back(&dependency, false);
+        }
+      });
+      if (has_cycle) { return false; }
     }
   }
-  // In case no circular dependencies were found
-  return false;
+  // Fresh indices from the end of the order, so that they stay between
+  // the ones the sheet hands out for cells at its beginning and its end
+  for (Cell* cell : order) {
+    cell->topological_index_ = sheet.TakeLastTopologicalIndex();
+  }
+  cells = std::move(order);
+  return true;
 }
 
-Cell::Cell(Sheet& sheet)
-  : impl_(std::make_unique<EmptyImpl>()), sheet_(sheet) {
+std::vector<const Cell*> Cell::CollectDirtyCone() const {
+  // Cells of the cone in post-order: every cell follows the cells it references
+  std::vector<const Cell*> cone;
+  // Not visit marks: parallel recalculation collects cones concurrently
+  std::unordered_set<const Cell*> expanded;
+  // Explicit DFS stack: a cell and whether the cells it depends on
+  // are pushed above it already
+  std::vector<std::pair<const Cell*, bool>> stack{ { this, false } };
+  while (!stack.empty()) {
+    const auto [cell, children_pushed] = stack.back();
+    if (children_pushed) {
+      cone.push_back(cell);
+      stack.pop_back();
+      continue;
+    }
+    // A cell may be pushed by several dependents before it is reached
+    if (!expanded.insert(cell).second) {
+      stack.pop_back();
+      continue;
+    }
+    stack.back().second = true;
+    cell->ForEachDependency([&](Cell& dependency) {
+      // Cells with valid caches stop the descent, their values are ready
+      if (!dependency.IsCacheValid() && expanded.count(&dependency) == 0) {
+        stack.emplace_back(&dependency, false);
+      }
+    });
+  }
+  return cone;
+}
+
+Cell::Cell(Sheet& sheet, Position pos)
+  : impl_(MakeEmptyImpl()),
+    // A new cell depends on nothing; it goes before the formulas
+    // whose ranges it falls into and after everything otherwise
+    topological_index_(sheet.GetRangeIndex().Contains(pos)
+                       ? sheet.TakeFirstTopologicalIndex()
+                       : sheet.TakeLastTopologicalIndex()),
+    pos_(pos),
+    sheet_(sheet) {
 }
 
 Cell::~Cell() {}
 
-void Cell::Set(std::string text) {
-  // Create a temporary implementation pointer
-  std::unique_ptr<Impl> temporary_impl;
+void Cell::ImplDeleter::operator()(Impl* impl) const { impl->Destroy(); }
 
+Cell::ImplPtr Cell::MakeImpl(std::string text, Position pos, Sheet& sheet) {
   // Determine the type of implementation based on the input text
   // If text is empty, use EmptyImpl
-  if (text.empty()) { temporary_impl = std::make_unique<EmptyImpl>(); }
+  if (text.empty()) { return MakeEmptyImpl(); }
   // If text starts with the formula sign, use FormulaImpl
-  else if (text.size() > 1 && text[0] == FORMULA_SIGN) {
-      temporary_impl = std::make_unique<FormulaImpl>(std::move(text), sheet_);
+  if (text.size() > 1 && text[0] == FORMULA_SIGN) {
+    return NewImpl<FormulaImpl>(sheet, std::move(text), pos, sheet);
   }
-  // Otherwise, use TextImpl
-  else { temporary_impl = std::make_unique<TextImpl>(std::move(text)); }
-
-  // Check for circular dependencies before applying changes
-  if (CheckForCircularDependencies(*temporary_impl)) {
-      throw CircularDependencyException(EMPTY_SIGN);
+  // Otherwise, use TextImpl, or InternedTextImpl if the sheet asks for it
+  if (sheet.IsTextInterning()) {
+    return NewImpl<InternedTextImpl>(sheet, text, sheet);
   }
-  // Remove this cell from the outgoing cells of its outgoing cells
-  for (Cell* outgoing : outgoing_cells_) {
-      outgoing->incoming_cells_.erase(this);
+  return NewImpl<TextImpl>(sheet, std::move(text), sheet);
+}
+
+Cell::ImplPtr Cell::MakeEmptyImpl() {
+  static EmptyImpl empty_impl;
+  return ImplPtr(&empty_impl);
+}
+
+template <typename T, typename... Args>
+Cell::ImplPtr Cell::NewImpl(Sheet& sheet, Args&&... args) {
+  SlabAllocator& allocator = sheet.GetAllocator();
+  void* memory = allocator.Allocate(sizeof(T));
+  try { return ImplPtr(new (memory) T(std::forward<Args>(args)...)); }
+  catch (...) {
+    // The formula may turn out to be incorrect
+    allocator.Deallocate(memory, sizeof(T));
+    throw;
   }
-  outgoing_cells_.clear();
+}
 
+void Cell::LinkOutgoingCells(const std::vector<Position>& referenced) {
   // Update outgoing cells and incoming
   // references based on the new implementation
-  for (const auto& pos : impl_->GetReferencedCells()) {
-    Cell* outgoing = sheet_.GetConcreteCell(pos);
-    if (!outgoing) {
-      sheet_.SetCell(pos, EMPTY_SIGN);
-      outgoing = sheet_.GetConcreteCell(pos);
+  for (const auto& pos : referenced) {
+    LinkOutgoingCell(sheet_.FindOrCreateCell(pos));
+  }
+}
+
+bool Cell::LinkOutgoingCell(Cell& outgoing) {
+  if (!PlaceAfter(outgoing)) { return false; }
+  outgoing_cells_.Insert(&outgoing);
+  outgoing.incoming_cells_.Insert(this);
+  return true;
+}
+
+void Cell::UnlinkOutgoingCells() {
+  // Remove this cell from the incoming cells of its outgoing cells
+  for (Cell* outgoing : outgoing_cells_) {
+      outgoing->incoming_cells_.Erase(this);
+      if (outgoing->incoming_cells_.Empty()) {
+        sheet_.MarkPossiblyUnused(outgoing->pos_);
+      }
+  }
+  outgoing_cells_.Clear();
+}
+
+void Cell::RegisterRanges() {
+  for (const Range& range : impl_->GetReferencedRanges()) {
+    sheet_.GetRangeIndex().Insert(range, this);
+  }
+}
+
+void Cell::UnregisterRanges() {
+  for (const Range& range : impl_->GetReferencedRanges()) {
+    sheet_.GetRangeIndex().Erase(range, this);
+  }
+}
+
+bool Cell::HasDependents() const {
+  return !incoming_cells_.Empty() || sheet_.GetRangeIndex().Contains(pos_);
+}
+
+bool Cell::HasDependencies() const {
+  return !outgoing_cells_.Empty() || !impl_->GetReferencedRanges().empty();
+}
+
+void Cell::ForEachDependency(const std::function<void(Cell&)>& func) const {
+  for (Cell* outgoing : outgoing_cells_) { func(*outgoing); }
+  for (const Range& range : impl_->GetReferencedRanges()) {
+    sheet_.ForEachCellInRange(range, func);
+  }
+}
+
+void Cell::ForEachDependent(const std::function<void(Cell&)>& func) const {
+  for (Cell* incoming : incoming_cells_) { func(*incoming); }
+  sheet_.GetRangeIndex().ForEachContaining(pos_, [&func](Cell* dependent) {
+    func(*dependent);
+  });
+}
+
+void Cell::SwapImpl(ImplPtr& impl) {
+  const bool had_text = impl_->HasText();
+  std::swap(impl_, impl);
+  if (impl_->HasText() != had_text) {
+    sheet_.UpdatePrintableArea(pos_, !had_text);
+  }
+}
+
+void Cell::Set(std::string text) {
+  // Create a temporary implementation pointer
+  ImplPtr temporary_impl = MakeImpl(std::move(text), pos_, sheet_);
+
+  // Check for circular dependencies before applying changes. Cells that
+  // do not exist yet reference nothing and cannot close a cycle; the old
+  // references of this cell cannot be a part of one either, as a cycle
+  // through a new reference ends at this cell
+  const std::vector<Position> referenced =
+      temporary_impl->GetReferencedCells();
+  for (const auto& pos : referenced) {
+    Cell* cell = sheet_.GetConcreteCell(pos);
+    if (cell && !PlaceAfter(*cell)) {
+      throw CircularDependencyException(EMPTY_SIGN);
     }
-    outgoing_cells_.insert(outgoing);
-    outgoing->incoming_cells_.insert(this);
   }
+  // The cells of the ranges are ordered the same way, but get no edges:
+  // the range index leads from them to this cell
+  bool has_cycle = false;
+  for (const Range& range : temporary_impl->GetReferencedRanges()) {
+    sheet_.ForEachCellInRange(range, [&](Cell& cell) {
+      if (!has_cycle && !PlaceAfter(cell)) { has_cycle = true; }
+    });
+    if (has_cycle) { throw CircularDependencyException(EMPTY_SIGN); }
+  }
+  UnlinkOutgoingCells();
+  LinkOutgoingCells(referenced);
 
   // Replace the current implementation with the new one
-  impl_ = std::move(temporary_impl);
+  UnregisterRanges();
+  SwapImpl(temporary_impl);
+  RegisterRanges();
+
+  // The dependency graph has changed, so has the recalculation order
+  sheet_.InvalidateRecalculationOrder();
 
   // Invalidate the cache of incoming cells
   InvalidateIncomingCellsCache();
 }
 
-void Cell::Clear() { impl_ = std::make_unique<EmptyImpl>(); }
+void Cell::SetBatch(Sheet& sheet,
+                    std::vector<std::pair<Position, std::string>> cells) {
+  struct Change {
+    Cell* cell;
+    ImplPtr impl;
+    CellSet outgoing_cells;
+  };
+
+  // Cells created by the batch, removed again if it is rolled back
+  std::vector<Position> created_cells;
+  std::vector<Change> changes;
+  std::unordered_map<Cell*, std::size_t> change_of_cell;
+
+  // Parse every text before anything is changed
+  std::vector<ImplPtr> impls;
+  impls.reserve(cells.size());
+  for (auto& [pos, text] : cells) {
+    impls.push_back(MakeImpl(std::move(text), pos, sheet));
+  }
+
+  // Find or create the cells, a later text
+  // for the same cell replaces an earlier one
+  changes.reserve(cells.size());
+  for (std::size_t i = 0; i < cells.size(); ++i) {
+    const Position pos = cells[i].first;
+    Cell* cell = sheet.GetConcreteCell(pos);
+    if (!cell) {
+      cell = &sheet.FindOrCreateCell(pos);
+      created_cells.push_back(pos);
+    }
+    const auto [it, inserted] = change_of_cell.emplace(cell, changes.size());
+    if (inserted) { changes.push_back({ cell, std::move(impls[i]), {} }); }
+    else { changes[it->second].impl = std::move(impls[i]); }
+  }
 
-Cell::Value Cell::GetValue() const { return impl_->GetValue(); }
+  // Swap the new implementations in, keeping the old implementations
+  // and edges for a rollback. The old edges of all the changed cells go
+  // first, so that only the graph the batch leaves is checked for cycles
+  for (auto& change : changes) {
+    Cell& cell = *change.cell;
+    change.outgoing_cells = cell.outgoing_cells_;
+    cell.UnlinkOutgoingCells();
+    cell.UnregisterRanges();
+  }
+  for (auto& change : changes) {
+    Cell& cell = *change.cell;
+    cell.SwapImpl(change.impl);
+    cell.RegisterRanges();
+  }
+  // Link the new edges that agree with the topological order right away,
+  // only the edges against it may close a cycle
+  std::vector<std::pair<Cell*, Cell*>> backward_edges;
+  // The new ranges are visible to the searches of the incremental
+  // placement at once, so it only works while they agree with the order
+  bool ranges_against_order = false;
+  for (auto& change : changes) {
+    Cell& cell = *change.cell;
+    for (const Range& range : cell.impl_->GetReferencedRanges()) {
+      sheet.ForEachCellInRange(range, [&](Cell& outgoing) {
+        if (outgoing.topological_index_ >= cell.topological_index_) {
+          ranges_against_order = true;
+        }
+      });
+    }
+    for (const auto& pos : cell.impl_->GetReferencedCells()) {
+      Cell* outgoing = sheet.GetConcreteCell(pos);
+      if (!outgoing) {
+        outgoing = &sheet.FindOrCreateCell(pos);
+        created_cells.push_back(pos);
+      }
+      if (outgoing->topological_index_ < cell.topological_index_) {
+        cell.outgoing_cells_.Insert(outgoing);
+        outgoing->incoming_cells_.Insert(&cell);
+      }
+      else { backward_edges.emplace_back(&cell, outgoing); }
+    }
+  }
 
-std::string Cell::GetText() const { return impl_->GetText(); }
+  // Past that many edges against the order one pass over the whole graph
+  // is cheaper than searching around each of them
+  constexpr std::size_t MAX_INCREMENTAL_EDGES = 64;
+  bool has_cycle = false;
+  if (backward_edges.size() <= MAX_INCREMENTAL_EDGES && !ranges_against_order) {
+    for (const auto& [cell, outgoing] : backward_edges) {
+      if (!cell->LinkOutgoingCell(*outgoing)) {
+        has_cycle = true;
+        break;
+      }
+    }
+  }
+  else {
+    for (const auto& [cell, outgoing] : backward_edges) {
+      cell->outgoing_cells_.Insert(outgoing);
+      outgoing->incoming_cells_.Insert(cell);
+    }
+    std::vector<Cell*> all_cells = sheet.GetRecalculationOrder();
+    has_cycle = !SortTopologically(all_cells);
+  }
+
+  if (has_cycle) {
+    // Restore the old implementations and edges; the old graph
+    // is acyclic, so the edges fit back into the topological order...
+    for (auto& change : changes) {
+      change.cell->UnlinkOutgoingCells();
+      change.cell->UnregisterRanges();
+    }
+    for (auto& change : changes) {
+      Cell& cell = *change.cell;
+      cell.SwapImpl(change.impl);
+      cell.RegisterRanges();
+      for (Cell* outgoing : change.outgoing_cells) {
+        cell.LinkOutgoingCell(*outgoing);
+      }
+      for (const Range& range : cell.impl_->GetReferencedRanges()) {
+        sheet.ForEachCellInRange(range, [&cell](Cell& outgoing) {
+          cell.PlaceAfter(outgoing);
+        });
+      }
+    }
+    // ...and remove the cells the batch has created
+    for (const auto& pos : created_cells) { sheet.ClearCell(pos); }
+    sheet.InvalidateRecalculationOrder();
+    throw CircularDependencyException(EMPTY_SIGN);
+  }
+
+  sheet.InvalidateRecalculationOrder();
+  std::vector<Cell*> changed_cells;
+  changed_cells.reserve(changes.size());
+  for (const auto& change : changes) { changed_cells.push_back(change.cell); }
+  InvalidateCaches(
+      ArrayView<Cell*>(changed_cells.data(), changed_cells.size()));
+}
+
+void Cell::Clear() {
+  UnregisterRanges();
+  UnlinkOutgoingCells();
+  ImplPtr empty_impl = MakeEmptyImpl();
+  SwapImpl(empty_impl);
+  // Cells that depend on this one must not keep serving stale values
+  InvalidateIncomingCellsCache();
+}
+
+void Cell::EvaluateIfDirty() const {
+  if (!impl_->IsCacheValid()) {
+    // Evaluate the dirty cells this one depends on first, dependencies
+    // before dependents, so no evaluation has to recurse into another one
+    for (const Cell* cell : CollectDirtyCone()) {
+      cell->impl_->GetNumericValue();
+    }
+  }
+}
+
+Cell::Value Cell::GetValue() const {
+  const ValueView value = GetValueView();
+  if (const auto* text = std::get_if<std::string_view>(&value)) {
+    return std::string(*text);
+  }
+  if (const double* number = std::get_if<double>(&value)) { return *number; }
+  return std::get<FormulaError>(value);
+}
+
+Cell::ValueView Cell::GetValueView() const {
+  EvaluateIfDirty();
+  return impl_->GetValueView();
+}
+
+Cell::NumericValue Cell::GetNumericValue() const {
+  EvaluateIfDirty();
+  return impl_->GetNumericValue();
+}
+
+std::string Cell::GetText() const { return std::string(GetTextView()); }
+
+std::string_view Cell::GetTextView() const { return impl_->GetTextView(); }
+
+bool Cell::HasText() const { return impl_->HasText(); }
 
 std::vector<Position> Cell::GetReferencedCells() const {
     return impl_->GetReferencedCells();
 }
 
-void Cell::InvalidateIncomingCellsCache() {
-  impl_->InvalidateOneCellCache();
-  for (Cell* incoming_cell : incoming_cells_) {
-      incoming_cell->InvalidateIncomingCellsCache();
+std::vector<Range> Cell::GetReferencedRanges() const {
+  return impl_->GetReferencedRanges();
+}
+
+std::optional<Cell::NumericValue> Cell::GetRangeValue() const {
+  EvaluateIfDirty();
+  return impl_->GetRangeValue();
+}
+
+std::size_t Cell::InvalidateIncomingCellsCache() {
+  Cell* const self = this;
+  return InvalidateCaches(ArrayView<Cell*>(&self, 1));
+}
+
+std::size_t Cell::InvalidateCaches(ArrayView<Cell*> cells) {
+  if (cells.empty()) { return 0; }
+  for (Cell* cell : cells) {
+    cell->impl_->InvalidateOneCellCache();
+    cell->sheet_.InvalidateColumnValue(cell->pos_);
+    // A new formula has no value yet either
+    if (!cell->impl_->IsCacheValid()) { cell->sheet_.MarkDirty(cell->pos_); }
   }
+  std::size_t touched = cells.size();
+  // A cell gets a value only after the cells it reads have got theirs,
+  // so the cells depending on a dirty cell are dirty already, unless
+  // they did not read it; either way the descent stops there
+  // The worklist of the sheet keeps its capacity between edits
+  std::vector<Cell*>& unvisited = cells[0]->sheet_.GetInvalidationWorklist();
+  unvisited.assign(cells.begin(), cells.end());
+  while (!unvisited.empty()) {
+    Cell* cell = unvisited.back();
+    unvisited.pop_back();
+    cell->ForEachDependent([&](Cell& dependent) {
+      // A dependent whose cache is invalid already had its own
+      // dependents invalidated when it lost the cache, stop there
+      if (!dependent.impl_->InvalidateOneCellCache()) { return; }
+      dependent.sheet_.InvalidateColumnValue(dependent.pos_);
+      dependent.sheet_.MarkDirty(dependent.pos_);
+      ++touched;
+      unvisited.push_back(&dependent);
+    });
+  }
+  return touched;
+}
+
+std::size_t Cell::GetMemoryUsage() const {
+  return impl_->GetMemoryUsage() + incoming_cells_.GetMemoryUsage()
+         + outgoing_cells_.GetMemoryUsage();
+}
+
+bool Cell::IsReferenced() const { return !incoming_cells_.Empty(); }
+
+bool Cell::IsCacheValid() const { return impl_->IsCacheValid(); }
+
+std::int64_t Cell::GetTopologicalIndex() const { return topological_index_; }
+
+Position Cell::GetPosition() const { return pos_; }
+
+const Cell::CellSet& Cell::GetIncomingCells() const {
+  return incoming_cells_;
 }
 
-bool Cell::IsReferenced() const { return !incoming_cells_.empty(); }
+const Cell::CellSet& Cell::GetOutgoingCells() const {
+  return outgoing_cells_;
+}
@@ -2,17 +2,26 @@
 
 #include "common.h"
 #include "formula.h"
+#include "small_set.h"
 
 #include <functional>
-#include <unordered_set>
 #include <cassert>
+#include <cstdint>
 #include <iostream>
 #include <string>
 #include <optional>
+#include <utility>
+#include <vector>
 
 class Sheet;
 
 class Cell : public CellInterface {
+  public:
+
+  // Most cells reference and are referenced by a few cells at most,
+  // those edges take no memory beyond the cell itself
+  using CellSet = SmallSet<Cell*, 3>;
+
   private:
 
   class Impl;
@@ -21,37 +30,159 @@ class Cell : public CellInterface {
 
   class TextImpl;
 
+  class InternedTextImpl;
+
   class FormulaImpl;
 
-  bool CheckForCircularDependencies(const Impl& new_impl) const;
+  // Implementations live in the slab allocator of the sheet,
+  // except the empty one, which all the empty cells share
+  struct ImplDeleter {
+    void operator()(Impl* impl) const;
+  };
+
+  using ImplPtr = std::unique_ptr<Impl, ImplDeleter>;
+
+  // Moves cells in the topological order so that this cell follows
+  // the referenced one, touching only the cells placed between them.
+  // Returns false if this cell is reachable from the referenced one,
+  // that is if referencing it would close a cycle
+  bool PlaceAfter(Cell& referenced);
+
+  // Sorts all the cells of a sheet so that every cell follows the cells
+  // it depends on and renumbers them in that order.
+  // Returns false if the dependencies between them form a cycle
+  static bool SortTopologically(std::vector<Cell*>& cells);
+
+  std::vector<const Cell*> CollectDirtyCone() const;
+
+  void EvaluateIfDirty() const;
+
+  static ImplPtr MakeImpl(std::string text, Position pos, Sheet& sheet);
+
+  static ImplPtr MakeEmptyImpl();
+
+  // Creates an implementation of the type in the allocator of the sheet
+  template <typename T, typename... Args>
+  static ImplPtr NewImpl(Sheet& sheet, Args&&... args);
+
+  // Exchanges the implementation of the cell with the given one,
+  // telling the sheet if the cell gets or loses its text
+  void SwapImpl(ImplPtr& impl);
+
+  // Links the cell to the cells at the positions, creating missing ones;
+  // the caller has checked that none of them closes a cycle
+  void LinkOutgoingCells(const std::vector<Position>& referenced);
+
+  // Links the cell to the cell it references unless that closes a cycle
+  bool LinkOutgoingCell(Cell& outgoing);
+
+  void UnlinkOutgoingCells();
+
+  // Registers the ranges of the formula in the range index of the sheet
+  void RegisterRanges();
+
+  void UnregisterRanges();
+
+  bool HasDependents() const;
+
+  bool HasDependencies() const;
+
+  // Invalidates the caches of the cells and of all the cells depending
+  // on them, iteratively and without descending below cells that are
+  // dirty already, and marks the formulas left without a value dirty
+  // in the sheet; returns the number of cells touched
+  static std::size_t InvalidateCaches(ArrayView<Cell*> cells);
 
   public:
 
-  Cell(Sheet& sheet);
+  // Pos is the position of the cell, formulas are parsed relative to it
+  Cell(Sheet& sheet, Position pos);
 
   ~Cell();
 
   void Set(std::string text);
 
+  // Sets the texts of several cells of the sheet at once. Parsing,
+  // rewiring of dependencies, the cycle check and cache invalidation
+  // run once for the whole batch; if any text is not a valid formula
+  // or the batch introduces a cycle, the sheet is left unchanged
+  static void SetBatch(Sheet& sheet,
+                       std::vector<std::pair<Position, std::string>> cells);
+
   void Clear();
 
   Value GetValue() const override;
 
   std::string GetText() const override;
 
+  ValueView GetValueView() const override;
+
+  std::string_view GetTextView() const override;
+
+  // Whether the text is not empty, without printing the formula
+  bool HasText() const;
+
   std::vector<Position> GetReferencedCells() const override;
 
-  void InvalidateIncomingCellsCache();
+  std::vector<Range> GetReferencedRanges() const override;
+
+  NumericValue GetNumericValue() const override;
+
+  // The value as aggregate functions read it from a range: nothing
+  // for empty cells and texts that are not numbers
+  std::optional<NumericValue> GetRangeValue() const;
+
+  // Invalidates the cache of the cell and of the cells depending on it,
+  // returns the number of cells touched
+  std::size_t InvalidateIncomingCellsCache();
 
   bool IsReferenced() const;
 
+  // Bytes of heap memory the cell holds: its contents and the edges that
+  // do not fit inline. The cell object itself belongs to its storage,
+  // the object of its contents to the allocator of the sheet
+  std::size_t GetMemoryUsage() const;
+
+  // Returns false if the cell holds a formula whose value must be recomputed
+  bool IsCacheValid() const;
+
+  // Cells whose formulas reference this cell
+  const CellSet& GetIncomingCells() const;
+
+  // Cells referenced by the formula of this cell
+  const CellSet& GetOutgoingCells() const;
+
+  // Calls func for every existing cell the value depends on: the
+  // referenced cells and the cells of the referenced ranges. A cell
+  // may be reported more than once
+  void ForEachDependency(const std::function<void(Cell&)>& func) const;
+
+  // Calls func for every cell whose value depends on this one: the cells
+  // referencing it and the formulas with ranges containing it. A cell
+  // may be reported more than once
+  void ForEachDependent(const std::function<void(Cell&)>& func) const;
+
+  // Position of the cell in a topological order of the dependency graph:
+  // greater than the positions of the cells it references
+  std::int64_t GetTopologicalIndex() const;
+
+  Position GetPosition() const;
+
 private:
 
-  std::unique_ptr<Impl> impl_;
+  ImplPtr impl_;
+
+  CellSet incoming_cells_;
+
+  CellSet outgoing_cells_;
+
+  // Every cell has a greater index than the cells it references
+  std::int64_t topological_index_;
 
-  std::unordered_set<Cell*> incoming_cells_;
+  // Marks the cells a search of the topological order has reached
+  std::uint64_t visit_mark_ = 0;
 
-  std::unordered_set<Cell*> outgoing_cells_;
+  Position pos_;
 
   Sheet& sheet_;
 };
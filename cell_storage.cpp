@@ -0,0 +1,253 @@
+#include "cell_storage.h"
+#include "cell.h"
+#include "position_map.h"
+#include "slab_allocator.h"
+
+#include <array>
+#include <cstdint>
+#include <new>
+#include <optional>
+
+namespace {
+
+class HashCellStorage : public CellStorage {
+  public:
+
+  using CellStorage::Find;
+
+  HashCellStorage() = default;
+
+  ~HashCellStorage() override {
+    cells_.ForEach([this](Position, Cell* cell) { DestroyCell(cell); });
+  }
+
+  const Cell* Find(Position pos) const override {
+    const auto* cell = cells_.Find(pos);
+    return cell != nullptr ? *cell : nullptr;
+  }
+
+  Cell& FindOrCreate(Position pos, Sheet& sheet) override {
+    auto& cell = cells_[pos];
+    if (cell == nullptr) {
+      cell = new (allocator_.Allocate(sizeof(Cell))) Cell(sheet, pos);
+    }
+    return *cell;
+  }
+
+  void Erase(Position pos) override {
+    Cell** cell = cells_.Find(pos);
+    if (cell == nullptr) { return; }
+    Cell* erased = *cell;
+    cells_.Erase(pos);
+    DestroyCell(erased);
+  }
+
+  void ForEach(const std::function<void(Position, const Cell&)>& func)
+      const override {
+    cells_.ForEach([&func](Position pos, const Cell* cell) {
+      func(pos, *cell);
+    });
+  }
+
+  void ForEachInRange(Range range,
+                      const std::function<void(Position, const Cell&)>& func)
+      const override {
+    const std::int64_t area =
+        std::int64_t{ range.last.row - range.first.row + 1 }
+        * (range.last.col - range.first.col + 1);
+    // Look up every position of small ranges, filter all the cells
+    // for ranges bigger than the sheet
+    if (area <= static_cast<std::int64_t>(cells_.Size())) {
+      for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+          if (const Cell* cell = Find({ row, col })) {
+            func({ row, col }, *cell);
+          }
+        }
+      }
+      return;
+    }
+    cells_.ForEach([&](Position pos, const Cell* cell) {
+      if (range.Contains(pos)) { func(pos, *cell); }
+    });
+  }
+
+  void GetColumn(int col, int first_row,
+                 std::vector<const Cell*>& column_cells) const override {
+    for (std::size_t i = 0; i < column_cells.size(); ++i) {
+      column_cells[i] = Find({ first_row + static_cast<int>(i), col });
+    }
+  }
+
+  std::size_t GetMemoryUsage() const override {
+    return cells_.GetMemoryUsage() + allocator_.GetMemoryUsage();
+  }
+
+  void ShrinkToFit() override {
+    cells_.ShrinkToFit();
+    allocator_.ReleaseEmptySlabs();
+  }
+
+  private:
+
+  void DestroyCell(Cell* cell) {
+    cell->~Cell();
+    allocator_.Deallocate(cell, sizeof(Cell));
+  }
+
+  // Cells are packed into slabs rather than allocated one by one
+  SlabAllocator allocator_;
+  PositionMap<Cell*> cells_;
+};
+
+class TiledCellStorage : public CellStorage {
+  public:
+
+  // Sheets are usually much taller than wide,
+  // so tiles are narrow to waste less on unused columns
+  static constexpr int TILE_ROWS = 64;
+  static constexpr int TILE_COLS = 16;
+
+  using CellStorage::Find;
+
+  const Cell* Find(Position pos) const override {
+    const auto* tile = tiles_.Find(TileOf(pos));
+    if (tile == nullptr) { return nullptr; }
+    const auto& cell = (*tile)->cells[IndexInTile(pos)];
+    return cell ? &*cell : nullptr;
+  }
+
+  Cell& FindOrCreate(Position pos, Sheet& sheet) override {
+    auto& tile = tiles_[TileOf(pos)];
+    if (tile == nullptr) { tile = std::make_unique<Tile>(); }
+    auto& cell = tile->cells[IndexInTile(pos)];
+    if (!cell) {
+      cell.emplace(sheet, pos);
+      ++tile->size;
+    }
+    return *cell;
+  }
+
+  void Erase(Position pos) override {
+    auto* tile = tiles_.Find(TileOf(pos));
+    if (tile == nullptr) { return; }
+    auto& cell = (*tile)->cells[IndexInTile(pos)];
+    if (!cell) { return; }
+    cell.reset();
+    // A tile goes with its last cell, so cleared areas take no memory
+    if (--(*tile)->size == 0) { tiles_.Erase(TileOf(pos)); }
+  }
+
+  void ForEach(const std::function<void(Position, const Cell&)>& func)
+      const override {
+    tiles_.ForEach([&func](Position tile_pos, const std::unique_ptr<Tile>& tile) {
+      for (int index = 0; index < TILE_ROWS * TILE_COLS; ++index) {
+        if (tile->cells[index]) {
+          func({ tile_pos.row * TILE_ROWS + index / TILE_COLS,
+                 tile_pos.col * TILE_COLS + index % TILE_COLS },
+               *tile->cells[index]);
+        }
+      }
+    });
+  }
+
+  void ForEachInRange(Range range,
+                      const std::function<void(Position, const Cell&)>& func)
+      const override {
+    const Position first_tile = TileOf(range.first);
+    const Position last_tile = TileOf(range.last);
+    const auto visit_tile = [&](Position tile_pos, const Tile& tile) {
+      const int first_row =
+          std::max(range.first.row, tile_pos.row * TILE_ROWS);
+      const int last_row =
+          std::min(range.last.row, (tile_pos.row + 1) * TILE_ROWS - 1);
+      const int first_col =
+          std::max(range.first.col, tile_pos.col * TILE_COLS);
+      const int last_col =
+          std::min(range.last.col, (tile_pos.col + 1) * TILE_COLS - 1);
+      for (int row = first_row; row <= last_row; ++row) {
+        for (int col = first_col; col <= last_col; ++col) {
+          const auto& cell = tile.cells[IndexInTile({ row, col })];
+          if (cell) { func({ row, col }, *cell); }
+        }
+      }
+    };
+    const std::int64_t tile_count =
+        std::int64_t{ last_tile.row - first_tile.row + 1 }
+        * (last_tile.col - first_tile.col + 1);
+    // Look up every tile of small ranges, filter all the tiles
+    // for ranges bigger than the allocated part of the sheet
+    if (tile_count <= static_cast<std::int64_t>(tiles_.Size())) {
+      for (int row = first_tile.row; row <= last_tile.row; ++row) {
+        for (int col = first_tile.col; col <= last_tile.col; ++col) {
+          if (const auto* tile = tiles_.Find({ row, col })) {
+            visit_tile({ row, col }, **tile);
+          }
+        }
+      }
+      return;
+    }
+    tiles_.ForEach([&](Position tile_pos, const std::unique_ptr<Tile>& tile) {
+      if (tile_pos.row >= first_tile.row && tile_pos.row <= last_tile.row
+          && tile_pos.col >= first_tile.col && tile_pos.col <= last_tile.col) {
+        visit_tile(tile_pos, *tile);
+      }
+    });
+  }
+
+  void GetColumn(int col, int first_row,
+                 std::vector<const Cell*>& column_cells) const override {
+    const int end_row = first_row + static_cast<int>(column_cells.size());
+    // One directory lookup per tile, then a stride of a tile row
+    for (int row = first_row; row < end_row;) {
+      const int tile_end_row =
+          std::min(end_row, (row / TILE_ROWS + 1) * TILE_ROWS);
+      const auto* tile = tiles_.Find(TileOf({ row, col }));
+      auto out = column_cells.begin() + (row - first_row);
+      if (tile == nullptr) {
+        std::fill(out, out + (tile_end_row - row), nullptr);
+        row = tile_end_row;
+        continue;
+      }
+      for (; row < tile_end_row; ++row) {
+        const auto& cell = (*tile)->cells[IndexInTile({ row, col })];
+        *out++ = cell ? &*cell : nullptr;
+      }
+    }
+  }
+
+  std::size_t GetMemoryUsage() const override {
+    return tiles_.GetMemoryUsage() + tiles_.Size() * sizeof(Tile);
+  }
+
+  void ShrinkToFit() override { tiles_.ShrinkToFit(); }
+
+  private:
+
+  struct Tile {
+    std::array<std::optional<Cell>, TILE_ROWS * TILE_COLS> cells;
+    // Cells stored in the tile
+    int size = 0;
+  };
+
+  static Position TileOf(Position pos) {
+    return { pos.row / TILE_ROWS, pos.col / TILE_COLS };
+  }
+
+  static int IndexInTile(Position pos) {
+    return (pos.row % TILE_ROWS) * TILE_COLS + pos.col % TILE_COLS;
+  }
+
+  // Tiles are addressed by their own row and column in the tile grid
+  PositionMap<std::unique_ptr<Tile>> tiles_;
+};
+
+} // end of namespace
+
+std::unique_ptr<CellStorage> CreateHashCellStorage() {
+  return std::make_unique<HashCellStorage>();
+}
+
+std::unique_ptr<CellStorage> CreateTiledCellStorage() {
+  return std::make_unique<TiledCellStorage>();
+}
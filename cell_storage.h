@@ -0,0 +1,65 @@
+#pragma once
+
+#include "common.h"
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+class Cell;
+class Sheet;
+
+// Storage backend that owns the cells of a sheet.
+// A cell never moves in memory while it is stored,
+// so the sheet and the cells may keep pointers to it
+class CellStorage {
+  public:
+
+  virtual ~CellStorage() = default;
+
+  // Returns the cell at the position or nullptr if there is none
+  virtual const Cell* Find(Position pos) const = 0;
+
+  Cell* Find(Position pos) {
+    return const_cast<Cell*>(static_cast<const CellStorage&>(*this).Find(pos));
+  }
+
+  // Returns the cell at the position, creating an empty one if there is none
+  virtual Cell& FindOrCreate(Position pos, Sheet& sheet) = 0;
+
+  // Destroys the cell at the position if there is one
+  virtual void Erase(Position pos) = 0;
+
+  // Calls func for every stored cell in an unspecified order
+  virtual void ForEach(
+      const std::function<void(Position, const Cell&)>& func) const = 0;
+
+  // Calls func for every stored cell of the range in an unspecified order
+  virtual void ForEachInRange(
+      Range range,
+      const std::function<void(Position, const Cell&)>& func) const = 0;
+
+  // Fills column_cells with the cells of the column in rows
+  // [first_row, first_row + column_cells.size()), absent cells
+  // are represented by nullptr
+  virtual void GetColumn(int col, int first_row,
+                         std::vector<const Cell*>& column_cells) const = 0;
+
+  // Bytes of memory the storage takes, with the cell objects
+  // but without the heap memory the cells hold themselves
+  virtual std::size_t GetMemoryUsage() const = 0;
+
+  // Gives back the memory the erased cells have left behind
+  virtual void ShrinkToFit() = 0;
+};
+
+// Sparse storage: every cell is allocated separately, from slabs
+// the storage keeps, and looked up through a hash table.
+// Sheets use it unless given another storage
+std::unique_ptr<CellStorage> CreateHashCellStorage();
+
+// Dense storage: cells live inline in fixed-size tiles
+// which are allocated on the first write into their area
+// and freed when their last cell is erased. A tile takes about
+// a hundred kilobytes, so it pays off only for densely filled areas
+std::unique_ptr<CellStorage> CreateTiledCellStorage();
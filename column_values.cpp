@@ -0,0 +1,109 @@
+#include "column_values.h"
+#include "cell.h"
+#include "cell_storage.h"
+
+#include <algorithm>
+
+ColumnValueCache::ColumnValueCache(const CellStorage& storage)
+  : storage_(storage) {
+}
+
+ColumnValueCache::~ColumnValueCache() {}
+
+void ColumnValueCache::Invalidate(Position pos) {
+  if (pos.col >= static_cast<int>(columns_.size())) {
+    columns_.resize(pos.col + 1);
+  }
+  Column& column = columns_[pos.col];
+  if (column.dirty_begin >= column.dirty_end) {
+    column.dirty_begin = pos.row;
+    column.dirty_end = pos.row + 1;
+    return;
+  }
+  column.dirty_begin = std::min(column.dirty_begin, pos.row);
+  column.dirty_end = std::max(column.dirty_end, pos.row + 1);
+}
+
+ColumnValues ColumnValueCache::Get(int col, int row_begin, int row_end) {
+  if (col >= static_cast<int>(columns_.size())) { columns_.resize(col + 1); }
+  Column& column = columns_[col];
+  // Rows past the arrays have not been written since the column
+  // was read last, unless they are marked
+  if (row_end > static_cast<int>(column.types.size())) {
+    column.types.resize(row_end, ValueType::Empty);
+    column.numbers.resize(row_end, 0.0);
+    column.ids.resize(row_end, 0);
+  }
+  const int size = static_cast<int>(column.types.size());
+  if (column.dirty_begin < std::min(column.dirty_end, size)) {
+    // Marked rows past the arrays stay marked
+    const int refreshed_end = std::min(column.dirty_end, size);
+    Refresh(column, col, column.dirty_begin, refreshed_end);
+    column.dirty_begin = refreshed_end;
+  }
+  const std::size_t count = row_end - row_begin;
+  return { { column.types.data() + row_begin, count },
+           { column.numbers.data() + row_begin, count },
+           { column.ids.data() + row_begin, count },
+           &texts_ };
+}
+
+void ColumnValueCache::Refresh(Column& column, int col,
+                               int row_begin, int row_end) {
+  cells_.resize(row_end - row_begin);
+  storage_.GetColumn(col, row_begin, cells_);
+  for (int row = row_begin; row < row_end; ++row) {
+    if (column.types[row] == ValueType::Text) {
+      texts_.Release(column.ids[row]);
+    }
+    column.types[row] = ValueType::Empty;
+    column.numbers[row] = 0.0;
+    column.ids[row] = 0;
+    const Cell* cell = cells_[row - row_begin];
+    if (cell == nullptr) { continue; }
+
+    const auto value = cell->GetValueView();
+    if (const double* number = std::get_if<double>(&value)) {
+      column.types[row] = ValueType::Number;
+      column.numbers[row] = *number;
+    }
+    else if (const auto* error = std::get_if<FormulaError>(&value)) {
+      column.types[row] = ValueType::Error;
+      column.ids[row] = static_cast<std::uint32_t>(error->GetCategory());
+    }
+    // Empty cells have no text, a lone escape sign has an empty one
+    else if (const auto text = std::get<std::string_view>(value);
+             !text.empty() || !cell->GetTextView().empty()) {
+      column.types[row] = ValueType::Text;
+      column.ids[row] = texts_.Intern(text);
+    }
+  }
+}
+
+void ColumnValueCache::Clear() {
+  for (Column& column : columns_) {
+    // The rows read so far are marked, so that they are read again
+    const int size = static_cast<int>(column.types.size());
+    column.dirty_end = column.dirty_begin < column.dirty_end
+                       ? std::max(column.dirty_end, size)
+                       : size;
+    column.dirty_begin = 0;
+    std::vector<ValueType>().swap(column.types);
+    std::vector<double>().swap(column.numbers);
+    std::vector<std::uint32_t>().swap(column.ids);
+  }
+  texts_ = StringPool();
+  std::vector<const Cell*>().swap(cells_);
+}
+
+std::size_t ColumnValueCache::GetMemoryUsage() const {
+  std::size_t memory = columns_.capacity() * sizeof(Column)
+                       + cells_.capacity() * sizeof(const Cell*)
+                       + texts_.GetMemoryUsage();
+  for (const Column& column : columns_) {
+    memory += column.types.capacity() * sizeof(ValueType)
+              + column.numbers.capacity() * sizeof(double)
+              + column.ids.capacity() * sizeof(std::uint32_t);
+  }
+  return memory;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "common.h"
+#include "string_pool.h"
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+class Cell;
+class CellStorage;
+
+// What the value of a cell is
+enum class ValueType : std::uint8_t { Empty, Number, Text, Error };
+
+// Values of consecutive rows of a column, an array per part of a value
+struct ColumnValues {
+  ArrayView<ValueType> types;
+  // Values of the Number rows, zeros elsewhere
+  ArrayView<double> numbers;
+  // Ids of the texts of the Text rows in the pool, categories
+  // of the errors of the Error rows, zeros elsewhere
+  ArrayView<std::uint32_t> ids;
+  const StringPool* texts = nullptr;
+
+  std::size_t size() const { return types.size(); }
+
+  std::string_view GetText(std::size_t row) const {
+    return texts->Get(ids[row]);
+  }
+
+  FormulaError GetError(std::size_t row) const {
+    return static_cast<FormulaError::Category>(ids[row]);
+  }
+};
+
+// Evaluated values of the cells of a sheet kept by column, so that bulk
+// readers scan flat arrays instead of asking every cell for a value.
+// Cells whose values may have changed are marked, and the marked rows
+// of a column are read again from the cells the next time it is asked for
+class ColumnValueCache {
+  public:
+
+  explicit ColumnValueCache(const CellStorage& storage);
+
+  ~ColumnValueCache();
+
+  // The value of the cell at the position may have changed
+  void Invalidate(Position pos);
+
+  // Values of rows [row_begin, row_end) of the column, evaluating
+  // formulas as needed. The views stay valid until the next call
+  ColumnValues Get(int col, int row_begin, int row_end);
+
+  // Drops the cached values and their memory,
+  // the values are read from the cells again when asked for
+  void Clear();
+
+  // Bytes of heap memory the cache holds
+  std::size_t GetMemoryUsage() const;
+
+  private:
+
+  struct Column {
+    std::vector<ValueType> types;
+    std::vector<double> numbers;
+    std::vector<std::uint32_t> ids;
+    // Rows to read again, the range is empty if begin >= end
+    int dirty_begin = 0;
+    int dirty_end = 0;
+  };
+
+  // Reads the rows of the column from the cells
+  void Refresh(Column& column, int col, int row_begin, int row_end);
+
+  const CellStorage& storage_;
+  std::vector<Column> columns_;
+  StringPool texts_;
+  // Cells of the rows being read, kept to avoid allocations
+  std::vector<const Cell*> cells_;
+};
@@ -2,6 +2,7 @@
 
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -27,6 +28,19 @@ struct Position {
   static Position FromString(std::string_view str);
 };
 
+// Rectangle of cells between two corners, both inclusive
+struct Range {
+  // The top left corner
+  Position first;
+  // The bottom right corner
+  Position last;
+
+  bool operator==(Range rhs) const;
+  bool Contains(Position pos) const;
+  // The corners separated by a colon, like A1:B10
+  std::string ToString() const;
+};
+
 struct PositionHasher {
   // Hash function for Position objects, combine hash values of row
   // and col using addition and multiplication
@@ -46,6 +60,26 @@ struct Size {
   bool operator==(Size rhs) const;
 };
 
+// Read-only view of an array stored elsewhere
+template <typename T>
+class ArrayView {
+  public:
+
+  ArrayView() = default;
+  ArrayView(const T* data, std::size_t size) : data_(data), size_(size) {}
+
+  const T* begin() const { return data_; }
+  const T* end() const { return data_ + size_; }
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const T& operator[](std::size_t index) const { return data_[index]; }
+
+  private:
+
+  const T* data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
 // Describes the errors that can occur when calculating a formula.
 class FormulaError {
   public:
@@ -84,6 +118,11 @@ class CellInterface {
   // Either the cell's text, the formula's value,
   // or an error message from the formula
   using Value = std::variant<std::string, double, FormulaError>;
+  // The cell's value as an operand of a formula:
+  // either a number or the error the formula evaluates to
+  using NumericValue = std::variant<double, FormulaError>;
+  // The visible value with the text viewed in place instead of copied
+  using ValueView = std::variant<std::string_view, double, FormulaError>;
 
   virtual ~CellInterface() = default;
   // Returns the visible value of the cell.
@@ -96,7 +135,17 @@ class CellInterface {
   // (potentially containing escape characters).
   // In the case of a formula - it's its expression.
   virtual std::string GetText() const = 0;
+  // The same as GetValue() and GetText(), but without allocations.
+  // The views stay valid until the cell is changed or cleared
+  virtual ValueView GetValueView() const = 0;
+  virtual std::string_view GetTextView() const = 0;
   virtual std::vector<Position> GetReferencedCells() const = 0;
+  // Returns the ranges the formula of the cell aggregates, each one as
+  // a whole; their cells are not among the referenced cells
+  virtual std::vector<Range> GetReferencedRanges() const = 0;
+  // Returns the value as a formula reads it. An empty cell reads as zero,
+  // a text cell as the number it holds, otherwise as the #VALUE! error
+  virtual NumericValue GetNumericValue() const = 0;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
@@ -131,6 +180,12 @@ class SheetInterface {
   // respectively. An empty cell is represented by an empty string in any case.
   virtual void PrintValues(std::ostream& output) const = 0;
   virtual void PrintTexts(std::ostream& output) const = 0;
+  // Appends the values aggregate functions take from the cells
+  // of the range, column by column: the numbers of the cells that are
+  // neither empty nor texts other than numbers. Returns the first error
+  // a cell evaluates to instead, the values appended so far are unspecified
+  virtual std::optional<FormulaError> GetRangeValues(
+      Range range, std::vector<double>& values) const = 0;
 };
 
 // Creates an empty table ready for use.
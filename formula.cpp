@@ -1,6 +1,8 @@
 #include "formula.h"
 #include "FormulaAST.h"
 
+#include <cmath>
+
 using namespace std::literals;
 
 FormulaError::FormulaError(Category category) : category_(category) {}
@@ -26,69 +28,78 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
 
 namespace {
 
+// The range the offsets of its corners point to from the anchor
+Range TranslateRange(Range offsets, Position anchor) {
+  return { { anchor.row + offsets.first.row, anchor.col + offsets.first.col },
+           { anchor.row + offsets.last.row, anchor.col + offsets.last.col } };
+}
+
 class Formula : public FormulaInterface {
   public:
-  explicit Formula(std::string expression)
-    : ast_(ParseFormulaAST(expression)) {
+  Formula(std::shared_ptr<const FormulaAST> ast, Position anchor)
+    : ast_(std::move(ast)),
+      anchor_(anchor) {
   }
 
   Value Evaluate(const SheetInterface& sheet) const override {
-    // Define a lambda function to handle arguments in the formula
-    const std::function<double(Position)> args =
-        [&sheet](const Position pos)->double {
-      // If the position is not valid, throw a reference error
-      if (!pos.IsValid()) { throw FormulaError(FormulaError::Category::Ref); }
+    // Define a lambda function to handle arguments in the formula,
+    // errors are returned boxed into NaNs rather than thrown
+    const auto args = [&sheet, anchor = anchor_](const Position offset)->double {
+      const Position pos{ anchor.row + offset.row, anchor.col + offset.col };
+      // If the position is not valid, return a reference error
+      if (!pos.IsValid()) {
+        return BoxFormulaError(FormulaError::Category::Ref);
+      }
 
       // Get the cell at the given position
       const auto* cell = sheet.GetCell(pos);
       // If the cell doesn't exist, return 0.0
       if (!cell) { return 0.0; }
-      // Retrieve the value of the cell
-      const auto& value = cell->GetValue();
-      // Check the type of the value and convert it to double if possible
+      // Retrieve the value of the cell as a number, text cells have it
+      // parsed in advance, so nothing is copied or parsed here
+      const auto value = cell->GetNumericValue();
       if (std::holds_alternative<double>(value)) {
           return std::get<double>(value);
       }
-      // If the value is a string, attempt to convert it to double
-      else if (std::holds_alternative<std::string>(value)) {
-        auto string_value = std::get<std::string>(value);
-        double result = 0.0;
-        if (!string_value.empty()) {
-          std::istringstream in(string_value);
-          // Try to extract a double value from the string
-          if (!(in >> result) || !in.eof()) {
-            // If extraction fails or not all characters
-            // are consumed, throw a value error
-            throw FormulaError(FormulaError::Category::Value);
-          }
-        }
-        return result;
+      // If the value is a FormulaError, pass it on
+      return BoxFormulaError(std::get<FormulaError>(value));
+    };
+
+    // Ranges are read as a whole: the sheet walks its storage
+    // and hands back the numbers of the range in one array
+    const auto range_args = [&sheet, anchor = anchor_](
+                                Range offsets,
+                                std::vector<double>& values)->double {
+      const Range range = TranslateRange(offsets, anchor);
+      if (!range.first.IsValid() || !range.last.IsValid()) {
+        return BoxFormulaError(FormulaError::Category::Ref);
       }
-      // If the value is a FormulaError, throw it
-      else if (std::holds_alternative<FormulaError>(value)) {
-        throw std::get<FormulaError>(value);
+      if (const auto error = sheet.GetRangeValues(range, values)) {
+        return BoxFormulaError(*error);
       }
-      // Unknown value type encountered
-      throw FormulaError(FormulaError::Category::Value);
+      return 0.0;
     };
 
     // Execute AST using the provided arguments
-    try { return ast_.Execute(args); }
-    // Catch any FormulaError thrown during execution and return it
-    catch (FormulaError& error) { return error; }
+    const double result = ast_->Execute(args, range_args);
+    // A NaN result carries the error the evaluation has stopped at
+    if (std::isnan(result)) { return UnboxFormulaError(result); }
+    return result;
   }
 
   std::vector<Position> GetReferencedCells() const override {
     // Vector to store unique referenced cells
     std::vector<Position> referenced_cells;
-    // Set to store unique cell positions
-    std::unordered_set<Position, PositionHasher> unique_cells;
 
-    // Iterate through the cells in AST
-    for (const auto& referenced_cell : ast_.GetCells()) {
-      // Check if the cell position is valid and not already present in the set
+    // The offsets are sorted, so are the cells they point to,
+    // and repetitions are next to each other
+    for (const auto offset : ast_->GetCells()) {
+      const Position referenced_cell{ anchor_.row + offset.row,
+                                      anchor_.col + offset.col };
+      // Check if the cell position is valid and not already added
       if (referenced_cell.IsValid()
-          && unique_cells.insert(referenced_cell).second) {
+          && (referenced_cells.empty()
+              || !(referenced_cells.back() == referenced_cell))) {
         // Add valid cell positions to the vector
         referenced_cells.push_back(referenced_cell);
       }
@@ -97,18 +108,40 @@ class Formula : public FormulaInterface {
     return referenced_cells;
   }
 
+  std::vector<Range> GetReferencedRanges() const override {
+    std::vector<Range> referenced_ranges;
+    // Formulas have a few ranges at most, a linear search is enough
+    for (const Range offsets : ast_->GetRanges()) {
+      const Range range = TranslateRange(offsets, anchor_);
+      if (range.first.IsValid() && range.last.IsValid()
+          && std::find(referenced_ranges.begin(), referenced_ranges.end(),
+                       range) == referenced_ranges.end()) {
+        referenced_ranges.push_back(range);
+      }
+    }
+    return referenced_ranges;
+  }
+
+  std::size_t GetMemoryUsage() const override {
+    return sizeof(*this)
+           + (sizeof(FormulaAST) + ast_->GetMemoryUsage()) / ast_.use_count();
+  }
+
   std::string GetExpression() const override {
     // Create an output string stream to store the expression
     std::ostringstream output;
     // Print the formula expression to the output stream
-    ast_.PrintFormula(output);
+    ast_->PrintFormula(output, anchor_);
     // Convert the content of the output stream to a string and return it
     return output.str();
   }
 
   private:
 
-  const FormulaAST ast_;
+  // Possibly shared with other cells of the same formula shape
+  std::shared_ptr<const FormulaAST> ast_;
+  // The cell the formula belongs to, the cells of the tree are relative to it
+  Position anchor_;
 };
 
 } // end of namespace
@@ -116,7 +149,43 @@ class Formula : public FormulaInterface {
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
   // Try to create a unique pointer to a Formula
   // object using the provided expression
-  try { return std::make_unique<Formula>(std::move(expression)); }
+  try {
+    return std::make_unique<Formula>(
+        std::make_shared<const FormulaAST>(ParseFormulaAST(expression)),
+        Position{});
+  }
   // If an exception is caught during formula parsing, throw a FormulaException
   catch (...) { throw FormulaException(EMPTY_SIGN); }
 }
+
+std::unique_ptr<FormulaInterface> FormulaTable::Parse(
+    std::string_view expression, Position anchor) {
+  std::optional<std::string> shape = GetFormulaShape(expression, anchor);
+  std::shared_ptr<const FormulaAST> ast;
+  auto it = shape ? shapes_.find(*shape) : shapes_.end();
+  if (it != shapes_.end()) { ast = it->second.lock(); }
+  if (!ast) {
+    try {
+      ast = std::make_shared<const FormulaAST>(
+          ParseFormulaAST(expression, anchor));
+    }
+    catch (...) { throw FormulaException(EMPTY_SIGN); }
+    // Only valid formulas get into the table
+    if (it != shapes_.end()) { it->second = ast; }
+    else if (shape) { shapes_.emplace(std::move(*shape), ast); }
+  }
+  if (shapes_.size() >= sweep_size_) {
+    Sweep();
+    sweep_size_ = std::max(sweep_size_, shapes_.size() * 2);
+  }
+  return std::make_unique<Formula>(std::move(ast), anchor);
+}
+
+std::size_t FormulaTable::GetShapeCount() const { return shapes_.size(); }
+
+void FormulaTable::Sweep() {
+  for (auto it = shapes_.begin(); it != shapes_.end();) {
+    if (it->second.expired()) { it = shapes_.erase(it); }
+    else { ++it; }
+  }
+}
@@ -8,8 +8,11 @@
 #include <cassert>
 #include <cctype>
 #include <sstream>
+#include <unordered_map>
 #include <unordered_set>
 #include <functional>
+#include <string>
+#include <string_view>
 
 class FormulaInterface {
   public:
@@ -18,6 +21,38 @@ class FormulaInterface {
   virtual Value Evaluate(const SheetInterface& sheet) const = 0;
   virtual std::string GetExpression() const = 0;
   virtual std::vector<Position> GetReferencedCells() const = 0;
+  // Ranges the functions of the formula aggregate, without repetitions
+  virtual std::vector<Range> GetReferencedRanges() const = 0;
+  // Bytes of memory the formula takes, the object included; a tree
+  // shared by several formulas is split evenly between them
+  virtual std::size_t GetMemoryUsage() const = 0;
 };
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+class FormulaAST;
+
+// Formulas of one shape relative to their cells, like =A1*B1 in C1
+// and =A2*B2 in C2, share one parsed and compiled formula
+class FormulaTable {
+  public:
+
+  // Parses the expression of the formula of the cell at the anchor,
+  // or reuses the formula of the same shape parsed before.
+  // Throws FormulaException if the expression is not a valid formula
+  std::unique_ptr<FormulaInterface> Parse(std::string_view expression,
+                                          Position anchor);
+
+  // Number of formula shapes the table holds, some may be unused already
+  std::size_t GetShapeCount() const;
+
+  private:
+
+  // Drops the shapes no formula uses anymore
+  void Sweep();
+
+  std::unordered_map<std::string, std::weak_ptr<const FormulaAST>> shapes_;
+
+  // The shapes are swept once the table grows that big
+  std::size_t sweep_size_ = 1024;
+};
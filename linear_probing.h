@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+
+// Erasure from an open-addressing table with linear probing, without
+// tombstones. The slot at hole has just been emptied in a table of
+// mask + 1 slots; every following entry of its probe run that a lookup
+// would no longer reach is moved back into the hole, which moves on to
+// the slot the entry left. Returns the slot left empty in the end, the
+// caller clears it.
+// is_empty(i) tells if slot i is empty, home_of(i) returns the slot
+// the entry of slot i hashes to, move(from, to) moves an entry
+template <typename IsEmpty, typename HomeOf, typename Move>
+std::size_t ShiftProbeRunBack(std::size_t hole, std::size_t mask,
+                              IsEmpty is_empty, HomeOf home_of, Move move) {
+  for (std::size_t i = (hole + 1) & mask; !is_empty(i); i = (i + 1) & mask) {
+    // The entry stays unless its home lies cyclically in (hole, i]
+    if (((i - home_of(i)) & mask) >= ((i - hole) & mask)) {
+      move(i, hole);
+      hole = i;
+    }
+  }
+  return hole;
+}
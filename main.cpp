@@ -1,7 +1,23 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <limits>
+#include <optional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
 #include "common.h"
+#include "FormulaAST.h"
 #include "formula.h"
+#include "position_map.h"
+#include "range_index.h"
+#include "small_set.h"
+#include "sheet.h"
+#include "slab_allocator.h"
 #include "test_runner_p.h"
+#include "thread_pool.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
   return output << "(" << pos.row << ", " << pos.col << ")";
@@ -124,6 +140,74 @@ void TestClearCell() {
   sheet->ClearCell("J10"_pos);
 }
 
+void TestReclaimClearedCells() {
+  for (auto make_storage : { CreateHashCellStorage, CreateTiledCellStorage }) {
+    Sheet sheet(make_storage());
+    // Cells created for references go with the last formula using them
+    sheet.SetCell("A1"_pos, "=B1+C1");
+    sheet.SetCell("A2"_pos, "=C1");
+    ASSERT(sheet.GetCell("B1"_pos) != nullptr);
+    sheet.ClearCell("A1"_pos);
+    ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("C1"_pos) != nullptr);
+    sheet.SetCell("A2"_pos, "text");
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+
+    // A cleared cell stays while referenced and keeps no edges
+    sheet.SetCell("B1"_pos, "=C1");
+    sheet.SetCell("A1"_pos, "=B1");
+    sheet.ClearCell("B1"_pos);
+    ASSERT(sheet.GetCell("B1"_pos) != nullptr);
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    ASSERT(sheet.GetConcreteCell("B1"_pos)->GetOutgoingCells().Empty());
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+
+    // Failed edits leave no cells behind
+    bool caught = false;
+    try { sheet.SetCell("Z9"_pos, "=Z9"); }
+    catch (const CircularDependencyException&) { caught = true; }
+    ASSERT(caught);
+    ASSERT(sheet.GetCell("Z9"_pos) == nullptr);
+    caught = false;
+    try { sheet.SetCell("Z9"_pos, "=1+"); }
+    catch (const FormulaException&) { caught = true; }
+    ASSERT(caught);
+    ASSERT(sheet.GetCell("Z9"_pos) == nullptr);
+
+    // Churning through an area gives all the memory back
+    sheet.ClearCell("A1"_pos);
+    sheet.ClearCell("A2"_pos);
+    sheet.ShrinkToFit();
+    ASSERT_EQUAL(sheet.GetMemoryUsage(), 0u);
+    for (int round = 0; round < 3; ++round) {
+      for (int row = 0; row < 200; ++row) {
+        const Position pos{ row + round * 1000, round };
+        sheet.SetCell(pos, "=" + Position{ row + 5000, 40 }.ToString()
+                               + "+SUM(E1:F" + std::to_string(row + 1) + ")");
+      }
+      ASSERT_EQUAL(sheet.GetColumnValues(round, round * 1000,
+                                         round * 1000 + 1).numbers[0], 0.0);
+      for (int row = 0; row < 200; ++row) {
+        sheet.ClearCell({ row + round * 1000, round });
+      }
+    }
+    ASSERT(sheet.GetRangeIndex().GetSize() == 0);
+    sheet.ShrinkToFit();
+    ASSERT_EQUAL(sheet.GetMemoryUsage(), 0u);
+
+    // The sheet works as before after the compaction
+    sheet.SetCell("B2"_pos, "=A1*2");
+    sheet.SetCell("A1"_pos, "=1.5");
+    ASSERT_EQUAL(sheet.GetColumnValues(1, 0, 2).numbers[1], 3.0);
+    sheet.ShrinkToFit();
+    sheet.SetCell("A1"_pos, "=4");
+    ASSERT_EQUAL(sheet.GetColumnValues(1, 0, 2).numbers[1], 8.0);
+    ASSERT_EQUAL(sheet.GetColumnValues(0, 0, 1).numbers[0], 4.0);
+  }
+}
+
 void TestFormulaArithmetic() {
   auto sheet = CreateSheet();
   auto evaluate =
@@ -285,6 +369,118 @@ void TestPrint() {
   ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
 }
 
+void TestPrintableSizeShrinks() {
+  auto sheet = CreateSheet();
+  sheet->SetCell("C5"_pos, "=E10");
+  // Cells only referenced have no text and are not printed
+  ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 5, 3 }));
+  sheet->SetCell("B2"_pos, "x");
+  sheet->ClearCell("C5"_pos);
+  ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 2, 2 }));
+  sheet->SetCell("B2"_pos, "");
+  ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 0, 0 }));
+
+  // Random edits against the bounding rectangle of a model
+  std::mt19937 generator(11);
+  std::uniform_int_distribution<int> row_of(0, Position::MAX_ROWS - 1);
+  std::uniform_int_distribution<int> col_of(0, Position::MAX_COLS - 1);
+  std::uniform_int_distribution<int> action_of(0, 3);
+  std::vector<Position> written;
+  std::set<Position> model;
+  for (int i = 0; i < 3000; ++i) {
+    const int action = action_of(generator);
+    if (action < 2 || written.empty()) {
+      // Near the corner sometimes, so that the outermost lines are hit
+      Position pos{ row_of(generator), col_of(generator) };
+      if (action == 0) { pos = { pos.row % 8, pos.col % 8 }; }
+      sheet->SetCell(pos, "text");
+      written.push_back(pos);
+      model.insert(pos);
+    }
+    else {
+      const Position pos = written[std::uniform_int_distribution<std::size_t>(
+          0, written.size() - 1)(generator)];
+      action == 2 ? sheet->ClearCell(pos) : sheet->SetCell(pos, "");
+      model.erase(pos);
+    }
+    Size expected{ 0, 0 };
+    for (const Position& pos : model) {
+      expected.rows = std::max(expected.rows, pos.row + 1);
+      expected.cols = std::max(expected.cols, pos.col + 1);
+    }
+    ASSERT_EQUAL(sheet->GetPrintableSize(), expected);
+  }
+
+  // A batch rolled back leaves the size as it was
+  Sheet other;
+  other.SetCell("A1"_pos, "=B1");
+  bool caught = false;
+  try {
+    other.SetCells({ { "Z100"_pos, "far" }, { "B1"_pos, "=A1" } });
+  }
+  catch (const CircularDependencyException&) { caught = true; }
+  ASSERT(caught);
+  ASSERT_EQUAL(other.GetPrintableSize(), (Size{ 1, 1 }));
+}
+
+void TestPrintSparse() {
+  // What the printers produce, cell by cell over the whole printable area
+  const auto print_slowly = [](const SheetInterface& sheet,
+                               std::ostream& output, bool values) {
+    const Size size = sheet.GetPrintableSize();
+    for (int row = 0; row < size.rows; ++row) {
+      for (int col = 0; col < size.cols; ++col) {
+        if (col > 0) { output << '\t'; }
+        const CellInterface* cell = sheet.GetCell({ row, col });
+        if (cell == nullptr) { continue; }
+        if (!values) {
+          output << cell->GetText();
+          continue;
+        }
+        std::visit([&output](const auto& value) { output << value; },
+                   cell->GetValue());
+      }
+      output << '\n';
+    }
+  };
+
+  auto sheet = CreateSheet();
+  std::mt19937 generator(7);
+  std::uniform_int_distribution<int> row_of(0, 3000);
+  std::uniform_int_distribution<int> col_of(0, 150);
+  for (int i = 0; i < 300; ++i) {
+    const Position pos{ row_of(generator), col_of(generator) };
+    const Position other{ row_of(generator), col_of(generator) };
+    switch (i % 4) {
+      case 0: sheet->SetCell(pos, "text " + std::to_string(i)); break;
+      case 1: sheet->SetCell(pos, "=" + std::to_string(i) + "/7"); break;
+      case 2: sheet->SetCell(pos, "=1e" + std::to_string(i % 40) + "/3"); break;
+      case 3: sheet->SetCell(pos, "=" + other.ToString() + "/0"); break;
+    }
+  }
+  sheet->SetCell("A1"_pos, "'=escaped");
+  sheet->SetCell("B1"_pos, "=-0.0");
+
+  // Numbers follow the format the stream is set to
+  const auto check = [&](std::ostringstream& output) {
+    std::ostringstream expected;
+    expected.copyfmt(output);
+    for (bool values : { false, true }) {
+      values ? sheet->PrintValues(output) : sheet->PrintTexts(output);
+      print_slowly(*sheet, expected, values);
+    }
+    ASSERT(output.str() == expected.str());
+  };
+  std::ostringstream output;
+  check(output);
+  std::ostringstream precise;
+  precise.precision(12);
+  check(precise);
+  std::ostringstream fixed;
+  fixed << std::fixed;
+  check(fixed);
+}
+
 void TestCellReferences() {
   auto sheet = CreateSheet();
   sheet->SetCell("A1"_pos, "1");
@@ -343,6 +539,1221 @@ void TestCellCircularReferences() {
   ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
 
+void TestFormulaCacheInvalidation() {
+  auto sheet = CreateSheet();
+  sheet->SetCell("A1"_pos, "1");
+  sheet->SetCell("A2"_pos, "=A1+1");
+  sheet->SetCell("A3"_pos, "=A2*2");
+  ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+
+  sheet->SetCell("A1"_pos, "5");
+  ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.0));
+  ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(),
+               CellInterface::Value(12.0));
+
+  sheet->SetCell("A2"_pos, "=A1/0");
+  ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(),
+               CellInterface::Value(FormulaError::Category::Div0));
+
+  sheet->SetCell("A2"_pos, "=A1");
+  sheet->ClearCell("A1"_pos);
+  ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
+void TestPositionMap() {
+  PositionMap<int> map;
+  ASSERT(map.Find("A1"_pos) == nullptr);
+  ASSERT(!map.Erase("A1"_pos));
+
+  for (int row = 0; row < 100; ++row) {
+    for (int col = 0; col < 100; ++col) {
+      map[Position{ row, col }] = row * 100 + col;
+    }
+  }
+  map[Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }] = -1;
+  ASSERT_EQUAL(map.Size(), 10001u);
+  ASSERT_EQUAL(*map.Find("C2"_pos), 102);
+  ASSERT_EQUAL(*map.Find("XFD16384"_pos), -1);
+  ASSERT(map.Find("A101"_pos) == nullptr);
+
+  // Erase every other entry and check the rest are still reachable
+  for (int row = 0; row < 100; ++row) {
+    for (int col = row % 2; col < 100; col += 2) {
+      ASSERT(map.Erase(Position{ row, col }));
+    }
+  }
+  ASSERT_EQUAL(map.Size(), 5001u);
+  for (int row = 0; row < 100; ++row) {
+    for (int col = 0; col < 100; ++col) {
+      const int* value = map.Find(Position{ row, col });
+      if ((row + col) % 2 == 0) { ASSERT(value == nullptr); }
+      else { ASSERT(value != nullptr && *value == row * 100 + col); }
+    }
+  }
+
+  int visited = 0;
+  map.ForEach([&](Position pos, int value) {
+    ASSERT_EQUAL(PositionMap<int>::Unpack(PositionMap<int>::Pack(pos)), pos);
+    ASSERT_EQUAL(*map.Find(pos), value);
+    ++visited;
+  });
+  ASSERT_EQUAL(visited, 5001);
+}
+
+void TestSmallSet() {
+  // Random edits against std::set, across the inline limit both ways
+  std::mt19937 generator(5);
+  std::uniform_int_distribution<int> value_dist(1, 40);
+  SmallSet<int, 3> set;
+  std::set<int> expected;
+  for (int i = 0; i < 20000; ++i) {
+    const int value = value_dist(generator);
+    // Keep the set small most of the time, like the edges of a cell
+    if (i % 1000 < 500 ? expected.size() < 5 : generator() % 3 != 0) {
+      ASSERT_EQUAL(set.Insert(value), expected.insert(value).second);
+    }
+    else {
+      ASSERT_EQUAL(set.Erase(value), expected.erase(value) == 1);
+    }
+    ASSERT_EQUAL(set.Size(), expected.size());
+    ASSERT_EQUAL(set.Contains(value), expected.count(value) == 1);
+    if (expected.size() < 3) { ASSERT_EQUAL(set.GetMemoryUsage(), 0u); }
+    if (expected.size() > 3) { ASSERT(set.GetMemoryUsage() > 0); }
+    if (i % 100 == 0) {
+      const SmallSet<int, 3> copy = set;
+      SmallSet<int, 3> moved;
+      moved = SmallSet<int, 3>(copy);
+      std::set<int> copied(copy.begin(), copy.end());
+      ASSERT(copied == expected);
+      ASSERT(std::set<int>(moved.begin(), moved.end()) == expected);
+      ASSERT(std::set<int>(set.begin(), set.end()) == expected);
+    }
+  }
+  set.Clear();
+  ASSERT(set.Empty() && set.begin() == set.end());
+  ASSERT_EQUAL(set.GetMemoryUsage(), 0u);
+
+  // Cells with a few edges keep them inline
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1");
+  sheet.SetCell("Z1"_pos, "");
+  const std::size_t before_formula = sheet.GetMemoryUsage();
+  sheet.SetCell("B1"_pos, "=A1+A2+A3");
+  ASSERT_EQUAL(sheet.GetConcreteCell("B1"_pos)->GetOutgoingCells().Size(), 3u);
+  ASSERT_EQUAL(sheet.GetConcreteCell("A2"_pos)->GetMemoryUsage(),
+               sheet.GetConcreteCell("Z1"_pos)->GetMemoryUsage());
+  ASSERT(sheet.GetMemoryUsage() > before_formula);
+  // A cell many formulas reference moves its edges to the heap
+  const std::size_t before_fan_in =
+      sheet.GetConcreteCell("A1"_pos)->GetMemoryUsage();
+  for (int row = 1; row < 10; ++row) {
+    sheet.SetCell(Position{ row, 1 }, "=A1");
+  }
+  const Cell* referenced = sheet.GetConcreteCell("A1"_pos);
+  ASSERT_EQUAL(referenced->GetIncomingCells().Size(), 10u);
+  ASSERT(referenced->GetMemoryUsage() > before_fan_in);
+  for (int row = 1; row < 10; ++row) { sheet.SetCell(Position{ row, 1 }, "1"); }
+  ASSERT_EQUAL(referenced->GetMemoryUsage(), before_fan_in);
+}
+
+void TestSlabAllocator() {
+  SlabAllocator allocator;
+  ASSERT_EQUAL(allocator.GetMemoryUsage(), 0u);
+  // Blocks of a size class share slabs and do not overlap
+  std::vector<std::uint32_t*> blocks;
+  for (std::uint32_t i = 0; i < 20000; ++i) {
+    blocks.push_back(static_cast<std::uint32_t*>(allocator.Allocate(24)));
+    ASSERT_EQUAL(reinterpret_cast<std::uintptr_t>(blocks.back())
+                     % alignof(std::max_align_t),
+                 0u);
+    *blocks.back() = i;
+  }
+  for (std::uint32_t i = 0; i < blocks.size(); ++i) {
+    ASSERT_EQUAL(*blocks[i], i);
+  }
+  const std::size_t full_usage = allocator.GetMemoryUsage();
+  ASSERT(full_usage > 0 && full_usage < 20000 * 64);
+  // A freed block is handed out again
+  void* freed = blocks[100];
+  allocator.Deallocate(freed, 24);
+  blocks[100] = static_cast<std::uint32_t*>(allocator.Allocate(24));
+  ASSERT_EQUAL(static_cast<void*>(blocks[100]), freed);
+  ASSERT_EQUAL(allocator.GetMemoryUsage(), full_usage);
+  // Once no block is in use the slabs are given back but the first one
+  for (std::uint32_t* block : blocks) { allocator.Deallocate(block, 24); }
+  ASSERT(allocator.GetMemoryUsage() > 0);
+  ASSERT(allocator.GetMemoryUsage() < full_usage);
+  allocator.ReleaseEmptySlabs();
+  ASSERT_EQUAL(allocator.GetMemoryUsage(), 0u);
+  // Big blocks bypass the slabs
+  void* big = allocator.Allocate(4096);
+  ASSERT_EQUAL(allocator.GetMemoryUsage(), 0u);
+  allocator.Deallocate(big, 4096);
+
+  // A sheet keeps the contents of its cells in slabs
+  Sheet sheet;
+  for (int row = 0; row < 1000; ++row) {
+    sheet.SetCell(Position{ row, 0 }, "text");
+    sheet.SetCell(Position{ row, 1 }, "=A1+1");
+  }
+  ASSERT(sheet.GetAllocator().GetMemoryUsage() > 0);
+  for (int row = 0; row < 1000; ++row) {
+    sheet.ClearCell(Position{ row, 0 });
+    sheet.ClearCell(Position{ row, 1 });
+  }
+  sheet.ShrinkToFit();
+  ASSERT_EQUAL(sheet.GetAllocator().GetMemoryUsage(), 0u);
+  ASSERT_EQUAL(sheet.GetMemoryUsage(), 0u);
+}
+
+void TestColumnValues() {
+  for (auto make_storage : { CreateHashCellStorage, CreateTiledCellStorage }) {
+    Sheet sheet(make_storage());
+    sheet.SetCell("A1"_pos, "=1.5");
+    sheet.SetCell("A2"_pos, "text");
+    sheet.SetCell("A3"_pos, "'=escaped");
+    sheet.SetCell("A4"_pos, "=A1*2");
+    sheet.SetCell("A5"_pos, "=1/0");
+    sheet.SetCell("A6"_pos, "'");
+    sheet.SetCell("A8"_pos, "text");
+    sheet.SetCell("B1"_pos, "=A1+1");
+
+    ColumnValues values = sheet.GetColumnValues(0, 0, 10);
+    ASSERT_EQUAL(values.size(), 10u);
+    const std::vector<ValueType> types{
+        ValueType::Number, ValueType::Text, ValueType::Text,
+        ValueType::Number, ValueType::Error, ValueType::Text,
+        ValueType::Empty, ValueType::Text, ValueType::Empty,
+        ValueType::Empty };
+    ASSERT(std::vector(values.types.begin(), values.types.end()) == types);
+    ASSERT_EQUAL(values.numbers[0], 1.5);
+    ASSERT_EQUAL(values.numbers[3], 3.0);
+    ASSERT_EQUAL(values.GetText(1), "text");
+    ASSERT_EQUAL(values.GetText(2), "=escaped");
+    ASSERT_EQUAL(values.GetText(5), "");
+    ASSERT_EQUAL(values.GetError(4), FormulaError(FormulaError::Category::Div0));
+    // Equal texts are stored once
+    ASSERT_EQUAL(values.ids[1], values.ids[7]);
+
+    // A part of a column, and a column beyond the written ones
+    values = sheet.GetColumnValues(0, 3, 5);
+    ASSERT_EQUAL(values.size(), 2u);
+    ASSERT_EQUAL(values.numbers[0], 3.0);
+    values = sheet.GetColumnValues(5, 0, 3);
+    ASSERT(std::all_of(values.types.begin(), values.types.end(),
+                       [](ValueType type) { return type == ValueType::Empty; }));
+
+    // Edits reach the cached values of their dependents in other columns
+    ASSERT_EQUAL(sheet.GetColumnValues(1, 0, 1).numbers[0], 2.5);
+    sheet.SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(sheet.GetColumnValues(1, 0, 1).numbers[0], 5.0);
+    values = sheet.GetColumnValues(0, 0, 10);
+    ASSERT_EQUAL(values.numbers[3], 8.0);
+    sheet.SetCell("A2"_pos, "other");
+    sheet.ClearCell("A8"_pos);
+    sheet.SetCell("A9"_pos, "=A20");
+    sheet.SetCell("A20"_pos, "x");
+    values = sheet.GetColumnValues(0, 0, 20);
+    ASSERT_EQUAL(values.GetText(1), "other");
+    ASSERT(values.types[7] == ValueType::Empty);
+    ASSERT(values.types[8] == ValueType::Error);
+    ASSERT_EQUAL(values.GetError(8), FormulaError(FormulaError::Category::Value));
+    ASSERT(values.types[19] == ValueType::Text);
+
+    // The values agree with the cells
+    for (int row = 0; row < 20; ++row) {
+      const CellInterface* cell = sheet.GetCell({ row, 0 });
+      const auto value = cell != nullptr ? cell->GetValue()
+                                         : CellInterface::Value();
+      switch (values.types[row]) {
+        case ValueType::Empty:
+          ASSERT(cell == nullptr || cell->GetText().empty());
+          break;
+        case ValueType::Number:
+          ASSERT_EQUAL(std::get<double>(value), values.numbers[row]);
+          break;
+        case ValueType::Text:
+          ASSERT_EQUAL(std::get<std::string>(value), values.GetText(row));
+          break;
+        case ValueType::Error:
+          ASSERT_EQUAL(std::get<FormulaError>(value), values.GetError(row));
+          break;
+      }
+    }
+
+    bool caught = false;
+    try { sheet.GetColumnValues(0, 5, 4); }
+    catch (const InvalidPositionException&) { caught = true; }
+    ASSERT(caught);
+  }
+
+  // Texts nobody holds anymore leave the pool
+  StringPool pool;
+  const std::uint32_t id = pool.Intern("a");
+  ASSERT_EQUAL(pool.Intern("a"), id);
+  ASSERT(pool.Intern("b") != id);
+  ASSERT_EQUAL(pool.GetSize(), 2u);
+  pool.Release(id);
+  ASSERT_EQUAL(pool.GetSize(), 2u);
+  pool.Release(id);
+  ASSERT_EQUAL(pool.GetSize(), 1u);
+  ASSERT_EQUAL(pool.Intern("c"), id);
+  ASSERT_EQUAL(pool.Get(id), "c");
+}
+
+void TestValueViews() {
+  auto sheet = CreateSheet();
+  sheet->SetCell("A1"_pos, "'=escaped");
+  sheet->SetCell("A2"_pos, "=A3 + 1");
+  sheet->SetCell("A3"_pos, "=1/0");
+  sheet->SetCell("A4"_pos, "text");
+  sheet->ClearCell("A4"_pos);
+
+  // Texts are viewed in place, the escape sign is skipped
+  const CellInterface* text = sheet->GetCell("A1"_pos);
+  const auto value = text->GetValueView();
+  ASSERT_EQUAL(std::get<std::string_view>(value), "=escaped");
+  ASSERT(std::get<std::string_view>(value).data()
+         == text->GetTextView().data() + 1);
+  ASSERT_EQUAL(text->GetTextView(), text->GetText());
+
+  // The canonical formula text is printed once and kept
+  const CellInterface* formula = sheet->GetCell("A2"_pos);
+  const std::string_view formula_text = formula->GetTextView();
+  ASSERT_EQUAL(formula_text, "=A3+1");
+  ASSERT(formula->GetTextView().data() == formula_text.data());
+  ASSERT_EQUAL(formula->GetText(), "=A3+1");
+  ASSERT_EQUAL(std::get<FormulaError>(formula->GetValueView()),
+               FormulaError(FormulaError::Category::Div0));
+  sheet->SetCell("A3"_pos, "2");
+  ASSERT_EQUAL(std::get<double>(formula->GetValueView()), 3.0);
+  ASSERT_EQUAL(formula->GetValue(), CellInterface::Value(3.0));
+  sheet->SetCell("A2"_pos, "=(A3)*2");
+  ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetTextView(), "=A3*2");
+
+  // Threads reading the text of one formula for the first time
+  // all get the one printed text
+  sheet->SetCell("B1"_pos, "=(A3+1)*(A3-1)");
+  const CellInterface* shared = sheet->GetCell("B1"_pos);
+  std::vector<std::string_view> texts(4);
+  std::vector<std::thread> readers;
+  for (std::string_view& read : texts) {
+    readers.emplace_back([shared, &read] { read = shared->GetTextView(); });
+  }
+  for (std::thread& reader : readers) { reader.join(); }
+  for (std::string_view read : texts) {
+    ASSERT_EQUAL(read, "=(A3+1)*(A3-1)");
+    ASSERT(read.data() == texts.front().data());
+  }
+
+  // A cleared cell has neither a text nor a value
+  if (const CellInterface* cleared = sheet->GetCell("A4"_pos)) {
+    ASSERT(cleared->GetTextView().empty());
+    ASSERT(std::get<std::string_view>(cleared->GetValueView()).empty());
+  }
+}
+
+void TestTextInterning() {
+  const std::string labels[] = { "USD", "EUR", "'=escaped", " 2.5", "N/A" };
+  const int rows = 2000;
+  Sheet interned;
+  interned.SetTextInterning(true);
+  Sheet plain;
+  for (Sheet* sheet : { &interned, &plain }) {
+    for (int row = 0; row < rows; ++row) {
+      sheet->SetCell(Position{ row, 0 }, labels[row % 5]);
+    }
+    sheet->SetCell("B1"_pos, "=A4*2");
+    sheet->SetCell("B2"_pos, "=SUM(A1:A10)");
+    sheet->SetCell("B3"_pos, "=A1");
+  }
+
+  // Interned texts read the same as the texts cells keep themselves
+  ASSERT_EQUAL(interned.GetTextTable().GetSize(), 5u);
+  ASSERT_EQUAL(plain.GetTextTable().GetSize(), 0u);
+  for (int row = 0; row < rows; ++row) {
+    const Position pos{ row, 0 };
+    ASSERT_EQUAL(interned.GetCell(pos)->GetText(),
+                 plain.GetCell(pos)->GetText());
+    ASSERT_EQUAL(interned.GetCell(pos)->GetValue(),
+                 plain.GetCell(pos)->GetValue());
+  }
+  ASSERT_EQUAL(std::get<std::string_view>(
+                   interned.GetCell("A3"_pos)->GetValueView()), "=escaped");
+  // Equal texts share one copy
+  ASSERT(interned.GetCell("A1"_pos)->GetTextView().data()
+         == interned.GetCell("A6"_pos)->GetTextView().data());
+  for (int row = 0; row < 3; ++row) {
+    const Position pos{ row, 1 };
+    ASSERT_EQUAL(interned.GetCell(pos)->GetValue(),
+                 plain.GetCell(pos)->GetValue());
+  }
+  ASSERT_EQUAL(std::get<double>(interned.GetCell("B1"_pos)->GetValue()), 5.0);
+  std::ostringstream interned_texts;
+  std::ostringstream plain_texts;
+  interned.PrintTexts(interned_texts);
+  plain.PrintTexts(plain_texts);
+  ASSERT_EQUAL(interned_texts.str(), plain_texts.str());
+  ASSERT(interned.GetMemoryUsage() < plain.GetMemoryUsage());
+
+  // A text is dropped with its last cell, and its id is reused
+  for (int row = 4; row < rows; row += 5) {
+    interned.SetCell(Position{ row, 0 }, "EUR");
+  }
+  ASSERT_EQUAL(interned.GetTextTable().GetSize(), 4u);
+  interned.SetCell("A5"_pos, "GBP");
+  ASSERT_EQUAL(interned.GetTextTable().GetSize(), 5u);
+  ASSERT_EQUAL(interned.GetCell("A5"_pos)->GetText(), "GBP");
+
+  // Texts set once interning is turned off are kept by their cells,
+  // the texts interned before stay in the table
+  interned.SetTextInterning(false);
+  interned.SetCells({ { "A1"_pos, "USD" }, { "A2"_pos, "EUR" } });
+  ASSERT_EQUAL(interned.GetCell("A1"_pos)->GetText(), "USD");
+  ASSERT_EQUAL(interned.GetTextTable().GetSize(), 5u);
+  for (int row = 0; row < rows; ++row) {
+    interned.ClearCell(Position{ row, 0 });
+  }
+  interned.ClearCell("B1"_pos);
+  interned.ClearCell("B2"_pos);
+  interned.ClearCell("B3"_pos);
+  ASSERT_EQUAL(interned.GetTextTable().GetSize(), 0u);
+  interned.ShrinkToFit();
+  ASSERT_EQUAL(interned.GetMemoryUsage(), 0u);
+}
+
+void TestSparseSheetMemory() {
+  // Cells scattered over the whole sheet take memory by the cell,
+  // not by the area around them
+  Sheet sheet;
+  std::mt19937 generator(11);
+  std::uniform_int_distribution<int> row_of(0, Position::MAX_ROWS - 1);
+  std::uniform_int_distribution<int> col_of(0, Position::MAX_COLS - 1);
+  for (int i = 0; i < 1000; ++i) {
+    sheet.SetCell(Position{ row_of(generator), col_of(generator) },
+                  std::to_string(i));
+  }
+  ASSERT(sheet.GetMemoryUsage() < 1000 * 1024);
+}
+
+void TestCellStorageBackends() {
+  auto fill = [](std::unique_ptr<SheetInterface> sheet) {
+    // Spread the cells over several tiles and leave gaps between them
+    for (int row = 0; row < 150; row += 7) {
+      for (int col = 0; col < 40; col += 3) {
+        sheet->SetCell(Position{ row, col },
+                       std::to_string(row * 100 + col));
+      }
+    }
+    sheet->SetCell("AZ200"_pos, "=A1+AN148");
+    sheet->SetCell("A1"_pos, "=B2");
+    sheet->ClearCell("D1"_pos);
+    ASSERT(sheet->GetCell("D1"_pos) == nullptr);
+    ASSERT(sheet->GetCell("B2"_pos) != nullptr);
+    ASSERT_EQUAL(sheet->GetCell("AZ200"_pos)->GetValue(),
+                 CellInterface::Value(14739.0));
+
+    std::ostringstream output;
+    sheet->PrintTexts(output);
+    sheet->PrintValues(output);
+    return output.str();
+  };
+
+  ASSERT_EQUAL(fill(CreateSheet(CreateHashCellStorage())),
+               fill(CreateSheet(CreateTiledCellStorage())));
+}
+
+void TestDeepChainEvaluation() {
+  // A chain much deeper than the call stack would allow to recurse through,
+  // snaking over the columns as it is longer than a column
+  const int depth = 100000;
+  auto at = [](int i) {
+    return Position{ i % Position::MAX_ROWS, i / Position::MAX_ROWS };
+  };
+  auto sheet = CreateSheet();
+  sheet->SetCell(at(0), "1");
+  for (int i = 1; i < depth; ++i) {
+    sheet->SetCell(at(i), "=" + at(i - 1).ToString() + "+1");
+  }
+  ASSERT_EQUAL(sheet->GetCell(at(depth - 1))->GetValue(),
+               CellInterface::Value(static_cast<double>(depth)));
+}
+
+void TestRecalculate() {
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "2");
+  sheet.SetCell("B1"_pos, "=A1*10");
+  sheet.SetCell("C1"_pos, "=A1+B1");
+  sheet.SetCell("D1"_pos, "=C1/B1");
+  sheet.SetCell("E1"_pos, "=D1-Z9");
+  sheet.Recalculate();
+  for (const auto pos : { "B1"_pos, "C1"_pos, "D1"_pos, "E1"_pos }) {
+    ASSERT(sheet.GetConcreteCell(pos)->IsCacheValid());
+  }
+  ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(1.1));
+
+  sheet.SetCell("A1"_pos, "0");
+  ASSERT(!sheet.GetConcreteCell("E1"_pos)->IsCacheValid());
+  sheet.Recalculate();
+  ASSERT(sheet.GetConcreteCell("E1"_pos)->IsCacheValid());
+  ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(),
+               CellInterface::Value(FormulaError::Category::Div0));
+
+  // Rewiring a dependency changes the order
+  sheet.SetCell("B1"_pos, "=E2+1");
+  sheet.SetCell("E2"_pos, "=A1+4");
+  sheet.Recalculate();
+  ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(1.0));
+}
+
+void TestRecalculateMarkedCells() {
+  Sheet sheet;
+  const int rows = 2000;
+  for (int row = 0; row < rows; ++row) {
+    sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+    sheet.SetCell(Position{ row, 1 },
+                  "=" + Position{ row, 0 }.ToString() + "*2");
+  }
+  sheet.Recalculate();
+
+  // A formula set over and over is marked every time
+  for (int round = 0; round < 3000; ++round) {
+    sheet.SetCell("B5"_pos, "=A5+" + std::to_string(round));
+  }
+  // Marked cells may be erased or evaluated before the recalculation
+  sheet.SetCell("C1"_pos, "=B5");
+  sheet.SetCell("C2"_pos, "=B5");
+  sheet.ClearCell("C1"_pos);
+  ASSERT(sheet.GetConcreteCell("C1"_pos) == nullptr);
+  ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(),
+               CellInterface::Value(3003.0));
+  sheet.SetCell("A7"_pos, "1");
+  ASSERT(!sheet.GetConcreteCell("B7"_pos)->IsCacheValid());
+  sheet.Recalculate();
+  ASSERT(sheet.GetConcreteCell("B5"_pos)->IsCacheValid());
+  ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetValue(), CellInterface::Value(2.0));
+  for (int row = 0; row < rows; ++row) {
+    ASSERT(sheet.GetConcreteCell(Position{ row, 1 })->IsCacheValid());
+  }
+}
+
+void TestThreadPoolExceptions() {
+  ThreadPool pool(4);
+  for (std::size_t failing : { std::size_t{ 0 }, std::size_t{ 5000 } }) {
+    std::atomic<std::size_t> calls{ 0 };
+    bool thrown = false;
+    try {
+      pool.ParallelFor(10000, [&](std::size_t i) {
+        ++calls;
+        if (i == failing) { throw std::runtime_error("task failed"); }
+      });
+    }
+    catch (const std::runtime_error& error) {
+      thrown = error.what() == std::string("task failed");
+    }
+    ASSERT(thrown);
+    ASSERT(calls <= 10000u);
+  }
+  // The pool runs the next batch as usual
+  std::vector<int> done(1000, 0);
+  pool.ParallelFor(done.size(), [&](std::size_t i) { done[i] = 1; });
+  ASSERT(std::count(done.begin(), done.end(), 1) == 1000);
+}
+
+void TestParallelRecalculate() {
+  auto fill = [](Sheet& sheet) {
+    const int rows = 1000;
+    for (int row = 1; row <= rows; ++row) {
+      const std::string r = std::to_string(row);
+      const std::string next = std::to_string(row % rows + 1);
+      sheet.SetCell(Position::FromString("A" + r), std::to_string(row % 10));
+      sheet.SetCell(Position::FromString("B" + r), "=A" + r + "*2");
+      sheet.SetCell(Position::FromString("C" + r), "=B" + r + "+A" + next);
+      sheet.SetCell(Position::FromString("D" + r), "=C" + r + "/(A" + r + "-5)");
+      sheet.SetCell(Position::FromString("E" + r), "=D" + r + "+D" + next);
+    }
+  };
+  auto print = [](const Sheet& sheet) {
+    std::ostringstream output;
+    sheet.PrintValues(output);
+    return output.str();
+  };
+
+  Sheet serial;
+  fill(serial);
+  serial.Recalculate();
+
+  Sheet parallel;
+  parallel.SetRecalculationThreads(4);
+  fill(parallel);
+  parallel.Recalculate();
+  ASSERT(parallel.GetConcreteCell("E1000"_pos)->IsCacheValid());
+  ASSERT_EQUAL(print(parallel), print(serial));
+
+  serial.SetCell("A7"_pos, "5");
+  parallel.SetCell("A7"_pos, "5");
+  parallel.Recalculate();
+  ASSERT_EQUAL(print(parallel), print(serial));
+}
+
+void TestFormulaDeepExpression() {
+  auto sheet = CreateSheet();
+  sheet->SetCell("A1"_pos, "=2");
+  // Right-nested sums keep every operand on the evaluation stack
+  std::string expression = "A1";
+  for (int i = 0; i < 200; ++i) { expression = "1-(A1+" + expression + ")"; }
+  sheet->SetCell("B1"_pos, "=" + expression);
+  ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+  ASSERT_EQUAL(std::get<double>(
+                   ParseFormula("-(-1-2)*-3/(4--2)")->Evaluate(*sheet)),
+               -1.5);
+}
+
+void TestErrorPropagationOrder() {
+  auto sheet = CreateSheet();
+  sheet->SetCell("A1"_pos, "=1/0");
+  sheet->SetCell("A2"_pos, "text");
+  // The first error met in evaluation order wins
+  sheet->SetCell("B1"_pos, "=A1+A2");
+  sheet->SetCell("B2"_pos, "=A2+A1");
+  sheet->SetCell("B3"_pos, "=-(B2*2)");
+  ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(),
+               CellInterface::Value(FormulaError::Category::Div0));
+  ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(),
+               CellInterface::Value(FormulaError::Category::Value));
+  ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(),
+               CellInterface::Value(FormulaError::Category::Value));
+
+  sheet->SetCell("A2"_pos, "2");
+  ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(),
+               CellInterface::Value(FormulaError::Category::Div0));
+  sheet->SetCell("A1"_pos, "=1");
+  ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(-6.0));
+}
+
+void TestTextCellAsNumber() {
+  auto sheet = CreateSheet();
+  auto read_as_number = [&](const std::string& text) {
+    sheet->SetCell("A1"_pos, text);
+    sheet->SetCell("B1"_pos, "=A1");
+    return sheet->GetCell("B1"_pos)->GetValue();
+  };
+  const CellInterface::Value value_error = FormulaError::Category::Value;
+
+  ASSERT_EQUAL(read_as_number("12"), CellInterface::Value(12.0));
+  ASSERT_EQUAL(read_as_number("  -1.5"), CellInterface::Value(-1.5));
+  ASSERT_EQUAL(read_as_number("+3"), CellInterface::Value(3.0));
+  ASSERT_EQUAL(read_as_number("1e2"), CellInterface::Value(100.0));
+  ASSERT_EQUAL(read_as_number(".5"), CellInterface::Value(0.5));
+  ASSERT_EQUAL(read_as_number("'7"), CellInterface::Value(7.0));
+  ASSERT_EQUAL(read_as_number("'"), CellInterface::Value(0.0));
+  ASSERT_EQUAL(read_as_number("1 "), value_error);
+  ASSERT_EQUAL(read_as_number("+-1"), value_error);
+  ASSERT_EQUAL(read_as_number("0x10"), value_error);
+  ASSERT_EQUAL(read_as_number("inf"), value_error);
+  ASSERT_EQUAL(read_as_number("nan"), value_error);
+  ASSERT_EQUAL(read_as_number("1e999"), value_error);
+  ASSERT_EQUAL(read_as_number("-1e999"), value_error);
+  // Too small to represent reads the way the same literal in a formula does
+  ASSERT_EQUAL(read_as_number("1e-400"), CellInterface::Value(0.0));
+  sheet->SetCell("C1"_pos, "=1e-320");
+  ASSERT_EQUAL(read_as_number("1e-320"), sheet->GetCell("C1"_pos)->GetValue());
+  ASSERT(std::get<double>(read_as_number("1e-320")) > 0.0);
+  ASSERT_EQUAL(read_as_number("1e-400x"), value_error);
+  sheet->SetCell("A1"_pos, "1e999");
+  ASSERT_EQUAL(std::get<std::string>(sheet->GetCell("A1"_pos)->GetValue()),
+               "1e999");
+}
+
+void TestSetCells() {
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1");
+  sheet.SetCell("C1"_pos, "=A1*10");
+  ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+  // Cells may reference cells set later in the same batch
+  sheet.SetCells({ { "B1"_pos, "=B2+B3" },
+                   { "B2"_pos, "=A1+1" },
+                   { "B3"_pos, "2" },
+                   { "A1"_pos, "5" },
+                   { "B3"_pos, "=B2*2" } });
+  ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(18.0));
+  ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=B2*2");
+  ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(50.0));
+
+  std::ostringstream before;
+  sheet.PrintTexts(before);
+  auto unchanged = [&] {
+    std::ostringstream after;
+    sheet.PrintTexts(after);
+    ASSERT_EQUAL(after.str(), before.str());
+    ASSERT(sheet.GetCell("D9"_pos) == nullptr);
+    ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(),
+                 CellInterface::Value(50.0));
+  };
+
+  // A cycle through cells of the batch and old cells rolls everything back
+  bool caught = false;
+  try {
+    sheet.SetCells({ { "E1"_pos, "=D9" },
+                     { "A1"_pos, "=B1" },
+                     { "B3"_pos, "3" },
+                     { "B2"_pos, "=C1" } });
+  }
+  catch (const CircularDependencyException&) { caught = true; }
+  ASSERT(caught);
+  unchanged();
+
+  caught = false;
+  try { sheet.SetCells({ { "E1"_pos, "=D9" }, { "A1"_pos, "=1+" } }); }
+  catch (const FormulaException&) { caught = true; }
+  ASSERT(caught);
+  unchanged();
+
+  caught = false;
+  try { sheet.SetCells({ { "E1"_pos, "1" }, { Position::NONE, "1" } }); }
+  catch (const InvalidPositionException&) { caught = true; }
+  ASSERT(caught);
+  unchanged();
+
+  // Chains listed from their end: every cell references a cell
+  // created after it, too many of them to reorder one by one
+  const auto reversed_chain = [](int col, int length) {
+    std::vector<std::pair<Position, std::string>> chain;
+    for (int row = length - 1; row > 0; --row) {
+      chain.emplace_back(Position{ row, col },
+                         "=" + Position{ row - 1, col }.ToString() + "+1");
+    }
+    return chain;
+  };
+  auto chain = reversed_chain(5, 200);
+  chain.emplace_back("F1"_pos, "1");
+  sheet.SetCells(chain);
+  ASSERT_EQUAL(sheet.GetCell("F200"_pos)->GetValue(),
+               CellInterface::Value(200.0));
+
+  chain = reversed_chain(6, 200);
+  chain.emplace_back("F1"_pos, "=F200");
+  caught = false;
+  try { sheet.SetCells(chain); }
+  catch (const CircularDependencyException&) { caught = true; }
+  ASSERT(caught);
+  ASSERT(sheet.GetCell("G1"_pos) == nullptr);
+  ASSERT(sheet.GetCell("G200"_pos) == nullptr);
+  ASSERT_EQUAL(sheet.GetCell("F200"_pos)->GetValue(),
+               CellInterface::Value(200.0));
+  sheet.SetCell("F1"_pos, "2");
+  ASSERT_EQUAL(sheet.GetCell("F200"_pos)->GetValue(),
+               CellInterface::Value(201.0));
+}
+
+
+// Random edits of a small sheet, one cell at a time and in batches:
+// an edit must be rejected exactly when it would close a cycle,
+// and the values must follow the accepted edits
+void TestCycleDetectionRandomEdits() {
+  const int cells = 12;
+  std::mt19937 generator(7);
+  std::uniform_int_distribution<int> cell_dist(0, cells - 1);
+  std::uniform_int_distribution<int> references_dist(0, 3);
+  Sheet sheet;
+  // Cells every cell references, every formula adds one to their sum
+  std::vector<std::vector<int>> references(cells);
+
+  const auto has_cycle = [&](const std::vector<std::vector<int>>& graph) {
+    enum class Mark { None, InProgress, Done };
+    std::vector<Mark> marks(cells, Mark::None);
+    std::function<bool(int)> visit = [&](int cell) {
+      if (marks[cell] != Mark::None) { return marks[cell] == Mark::InProgress; }
+      marks[cell] = Mark::InProgress;
+      for (int reference : graph[cell]) {
+        if (visit(reference)) { return true; }
+      }
+      marks[cell] = Mark::Done;
+      return false;
+    };
+    for (int cell = 0; cell < cells; ++cell) {
+      if (visit(cell)) { return true; }
+    }
+    return false;
+  };
+  std::function<double(int)> value_of = [&](int cell) {
+    if (sheet.GetCell(Position{ cell, 0 }) == nullptr
+        || sheet.GetCell(Position{ cell, 0 })->GetText().empty()) {
+      return 0.0;
+    }
+    double value = 1.0;
+    for (int reference : references[cell]) { value += value_of(reference); }
+    return value;
+  };
+
+  for (int edit = 0; edit < 2000; ++edit) {
+    std::vector<std::pair<Position, std::string>> batch;
+    auto graph = references;
+    for (int i = 0, size = edit % 5 == 0 ? 3 : 1; i < size; ++i) {
+      const int cell = cell_dist(generator);
+      std::string text = "=1";
+      graph[cell].clear();
+      for (int j = references_dist(generator); j > 0; --j) {
+        graph[cell].push_back(cell_dist(generator));
+        text += "+" + Position{ graph[cell].back(), 0 }.ToString();
+      }
+      batch.emplace_back(Position{ cell, 0 }, text);
+    }
+
+    bool caught = false;
+    try {
+      if (batch.size() == 1) { sheet.SetCell(batch[0].first, batch[0].second); }
+      else { sheet.SetCells(batch); }
+    }
+    catch (const CircularDependencyException&) { caught = true; }
+    ASSERT_EQUAL(caught, has_cycle(graph));
+    if (!caught) { references = graph; }
+
+    const int cell = cell_dist(generator);
+    const CellInterface* checked = sheet.GetCell(Position{ cell, 0 });
+    if (checked != nullptr && !checked->GetText().empty()) {
+      ASSERT_EQUAL(std::get<double>(checked->GetValue()), value_of(cell));
+    }
+  }
+}
+
+// The hand-written parser must accept exactly the texts the grammar
+// accepts and build the same trees as the parser ANTLR generates
+void TestFormulaParserMatchesAntlr() {
+  const auto parse = [](const std::string& text, bool antlr) {
+    std::ostringstream out;
+    try {
+      std::istringstream in(text);
+      const FormulaAST ast = antlr ? ParseFormulaASTWithAntlr(in)
+                                   : ParseFormulaAST(std::string_view(text));
+      ast.Print(out);
+      out << " | ";
+      ast.PrintFormula(out);
+      out << " | ";
+      ast.PrintCells(out);
+    }
+    catch (const FormulaException&) {
+      out << "#REF!";
+    }
+    catch (const std::exception&) {
+      out << "error";
+    }
+    return out.str();
+  };
+  const auto check = [&](const std::string& text) {
+    const std::string expected = parse(text, true);
+    const std::string actual = parse(text, false);
+    if (actual != expected) {
+      std::ostringstream message;
+      message << "\"" << text << "\": " << actual << " != " << expected;
+      throw std::runtime_error(message.str());
+    }
+  };
+
+  for (const std::string text : {
+           "1", "1.", ".5", "1.5", "1e", "1E5", "1e+5", "1e-5", "1e+",
+           "1.5e3", ".5e-2", "1e400", "1e-400", "E5", "1 E5", "1.5.5",
+           "A1", "A1B2", "AB", "a1", "A0", "ZZZZZ1", "A16385", "XFD16384",
+           "XFE1", "--1", "+-+1", "-1*2", "1-2-3", "8/4/2", "1+2*3",
+           "(1+2)*3", "((((((1))))))", "(1", "1)", "()", "", " ", "+",
+           "1+", "*1", " \t1 +\r\n2 ", "1 2", "A1 + B2 * (C3 - -D4)",
+           "1+x", "1;2", "1,5", "A1+A1", "SUM(A1:B2)", "SUM(B2:A1)",
+           "SUM (A1 : B2 , 1)", "SUM()", "SUM", "SUM(1", "SUM(1,)",
+           "SUM(A1:)", "SUM(:B2)", "SUM(A1:B2+1)", "SUM(A1:1)", "A1:B2",
+           "SUMA1", "SUMX(1)", "sum(1)", "FOO(1)", "-SUM(1,2)*3",
+           "MAX(MIN(A1:A3,2),COUNT(B1:C2),AVERAGE(1,(2)))",
+           "SUM(A1:XFE1)", "SUM(A0:B2)"}) {
+    check(text);
+  }
+
+  // Random token sequences, valid and not
+  std::mt19937 generator(13);
+  const std::string tokens[] = {
+    "+", "-", "*", "/", "(", ")", "(", ")", "1", "0.25", ".5", "2e3",
+    "3E-2", "A1", "B12", "ZZ9", "XFD16384", "A99999", " ", "\t", "e", ".",
+    "SUM(", "MIN (", "AVERAGE(", "COUNT(", ",", ":", "A1:B2", "C3:A1",
+  };
+  std::uniform_int_distribution<std::size_t> token_dist(0, std::size(tokens) - 1);
+  std::uniform_int_distribution<int> length_dist(1, 12);
+  for (int i = 0; i < 20000; ++i) {
+    std::string text;
+    for (int length = length_dist(generator); length > 0; --length) {
+      text += tokens[token_dist(generator)];
+    }
+    check(text);
+  }
+}
+
+void TestAggregateFunctions() {
+  Sheet sheet;
+  for (int row = 0; row < 10; ++row) {
+    sheet.SetCell(Position{ row, 0 }, std::to_string(row + 1));
+  }
+  const auto value = [&sheet](Position pos) {
+    return sheet.GetCell(pos)->GetValue();
+  };
+  sheet.SetCell("C1"_pos, "=SUM(A1:A10)");
+  ASSERT_EQUAL(std::get<double>(value("C1"_pos)), 55.0);
+  sheet.SetCell("C2"_pos, "=MIN(A3:A10) + MAX(A10:A1) * 2");
+  ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=MIN(A3:A10)+MAX(A1:A10)*2");
+  ASSERT_EQUAL(std::get<double>(value("C2"_pos)), 23.0);
+  sheet.SetCell("C3"_pos, "=AVERAGE(A1:A4, 10) / COUNT(A1:B10, 1, -1)");
+  ASSERT_EQUAL(std::get<double>(value("C3"_pos)), 4.0 / 12);
+
+  // A range is one dependency, not a cell per position
+  sheet.SetCell("C4"_pos, "=SUM(A1:A10, A2:A5, A1:A10) + B1");
+  ASSERT((sheet.GetCell("C4"_pos)->GetReferencedCells()
+          == std::vector{ "B1"_pos }));
+  ASSERT((sheet.GetCell("C4"_pos)->GetReferencedRanges()
+          == std::vector{ Range{ "A1"_pos, "A10"_pos },
+                          Range{ "A2"_pos, "A5"_pos } }));
+  ASSERT_EQUAL(std::get<double>(value("C4"_pos)), 124.0);
+
+  // Empty cells and texts are skipped, numbers in texts are not
+  sheet.SetCell("A3"_pos, "");
+  sheet.SetCell("A4"_pos, "label");
+  sheet.SetCell("A5"_pos, "'5");
+  ASSERT_EQUAL(std::get<double>(value("C1"_pos)), 48.0);
+  sheet.SetCell("D1"_pos, "=COUNT(A1:A10)");
+  ASSERT_EQUAL(std::get<double>(value("D1"_pos)), 8.0);
+  sheet.SetCell("D2"_pos, "=AVERAGE(E1:E5)");
+  ASSERT_EQUAL(std::get<FormulaError>(value("D2"_pos)),
+               FormulaError(FormulaError::Category::Div0));
+  sheet.SetCell("D3"_pos, "=MIN(E1:E5)+MAX(E1:E5)+SUM(E1:E5)+COUNT(E1:E5)");
+  ASSERT_EQUAL(std::get<double>(value("D3"_pos)), 0.0);
+  sheet.SetCell("D4"_pos, "=MIN(A1:A10, -1) + MAX(-5, -3)");
+  ASSERT_EQUAL(std::get<double>(value("D4"_pos)), -4.0);
+
+  // Errors of the cells pass through, the first one in column order
+  sheet.SetCell("B2"_pos, "=1/0");
+  sheet.SetCell("B3"_pos, "=XFD16384+1");
+  sheet.SetCell("A6"_pos, "=A4*1");
+  sheet.SetCell("D5"_pos, "=SUM(A1:B10)");
+  ASSERT_EQUAL(std::get<FormulaError>(value("D5"_pos)),
+               FormulaError(FormulaError::Category::Value));
+  sheet.SetCell("D6"_pos, "=SUM(B1:B10)");
+  ASSERT_EQUAL(std::get<FormulaError>(value("D6"_pos)),
+               FormulaError(FormulaError::Category::Div0));
+  sheet.SetCell("D7"_pos, "=SUM(1e308, 1e308)");
+  ASSERT_EQUAL(std::get<FormulaError>(value("D7"_pos)),
+               FormulaError(FormulaError::Category::Div0));
+
+  // Editing a cell of a range invalidates the aggregate, including
+  // cells created inside the range after the formula
+  sheet.SetCell("A6"_pos, "6");
+  ASSERT_EQUAL(std::get<double>(value("C1"_pos)), 48.0);
+  sheet.SetCell("A1"_pos, "100");
+  ASSERT_EQUAL(std::get<double>(value("C1"_pos)), 147.0);
+  sheet.SetCell("F1"_pos, "=SUM(G1:G3)");
+  ASSERT_EQUAL(std::get<double>(value("F1"_pos)), 0.0);
+  sheet.SetCell("G2"_pos, "7");
+  ASSERT_EQUAL(std::get<double>(value("F1"_pos)), 7.0);
+  sheet.ClearCell("G2"_pos);
+  ASSERT_EQUAL(std::get<double>(value("F1"_pos)), 0.0);
+
+  // A range over the cell itself or a cell depending on it is a cycle
+  const auto closes_cycle = [&sheet](Position pos, const std::string& text) {
+    try { sheet.SetCell(pos, text); }
+    catch (const CircularDependencyException&) { return true; }
+    return false;
+  };
+  ASSERT(closes_cycle("G2"_pos, "=SUM(G1:G3)"));
+  ASSERT(closes_cycle("G3"_pos, "=F1"));
+  ASSERT_EQUAL(std::get<double>(value("F1"_pos)), 0.0);
+
+  // Ranges move with the formula sharing their shape
+  sheet.SetCell("H1"_pos, "=SUM(A1:A2)");
+  sheet.SetCell("H2"_pos, "=SUM(A2:A3)");
+  ASSERT_EQUAL(sheet.GetCell("H2"_pos)->GetText(), "=SUM(A2:A3)");
+  ASSERT_EQUAL(std::get<double>(value("H2"_pos)), 2.0);
+
+  for (const std::string text :
+       { "=A1:A2", "=SUM()", "=SUM(A1:ZZZZ2)", "=TOTAL(A1:A2)" }) {
+    bool caught = false;
+    try { sheet.SetCell("H3"_pos, text); }
+    catch (const FormulaException&) { caught = true; }
+    ASSERT(caught);
+  }
+
+  // Both storages read ranges alike, across tile boundaries
+  for (auto make_storage : { CreateHashCellStorage, CreateTiledCellStorage }) {
+    Sheet other(make_storage());
+    double expected = 0.0;
+    for (int row = 0; row < 200; row += 3) {
+      for (int col = 10; col < 40; col += 7) {
+        other.SetCell(Position{ row, col }, std::to_string(row * col));
+        if (row >= 5 && row <= 150 && col >= 15 && col <= 33) {
+          expected += row * col;
+        }
+      }
+    }
+    other.SetCell("A1"_pos, "=SUM(P6:AH151)");
+    ASSERT_EQUAL(std::get<double>(other.GetCell("A1"_pos)->GetValue()),
+                 expected);
+  }
+}
+
+void TestFormulaSharing() {
+  Sheet sheet;
+  const int rows = 100;
+  for (int row = 0; row < rows; ++row) {
+    sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+    sheet.SetCell(Position{ row, 1 }, "2");
+    const std::string suffix = std::to_string(row + 1);
+    sheet.SetCell(Position{ row, 2 }, "=A" + suffix + "*B" + suffix);
+  }
+  // Copied down the column, the formulas are of one shape
+  ASSERT_EQUAL(sheet.GetFormulaTable().GetShapeCount(), 1u);
+  ASSERT_EQUAL(sheet.GetCell("C50"_pos)->GetText(), "=A50*B50");
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("C50"_pos)->GetValue()), 98.0);
+  ASSERT((sheet.GetCell("C50"_pos)->GetReferencedCells()
+          == std::vector{ "A50"_pos, "B50"_pos }));
+  // Spaces make a different shape, not a different formula
+  sheet.SetCell("C51"_pos, "=A51 * B51");
+  ASSERT_EQUAL(sheet.GetFormulaTable().GetShapeCount(), 2u);
+  ASSERT_EQUAL(sheet.GetCell("C51"_pos)->GetText(), "=A51*B51");
+
+  // Cells above and to the left of the formula
+  sheet.SetCell("E5"_pos, "=A1+D4");
+  sheet.SetCell("F6"_pos, "=B2+E5");
+  ASSERT_EQUAL(sheet.GetFormulaTable().GetShapeCount(), 3u);
+  ASSERT_EQUAL(sheet.GetCell("F6"_pos)->GetText(), "=B2+E5");
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell("F6"_pos)->GetValue()), 2.0);
+
+  // Texts that are not formulas fail wherever they are
+  for (const char* text : { "=A1+", "=ZZZZZ1", "=A1+a1", "=[0,0]" }) {
+    for (const Position pos : { "H1"_pos, "H2"_pos }) {
+      try {
+        sheet.SetCell(pos, text);
+        ASSERT(false);
+      }
+      catch (const FormulaException&) {
+      }
+    }
+  }
+
+  // Random formulas read the same as parsed on their own
+  std::mt19937 generator(3);
+  std::uniform_int_distribution<int> coordinate(0, 20);
+  std::uniform_int_distribution<int> token(0, 3);
+  for (int i = 0; i < 2000; ++i) {
+    const Position pos{ coordinate(generator) + 30, coordinate(generator) };
+    std::string expression = Position{ coordinate(generator),
+                                       coordinate(generator) }.ToString();
+    for (int j = 0; j < 3; ++j) {
+      expression += "+-*/"[token(generator)];
+      expression += token(generator) == 0
+          ? std::string("2")
+          : Position{ coordinate(generator), coordinate(generator) }.ToString();
+    }
+    sheet.SetCell(pos, "=" + expression);
+    const auto formula = ParseFormula(expression);
+    ASSERT_EQUAL(sheet.GetCell(pos)->GetText(), "=" + formula->GetExpression());
+    ASSERT(sheet.GetCell(pos)->GetReferencedCells()
+           == formula->GetReferencedCells());
+  }
+
+  // Shapes no cell uses anymore do not pile up
+  for (int i = 0; i < 5000; ++i) {
+    sheet.SetCell("Z1"_pos, "=A1+" + std::to_string(i));
+  }
+  ASSERT(sheet.GetFormulaTable().GetShapeCount() <= 1024u);
+}
+
+void TestInvalidationStopsAtDirtyCells() {
+  // A ladder of diamonds: every cell of a row sums up both cells
+  // of the previous row, so there are 2^60 paths from the first row
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1");
+  sheet.SetCell("B1"_pos, "1");
+  const int rows = 61;
+  for (int row = 1; row < rows; ++row) {
+    const std::string formula = "=" + Position{ row - 1, 0 }.ToString()
+        + "+" + Position{ row - 1, 1 }.ToString();
+    sheet.SetCell(Position{ row, 0 }, formula);
+    sheet.SetCell(Position{ row, 1 }, formula);
+  }
+  const Position top{ rows - 1, 0 };
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell(top)->GetValue()), 0x1p60);
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell({ rows - 1, 1 })->GetValue()),
+               0x1p60);
+
+  // Every formula is touched once, the second time the descent
+  // stops at the first row of formulas, which is dirty already
+  Cell* root = sheet.GetConcreteCell("A1"_pos);
+  ASSERT_EQUAL(root->InvalidateIncomingCellsCache(), 1u + (rows - 1) * 2);
+  ASSERT_EQUAL(root->InvalidateIncomingCellsCache(), 1u);
+
+  sheet.SetCell("A1"_pos, "3");
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell(top)->GetValue()), 0x1p61);
+  sheet.SetCell("B1"_pos, "5");
+  ASSERT_EQUAL(std::get<double>(sheet.GetCell(top)->GetValue()), 0x1p62);
+}
+
+// Formulas with ranges are found through the range index: a range gets
+// no edge per cell, and every write inside it still reaches the formula
+void TestRangeDependencies() {
+  // The index reports exactly the ranges containing a position
+  {
+    std::mt19937 generator(17);
+    std::uniform_int_distribution<int> coordinate_dist(0, 300);
+    std::uniform_int_distribution<int> size_dist(0, 4);
+    RangeIndex index;
+    std::vector<std::pair<Range, Cell*>> ranges;
+    for (int i = 0; i < 500; ++i) {
+      const Position first{ coordinate_dist(generator),
+                            coordinate_dist(generator) };
+      // Sizes from one cell to thousands of rows
+      const int height = (1 << (size_dist(generator) * 3)) - 1;
+      const int width = (1 << size_dist(generator)) - 1;
+      ranges.emplace_back(Range{ first, { first.row + height,
+                                          first.col + width } },
+                          reinterpret_cast<Cell*>(std::uintptr_t(i + 1)));
+      index.Insert(ranges.back().first, ranges.back().second);
+    }
+    for (int i = 0; i < 250; ++i) {
+      ASSERT(index.Erase(ranges.back().first, ranges.back().second));
+      ASSERT(!index.Erase(ranges.back().first, ranges.back().second));
+      ranges.pop_back();
+    }
+    ASSERT_EQUAL(index.GetSize(), ranges.size());
+    for (int i = 0; i < 2000; ++i) {
+      const Position pos{ coordinate_dist(generator) * 4,
+                          coordinate_dist(generator) };
+      std::vector<Cell*> expected;
+      for (const auto& [range, cell] : ranges) {
+        if (range.Contains(pos)) { expected.push_back(cell); }
+      }
+      std::vector<Cell*> found;
+      index.ForEachContaining(pos, [&found](Cell* cell) {
+        found.push_back(cell);
+      });
+      std::sort(expected.begin(), expected.end());
+      std::sort(found.begin(), found.end());
+      ASSERT(found == expected);
+      ASSERT_EQUAL(index.Contains(pos), !expected.empty());
+    }
+  }
+
+  for (auto make_storage : { CreateHashCellStorage, CreateTiledCellStorage }) {
+    Sheet sheet(make_storage());
+    const auto value = [&sheet](Position pos) {
+      return std::get<double>(sheet.GetCell(pos)->GetValue());
+    };
+    // A whole column creates no cells and no edges
+    sheet.SetCell("A1"_pos, "=SUM(B1:B16384)");
+    sheet.SetCell("A2"_pos, "=COUNT(B1:C16384) + SUM(B100:B200)");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 2, 1 }));
+    ASSERT(sheet.GetConcreteCell("A1"_pos)->GetOutgoingCells().Empty());
+    ASSERT_EQUAL(value("A1"_pos), 0.0);
+    ASSERT_EQUAL(value("A2"_pos), 0.0);
+
+    // Writes inside the ranges invalidate the formulas
+    sheet.SetCell("B150"_pos, "2");
+    sheet.SetCell("B16384"_pos, "=B150 * 2");
+    sheet.SetCell("C9000"_pos, "text");
+    ASSERT_EQUAL(value("A1"_pos), 6.0);
+    ASSERT_EQUAL(value("A2"_pos), 4.0);
+    sheet.SetCell("B150"_pos, "3");
+    ASSERT_EQUAL(value("A1"_pos), 9.0);
+    ASSERT_EQUAL(value("A2"_pos), 5.0);
+    sheet.ClearCell("B16384"_pos);
+    ASSERT_EQUAL(value("A1"_pos), 3.0);
+    ASSERT(sheet.GetCell("B16384"_pos) == nullptr);
+
+    // Cycles through a range are rejected and leave the sheet unchanged
+    bool caught = false;
+    try { sheet.SetCell("B5000"_pos, "=A1"); }
+    catch (const CircularDependencyException&) { caught = true; }
+    ASSERT(caught);
+    caught = false;
+    try { sheet.SetCells({ { "D1"_pos, "=A2" }, { "C20"_pos, "=D1" } }); }
+    catch (const CircularDependencyException&) { caught = true; }
+    ASSERT(caught);
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+    ASSERT_EQUAL(value("A2"_pos), 4.0);
+
+    // Replacing a formula drops its ranges from the index
+    sheet.SetCell("A1"_pos, "=SUM(D1:D2)");
+    sheet.SetCell("B5000"_pos, "=A1 + 1");
+    sheet.SetCell("D2"_pos, "4");
+    ASSERT_EQUAL(value("B5000"_pos), 5.0);
+    ASSERT_EQUAL(value("A2"_pos), 5.0);
+    sheet.ClearCell("A2"_pos);
+    ASSERT_EQUAL(sheet.GetRangeIndex().GetSize(), 1u);
+  }
+
+  // Random edits with overlapping ranges against a model
+  // that expands every range into its cells
+  const int cells = 12;
+  std::mt19937 generator(23);
+  std::uniform_int_distribution<int> cell_dist(0, cells - 1);
+  Sheet sheet;
+  sheet.SetRecalculationThreads(2);
+  std::vector<std::optional<std::pair<int, int>>> ranges(cells);
+  const auto has_cycle = [&](const auto& graph) {
+    std::vector<int> marks(cells, 0);
+    std::function<bool(int)> visit = [&](int cell) {
+      if (marks[cell] != 0) { return marks[cell] == 1; }
+      marks[cell] = 1;
+      if (graph[cell]) {
+        for (int row = graph[cell]->first; row <= graph[cell]->second; ++row) {
+          if (graph[row] && visit(row)) { return true; }
+        }
+      }
+      marks[cell] = 2;
+      return false;
+    };
+    for (int cell = 0; cell < cells; ++cell) {
+      if (visit(cell)) { return true; }
+    }
+    return false;
+  };
+  std::function<double(int)> value_of = [&](int cell) {
+    double value = 1.0;
+    for (int row = ranges[cell]->first; row <= ranges[cell]->second; ++row) {
+      if (ranges[row]) { value += value_of(row); }
+    }
+    return value;
+  };
+  for (int edit = 0; edit < 2000; ++edit) {
+    std::vector<std::pair<Position, std::string>> batch;
+    auto graph = ranges;
+    for (int i = 0, size = edit % 4 == 0 ? 3 : 1; i < size; ++i) {
+      const int cell = cell_dist(generator);
+      const int first = cell_dist(generator);
+      const int last = std::min(cells - 1, first + cell_dist(generator) / 4);
+      graph[cell].emplace(first, last);
+      batch.emplace_back(Position{ cell, 0 },
+                         "=1+SUM(" + Position{ first, 0 }.ToString() + ":"
+                             + Position{ last, 0 }.ToString() + ")");
+    }
+    if (edit % 7 == 0) {
+      const int cell = cell_dist(generator);
+      graph[cell].reset();
+      batch.emplace_back(Position{ cell, 0 }, "");
+    }
+    bool caught = false;
+    try {
+      if (batch.size() == 1) { sheet.SetCell(batch[0].first, batch[0].second); }
+      else { sheet.SetCells(batch); }
+    }
+    catch (const CircularDependencyException&) { caught = true; }
+    ASSERT_EQUAL(caught, has_cycle(graph));
+    if (!caught) { ranges = graph; }
+    if (edit % 10 == 0) { sheet.Recalculate(); }
+
+    const int cell = cell_dist(generator);
+    if (ranges[cell]) {
+      ASSERT_EQUAL(std::get<double>(sheet.GetCell({ cell, 0 })->GetValue()),
+                   value_of(cell));
+    }
+  }
+}
+
 }  // namespace
 
 int main() {
@@ -354,6 +1765,7 @@ int main() {
   RUN_TEST(tr, TestInvalidPosition);
   RUN_TEST(tr, TestSetCellPlainText);
   RUN_TEST(tr, TestClearCell);
+  RUN_TEST(tr, TestReclaimClearedCells);
   RUN_TEST(tr, TestFormulaArithmetic);
   RUN_TEST(tr, TestFormulaReferences);
   RUN_TEST(tr, TestFormulaExpressionFormatting);
@@ -363,9 +1775,35 @@ int main() {
   RUN_TEST(tr, TestEmptyCellTreatedAsZero);
   RUN_TEST(tr, TestFormulaInvalidPosition);
   RUN_TEST(tr, TestPrint);
+  RUN_TEST(tr, TestPrintSparse);
+  RUN_TEST(tr, TestPrintableSizeShrinks);
   RUN_TEST(tr, TestCellReferences);
   RUN_TEST(tr, TestFormulaIncorrect);
   RUN_TEST(tr, TestCellCircularReferences);
+  RUN_TEST(tr, TestFormulaCacheInvalidation);
+  RUN_TEST(tr, TestPositionMap);
+  RUN_TEST(tr, TestSmallSet);
+  RUN_TEST(tr, TestSlabAllocator);
+  RUN_TEST(tr, TestColumnValues);
+  RUN_TEST(tr, TestValueViews);
+  RUN_TEST(tr, TestTextInterning);
+  RUN_TEST(tr, TestCellStorageBackends);
+  RUN_TEST(tr, TestSparseSheetMemory);
+  RUN_TEST(tr, TestDeepChainEvaluation);
+  RUN_TEST(tr, TestRecalculate);
+  RUN_TEST(tr, TestRecalculateMarkedCells);
+  RUN_TEST(tr, TestParallelRecalculate);
+  RUN_TEST(tr, TestThreadPoolExceptions);
+  RUN_TEST(tr, TestFormulaDeepExpression);
+  RUN_TEST(tr, TestErrorPropagationOrder);
+  RUN_TEST(tr, TestTextCellAsNumber);
+  RUN_TEST(tr, TestSetCells);
+  RUN_TEST(tr, TestCycleDetectionRandomEdits);
+  RUN_TEST(tr, TestFormulaParserMatchesAntlr);
+  RUN_TEST(tr, TestInvalidationStopsAtDirtyCells);
+  RUN_TEST(tr, TestFormulaSharing);
+  RUN_TEST(tr, TestAggregateFunctions);
+  RUN_TEST(tr, TestRangeDependencies);
 
   std::unique_ptr<SheetInterface> sheet = CreateSheet();
   sheet->SetCell("A1"_pos, "=1*1");
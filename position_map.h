@@ -0,0 +1,153 @@
+#pragma once
+
+#include "common.h"
+#include "linear_probing.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Open-addressing hash table keyed by a cell position.
+// A position is packed into a single 32-bit integer (row << 14 | col),
+// so a lookup neither allocates nor converts the position to a string.
+// Collisions are resolved by linear probing, erased slots are refilled
+// by shifting the rest of the probe run back (no tombstones).
+template <typename Value>
+class PositionMap {
+  public:
+
+  static constexpr int COL_BITS = 14;
+
+  static_assert(Position::MAX_COLS <= (1 << COL_BITS),
+                "column index does not fit into the packed key");
+
+  static std::uint32_t Pack(Position pos) {
+    return static_cast<std::uint32_t>(pos.row) << COL_BITS
+           | static_cast<std::uint32_t>(pos.col);
+  }
+
+  static Position Unpack(std::uint32_t key) {
+    return { static_cast<int>(key >> COL_BITS),
+             static_cast<int>(key & ((1u << COL_BITS) - 1)) };
+  }
+
+  // Returns a pointer to the value stored at the position or nullptr
+  Value* Find(Position pos) {
+    return const_cast<Value*>(
+        static_cast<const PositionMap&>(*this).Find(pos));
+  }
+
+  const Value* Find(Position pos) const {
+    if (slots_.empty()) { return nullptr; }
+    const std::uint32_t key = Pack(pos);
+    for (std::size_t i = SlotFor(key); ; i = (i + 1) & mask_) {
+      if (slots_[i].key == key) { return &slots_[i].value; }
+      if (slots_[i].key == EMPTY_KEY) { return nullptr; }
+    }
+  }
+
+  // Returns the value stored at the position, inserting
+  // a default-constructed one if there is none yet.
+  // The reference is invalidated by the next insertion or erasure
+  Value& operator[](Position pos) {
+    if ((size_ + 1) * 4 > slots_.size() * 3) {
+      Rehash(slots_.empty() ? MIN_BITS : bits_ + 1);
+    }
+    const std::uint32_t key = Pack(pos);
+    std::size_t i = SlotFor(key);
+    for (; slots_[i].key != EMPTY_KEY; i = (i + 1) & mask_) {
+      if (slots_[i].key == key) { return slots_[i].value; }
+    }
+    slots_[i].key = key;
+    ++size_;
+    return slots_[i].value;
+  }
+
+  // Removes the value stored at the position, returns false if there is none
+  bool Erase(Position pos) {
+    if (slots_.empty()) { return false; }
+    const std::uint32_t key = Pack(pos);
+    std::size_t hole = SlotFor(key);
+    for (; slots_[hole].key != key; hole = (hole + 1) & mask_) {
+      if (slots_[hole].key == EMPTY_KEY) { return false; }
+    }
+    hole = ShiftProbeRunBack(
+        hole, mask_,
+        [this](std::size_t i) { return slots_[i].key == EMPTY_KEY; },
+        [this](std::size_t i) { return SlotFor(slots_[i].key); },
+        [this](std::size_t from, std::size_t to) {
+          slots_[to] = std::move(slots_[from]);
+        });
+    slots_[hole].key = EMPTY_KEY;
+    slots_[hole].value = Value();
+    --size_;
+    return true;
+  }
+
+  std::size_t Size() const { return size_; }
+
+  bool Empty() const { return size_ == 0; }
+
+  // Rebuilds the table at the smallest size that fits its entries,
+  // giving back the memory of the slots erased entries have left
+  void ShrinkToFit() {
+    int bits = 0;
+    if (size_ > 0) {
+      bits = MIN_BITS;
+      while (size_ * 4 > (std::size_t{ 1 } << bits) * 3) { ++bits; }
+    }
+    if (bits < bits_) { Rehash(bits); }
+  }
+
+  // Bytes of heap memory the table holds, the values included
+  std::size_t GetMemoryUsage() const {
+    return slots_.capacity() * sizeof(Slot);
+  }
+
+  // Calls func(Position, const Value&) for every stored entry
+  // in an unspecified order
+  template <typename Func>
+  void ForEach(Func func) const {
+    for (const auto& slot : slots_) {
+      if (slot.key != EMPTY_KEY) { func(Unpack(slot.key), slot.value); }
+    }
+  }
+
+  private:
+
+  static constexpr std::uint32_t EMPTY_KEY = ~std::uint32_t{ 0 };
+
+  // Bits of the size of a table that has any entries
+  static constexpr int MIN_BITS = 4;
+
+  struct Slot {
+    std::uint32_t key = EMPTY_KEY;
+    Value value;
+  };
+
+  std::size_t SlotFor(std::uint32_t key) const {
+    // Fibonacci hashing spreads neighbouring positions over the table
+    return static_cast<std::size_t>(
+        (key * UINT64_C(0x9E3779B97F4A7C15)) >> (64 - bits_)) & mask_;
+  }
+
+  // Moves the entries to a table of 2^bits slots, no slots if bits is zero
+  void Rehash(int bits) {
+    std::vector<Slot> old_slots = std::move(slots_);
+    bits_ = bits;
+    slots_ = bits_ == 0 ? std::vector<Slot>()
+                        : std::vector<Slot>(std::size_t{ 1 } << bits_);
+    mask_ = slots_.empty() ? 0 : slots_.size() - 1;
+    for (auto& slot : old_slots) {
+      if (slot.key == EMPTY_KEY) { continue; }
+      std::size_t i = SlotFor(slot.key);
+      while (slots_[i].key != EMPTY_KEY) { i = (i + 1) & mask_; }
+      slots_[i] = std::move(slot);
+    }
+  }
+
+  std::vector<Slot> slots_;
+  std::size_t size_ = 0;
+  std::size_t mask_ = 0;
+  int bits_ = 0;
+};
@@ -0,0 +1,70 @@
+#include "printable_area.h"
+
+namespace {
+
+constexpr int WORD_BITS = 64;
+
+// A line holds at most as many cells as the other side has lines
+static_assert(Position::MAX_ROWS <= UINT16_MAX
+              && Position::MAX_COLS <= UINT16_MAX);
+
+int GetHighestBit(std::uint64_t bits) {
+  int bit = 0;
+  for (int shift = WORD_BITS / 2; shift > 0; shift /= 2) {
+    if (bits >> shift != 0) {
+      bits >>= shift;
+      bit += shift;
+    }
+  }
+  return bit;
+}
+
+int GetWordCount(int bits) { return (bits + WORD_BITS - 1) / WORD_BITS; }
+
+}  // namespace
+
+void PrintableArea::Add(Position pos) {
+  rows_.Add(pos.row);
+  cols_.Add(pos.col);
+}
+
+void PrintableArea::Remove(Position pos) {
+  rows_.Remove(pos.row);
+  cols_.Remove(pos.col);
+}
+
+Size PrintableArea::GetSize() const {
+  return Size{ rows_.GetEnd(), cols_.GetEnd() };
+}
+
+PrintableArea::Axis::Axis(int lines)
+  : counts_(lines),
+    lines_(GetWordCount(lines)),
+    words_(GetWordCount(GetWordCount(lines))) {
+}
+
+void PrintableArea::Axis::Add(int line) {
+  if (counts_[line]++ != 0) { return; }
+  const int word = line / WORD_BITS;
+  lines_[word] |= std::uint64_t(1) << (line % WORD_BITS);
+  words_[word / WORD_BITS] |= std::uint64_t(1) << (word % WORD_BITS);
+}
+
+void PrintableArea::Axis::Remove(int line) {
+  if (--counts_[line] != 0) { return; }
+  const int word = line / WORD_BITS;
+  lines_[word] &= ~(std::uint64_t(1) << (line % WORD_BITS));
+  if (lines_[word] == 0) {
+    words_[word / WORD_BITS] &= ~(std::uint64_t(1) << (word % WORD_BITS));
+  }
+}
+
+int PrintableArea::Axis::GetEnd() const {
+  for (int i = static_cast<int>(words_.size()) - 1; i >= 0; --i) {
+    if (words_[i] != 0) {
+      const int word = i * WORD_BITS + GetHighestBit(words_[i]);
+      return word * WORD_BITS + GetHighestBit(lines_[word]) + 1;
+    }
+  }
+  return 0;
+}
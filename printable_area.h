@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <vector>
+
+// Rows and columns holding cells with a text, counted as cells get and
+// lose their texts, so that the printable size of the sheet is known
+// without visiting the cells, however the sheet grows or shrinks
+class PrintableArea {
+  public:
+
+  void Add(Position pos);
+
+  void Remove(Position pos);
+
+  // The bounding rectangle of the counted cells, from the first
+  // row and column on
+  Size GetSize() const;
+
+  private:
+
+  // Cells per line along one side of the sheet. A bit per line marks the
+  // lines that have cells and a bit per word of those marks the words with
+  // any bit set, so the last line with cells is found in a few steps
+  class Axis {
+    public:
+
+    explicit Axis(int lines);
+
+    void Add(int line);
+
+    void Remove(int line);
+
+    // One past the last line with cells, zero if there are none
+    int GetEnd() const;
+
+    private:
+
+    std::vector<std::uint16_t> counts_;
+    std::vector<std::uint64_t> lines_;
+    std::vector<std::uint64_t> words_;
+  };
+
+  Axis rows_{ Position::MAX_ROWS };
+  Axis cols_{ Position::MAX_COLS };
+};
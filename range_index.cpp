@@ -0,0 +1,74 @@
+#include "range_index.h"
+
+#include <algorithm>
+
+int RangeIndex::LevelOf(int length) {
+  int level = 0;
+  while ((1 << level) < length) { ++level; }
+  return level;
+}
+
+int RangeIndex::GridOf(Range range) {
+  return LevelOf(range.last.row - range.first.row + 1) * LEVELS
+         + LevelOf(range.last.col - range.first.col + 1);
+}
+
+void RangeIndex::Insert(Range range, Cell* cell) {
+  const int grid_id = GridOf(range);
+  Grid& grid = grids_[grid_id];
+  const Position first = BlockOf(range.first, grid_id / LEVELS,
+                                 grid_id % LEVELS);
+  const Position last = BlockOf(range.last, grid_id / LEVELS,
+                                grid_id % LEVELS);
+  for (int row = first.row; row <= last.row; ++row) {
+    for (int col = first.col; col <= last.col; ++col) {
+      grid.blocks[{ row, col }].push_back({ range, cell });
+    }
+  }
+  if (grid.size++ == 0) { used_grids_.push_back(grid_id); }
+  ++size_;
+}
+
+bool RangeIndex::Erase(Range range, Cell* cell) {
+  const int grid_id = GridOf(range);
+  Grid& grid = grids_[grid_id];
+  const Position first = BlockOf(range.first, grid_id / LEVELS,
+                                 grid_id % LEVELS);
+  const Position last = BlockOf(range.last, grid_id / LEVELS,
+                                grid_id % LEVELS);
+  bool erased = false;
+  for (int row = first.row; row <= last.row; ++row) {
+    for (int col = first.col; col <= last.col; ++col) {
+      auto* entries = grid.blocks.Find({ row, col });
+      if (entries == nullptr) { continue; }
+      const auto it = std::find_if(entries->begin(), entries->end(),
+                                   [&](const Entry& entry) {
+                                     return entry.cell == cell
+                                            && entry.range == range;
+                                   });
+      if (it == entries->end()) { continue; }
+      // The order of the entries of a block does not matter
+      *it = entries->back();
+      entries->pop_back();
+      if (entries->empty()) { grid.blocks.Erase({ row, col }); }
+      erased = true;
+    }
+  }
+  if (!erased) { return false; }
+  if (--grid.size == 0) {
+    used_grids_.erase(std::find(used_grids_.begin(), used_grids_.end(),
+                                grid_id));
+  }
+  --size_;
+  return true;
+}
+
+void RangeIndex::ShrinkToFit() {
+  for (Grid& grid : grids_) { grid.blocks.ShrinkToFit(); }
+}
+
+bool RangeIndex::Contains(Position pos) const {
+  bool contains = false;
+  ForEachContaining(pos, [&contains](Cell*) { contains = true; });
+  return contains;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "common.h"
+#include "position_map.h"
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+class Cell;
+
+// Spatial index of the ranges formulas aggregate: finds the formulas
+// whose ranges contain a cell without an edge per cell of a range.
+// Ranges are kept in a family of grids, grid (i, j) splits the sheet into
+// blocks of 2^i rows by 2^j columns. A range goes to the grid with the
+// smallest blocks at least as tall and as wide as the range, so it overlaps
+// at most four blocks there; a lookup visits one block of each grid that
+// has ranges, and long columns do not slow down lookups beside them
+class RangeIndex {
+  public:
+
+  // Registers the range of the formula of the cell
+  void Insert(Range range, Cell* cell);
+
+  // Unregisters the range, returns false if it was not registered
+  bool Erase(Range range, Cell* cell);
+
+  // Calls func(Cell*) for every cell with a range containing
+  // the position; a cell is reported once per such range
+  template <typename Func>
+  void ForEachContaining(Position pos, Func func) const {
+    for (const int grid_id : used_grids_) {
+      const Grid& grid = grids_[grid_id];
+      const auto* entries = grid.blocks.Find(
+          BlockOf(pos, grid_id / LEVELS, grid_id % LEVELS));
+      if (entries == nullptr) { continue; }
+      for (const Entry& entry : *entries) {
+        if (entry.range.Contains(pos)) { func(entry.cell); }
+      }
+    }
+  }
+
+  // Whether any registered range contains the position
+  bool Contains(Position pos) const;
+
+  // Number of registered ranges
+  std::size_t GetSize() const { return size_; }
+
+  // Gives back the memory of the blocks the erased ranges have left
+  void ShrinkToFit();
+
+  private:
+
+  // Blocks of the last level span the whole sheet
+  static constexpr int LEVELS = 15;
+  static_assert(Position::MAX_ROWS <= 1 << (LEVELS - 1)
+                && Position::MAX_COLS <= 1 << (LEVELS - 1));
+
+  struct Entry {
+    Range range;
+    Cell* cell;
+  };
+
+  struct Grid {
+    // Keyed by the row and the column of a block in the grid
+    PositionMap<std::vector<Entry>> blocks;
+    std::size_t size = 0;
+  };
+
+  // The smallest level whose blocks are at least that many cells long
+  static int LevelOf(int length);
+
+  static int GridOf(Range range);
+
+  static Position BlockOf(Position pos, int row_level, int col_level) {
+    return { pos.row >> row_level, pos.col >> col_level };
+  }
+
+  std::array<Grid, LEVELS * LEVELS> grids_;
+  // Grids holding ranges, the only ones lookups visit
+  std::vector<int> used_grids_;
+  std::size_t size_ = 0;
+};
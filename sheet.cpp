@@ -2,8 +2,148 @@
 #include "cell.h"
 #include "common.h"
 
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <ostream>
+
 using namespace std::literals;
 
+namespace {
+
+// Collects the output and writes it to the stream in large blocks.
+// Numbers are formatted with std::to_chars the way the stream would
+// format them with its default flags and its precision
+class OutputBuffer {
+  public:
+
+  explicit OutputBuffer(std::ostream& output)
+    : output_(output),
+      precision_(static_cast<int>(output.precision())),
+      // Other formats are rare enough to be left to the stream itself
+      use_stream_((output.flags() & (std::ios_base::floatfield
+                                     | std::ios_base::showpoint
+                                     | std::ios_base::showpos
+                                     | std::ios_base::uppercase)) != 0),
+      buffer_(BUFFER_SIZE) {
+  }
+
+  void Write(std::string_view text) {
+    if (text.size() > buffer_.size() - size_) {
+      Flush();
+      if (text.size() > buffer_.size()) {
+        output_.write(text.data(), text.size());
+        return;
+      }
+    }
+    std::memcpy(buffer_.data() + size_, text.data(), text.size());
+    size_ += text.size();
+  }
+
+  // Writes the character count times
+  void Fill(char c, std::size_t count) {
+    while (count > 0) {
+      if (size_ == buffer_.size()) { Flush(); }
+      const std::size_t chunk = std::min(count, buffer_.size() - size_);
+      std::memset(buffer_.data() + size_, c, chunk);
+      size_ += chunk;
+      count -= chunk;
+    }
+  }
+
+  void WriteNumber(double number) {
+    if (!use_stream_) {
+      // Retry once in an empty buffer, only an absurd precision
+      // does not fit in it
+      for (int attempt = 0; attempt < 2; ++attempt) {
+        const auto [end, error] = std::to_chars(
+            buffer_.data() + size_, buffer_.data() + buffer_.size(), number,
+            std::chars_format::general, precision_);
+        if (error == std::errc()) {
+          size_ = end - buffer_.data();
+          return;
+        }
+        Flush();
+      }
+    }
+    Flush();
+    output_ << number;
+  }
+
+  void Flush() {
+    output_.write(buffer_.data(), size_);
+    size_ = 0;
+  }
+
+  private:
+
+  static constexpr std::size_t BUFFER_SIZE = 1 << 16;
+
+  std::ostream& output_;
+  const int precision_;
+  const bool use_stream_;
+  std::vector<char> buffer_;
+  std::size_t size_ = 0;
+};
+
+// Prints the cells of the area of the size row by row, separating columns
+// by tabs and ending every row with a newline. Only the stored cells with
+// a text are visited, put in row-major order; the gaps between them are
+// written as runs of tabs, so no position of the area is looked up
+template <typename PrintCell>
+void PrintCells(const CellStorage& storage, Size size, std::ostream& output,
+                PrintCell print_cell) {
+  using PositionedCell = std::pair<Position, const Cell*>;
+  // Cells are bucketed by row in two passes, counting and then placing
+  // them, and only the cells of a row are sorted by column
+  std::vector<std::size_t> row_ends(size.rows + 1);
+  std::vector<PositionedCell> unordered;
+  storage.ForEach([&](Position pos, const Cell& cell) {
+    if (cell.HasText()) {
+      unordered.emplace_back(pos, &cell);
+      ++row_ends[pos.row + 1];
+    }
+  });
+  for (int row = 0; row < size.rows; ++row) {
+    row_ends[row + 1] += row_ends[row];
+  }
+  std::vector<PositionedCell> cells(unordered.size());
+  {
+    std::vector<std::size_t> row_fill(row_ends.begin(), row_ends.end() - 1);
+    for (const PositionedCell& cell : unordered) {
+      cells[row_fill[cell.first.row]++] = cell;
+    }
+  }
+
+  OutputBuffer buffer(output);
+  for (int row = 0; row < size.rows; ++row) {
+    const auto first = cells.begin() + row_ends[row];
+    const auto last = cells.begin() + row_ends[row + 1];
+    std::sort(first, last, [](const auto& lhs, const auto& rhs) {
+      return lhs.first.col < rhs.first.col;
+    });
+    // Tabs written in the row so far
+    int tabs = 0;
+    for (auto cell = first; cell != last; ++cell) {
+      buffer.Fill('\t', cell->first.col - tabs);
+      tabs = cell->first.col;
+      print_cell(*cell->second, buffer);
+    }
+    buffer.Fill('\t', size.cols - 1 - tabs);
+    buffer.Write("\n");
+  }
+  buffer.Flush();
+}
+
+}  // namespace
+
+Sheet::Sheet() : Sheet(CreateHashCellStorage()) {}
+
+Sheet::Sheet(std::unique_ptr<CellStorage> storage)
+  : storage_(std::move(storage)),
+    column_values_(*storage_) {
+}
+
 Sheet::~Sheet() {}
 
 void Sheet::SetCell(Position pos, std::string text) {
@@ -11,12 +151,29 @@ void Sheet::SetCell(Position pos, std::string text) {
     throw InvalidPositionException("Error: position is not valid");
   }
 
-  const auto& cell = sheet_.find(pos);
+  const bool is_new = storage_->Find(pos) == nullptr;
+  try { FindOrCreateCell(pos).Set(std::move(text)); }
+  catch (...) {
+    // A failed edit leaves nothing behind, the new cell included
+    if (is_new) { MarkPossiblyUnused(pos); }
+    EraseUnusedCells();
+    throw;
+  }
+  EraseUnusedCells();
+}
 
-  if (cell == sheet_.end()) {
-    sheet_.emplace(pos, std::make_unique<Cell>(*this));
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+  for (const auto& [pos, text] : cells) {
+    if (!pos.IsValid()) {
+      throw InvalidPositionException("Error: position is not valid");
+    }
+  }
+  try { Cell::SetBatch(*this, std::move(cells)); }
+  catch (...) {
+    EraseUnusedCells();
+    throw;
   }
-  sheet_.at(pos)->Set(std::move(text));
+  EraseUnusedCells();
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
@@ -32,83 +189,104 @@ void Sheet::ClearCell(Position pos) {
   }
 
   // Find the cell at the given position
-  const auto& cell_at_pos = sheet_.find(pos);
-  if (cell_at_pos != sheet_.end() && cell_at_pos->second != nullptr) {
-    // Clear the cell's content
-    cell_at_pos->second->Clear();
-    // Check if the cell is no longer referenced and reset it if necessary
-    if (!cell_at_pos->second->IsReferenced()) { cell_at_pos->second.reset(); }
+  Cell* cell_at_pos = storage_->Find(pos);
+  if (cell_at_pos != nullptr) {
+    // Clear the cell's content; the cell is removed unless it is
+    // referenced, and so are the cells only it referenced
+    cell_at_pos->Clear();
+    MarkPossiblyUnused(pos);
+    EraseUnusedCells();
   }
 }
 
-Size Sheet::GetPrintableSize() const {
+std::size_t Sheet::GetMemoryUsage() const {
+  std::size_t memory = storage_->GetMemoryUsage()
+                       + allocator_.GetMemoryUsage()
+                       + text_table_.GetMemoryUsage();
+  storage_->ForEach([&memory](Position, const Cell& cell) {
+    memory += cell.GetMemoryUsage();
+  });
+  return memory;
+}
+
+void Sheet::ShrinkToFit() {
+  storage_->ShrinkToFit();
+  range_index_.ShrinkToFit();
+  column_values_.Clear();
+  std::vector<Cell*>().swap(recalculation_order_);
+  recalculation_order_valid_ = false;
+  std::vector<Position>().swap(possibly_unused_cells_);
+  std::vector<Cell*>().swap(invalidation_worklist_);
+  CompactDirtyCells();
+  dirty_cells_.shrink_to_fit();
+  allocator_.ReleaseEmptySlabs();
+  text_table_.ShrinkToFit();
+}
 
-  int max_row = 0;
-  int max_col = 0;
+Size Sheet::GetPrintableSize() const { return printable_area_.GetSize(); }
 
-  for (auto it = sheet_.begin(); it != sheet_.end(); ++it) {
-    if (it->second != nullptr) {
-      if (it->first.row > max_row - 1) { max_row = it->first.row + 1; }
-      if (it->first.col > max_col - 1) { max_col = it->first.col + 1; }
+void Sheet::PrintValues(std::ostream& output) const {
+  PrintCells(*storage_, GetPrintableSize(), output,
+             [](const Cell& cell, OutputBuffer& buffer) {
+    const auto value = cell.GetValueView();
+    // Check the type of the value and print it to the output buffer
+    if (std::holds_alternative<double>(value)) {
+      buffer.WriteNumber(std::get<double>(value));
     }
-  }
+    // Check the type of the value and print it to the output buffer
+    else if (std::holds_alternative<std::string_view>(value)) {
+      buffer.Write(std::get<std::string_view>(value));
+    }
+    // Check the type of the value and print it to the output buffer
+    else if (std::holds_alternative<FormulaError>(value)) {
+      buffer.Write(std::get<FormulaError>(value).Message());
+    }
+  });
+}
 
-  return Size{ max_row, max_col };
+void Sheet::PrintTexts(std::ostream& output) const {
+  PrintCells(*storage_, GetPrintableSize(), output,
+             [](const Cell& cell, OutputBuffer& buffer) {
+    buffer.Write(cell.GetTextView());
+  });
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-  // Get the printable size of the sheet
-  Size size = GetPrintableSize();
-  // Iterate through each cell and print its value
-  for (int row = 0; row < size.rows; ++row) {
-    for (int col = 0; col < size.cols; ++col) {
-      // Print tab separator between columns (except for the first column)
-      if (col > 0) { output << "\t"; }
-      // Find the cell at the current position
-      const auto& it = sheet_.find({ row, col });
-      // Check if the cell exists and has a non-empty text value
-      if (it != sheet_.end() && it->second != nullptr
-          && !it->second->GetText().empty()) {
-        const auto& value = it->second->GetValue();
-        // Check the type of the value and print it to the output stream
-        if (std::holds_alternative<double>(value)) {
-          output << std::get<double>(value);
-        }
-        // Check the type of the value and print it to the output stream
-        else if (std::holds_alternative<std::string>(value)) {
-          output << std::get<std::string>(value);
-        }
-        // Check the type of the value and print it to the output stream
-        else if (std::holds_alternative<FormulaError>(value)) {
-          output << std::get<FormulaError>(value).Message();
-        }
+std::optional<FormulaError> Sheet::GetRangeValues(
+    Range range, std::vector<double>& values) const {
+  // The storage hands out a column at a time, so the range is read
+  // without a lookup per cell. Not a scratch buffer kept between calls:
+  // reading a cell may evaluate formulas that read ranges themselves
+  std::vector<const Cell*> column_cells(range.last.row - range.first.row + 1);
+  for (int col = range.first.col; col <= range.last.col; ++col) {
+    storage_->GetColumn(col, range.first.row, column_cells);
+    for (const Cell* cell : column_cells) {
+      if (cell == nullptr) { continue; }
+      const auto value = cell->GetRangeValue();
+      if (!value) { continue; }
+      if (const double* number = std::get_if<double>(&*value)) {
+        values.push_back(*number);
       }
+      else { return std::get<FormulaError>(*value); }
     }
-    // Print newline character to move to the next row
-    output << "\n";
   }
+  return std::nullopt;
 }
 
-void Sheet::PrintTexts(std::ostream& output) const {
-  // Get the printable size of the sheet
-  Size size = GetPrintableSize();
-  // Iterate through each cell and print its text
-  for (int row = 0; row < size.rows; ++row) {
-    for (int col = 0; col < size.cols; ++col) {
-      // Print tab separator between columns (except for the first column)
-      if (col > 0) output << "\t";
-      // Find the cell at the current position
-      const auto& it = sheet_.find({ row, col });
-      // Check if the cell exists and has non-empty text
-      if (it != sheet_.end() && it->second != nullptr
-          && !it->second->GetText().empty()) {
-        // Print the text of the cell
-        output << it->second->GetText();
-      }
-    }
-    // Print newline character to move to the next row
-    output << "\n";
+ColumnValues Sheet::GetColumnValues(int col, int row_begin,
+                                    int row_end) const {
+  if (col < 0 || col >= Position::MAX_COLS || row_begin < 0
+      || row_begin > row_end || row_end > Position::MAX_ROWS) {
+    throw InvalidPositionException("Error: position is not valid");
   }
+  return column_values_.Get(col, row_begin, row_end);
+}
+
+void Sheet::InvalidateColumnValue(Position pos) {
+  column_values_.Invalidate(pos);
+}
+
+void Sheet::UpdatePrintableArea(Position pos, bool has_text) {
+  has_text ? printable_area_.Add(pos) : printable_area_.Remove(pos);
 }
 
 const Cell* Sheet::GetConcreteCell(Position pos) const {
@@ -117,11 +295,9 @@ const Cell* Sheet::GetConcreteCell(Position pos) const {
     throw InvalidPositionException("Error: position is not valid");
   }
   // Find the cell at the specified position
-  const auto requested_cell_iter = sheet_.find(pos);
-  // If the cell does not exist, return nullptr
-  if (requested_cell_iter == sheet_.end()) { return nullptr; }
   // Return a pointer to the cell at the specified position
-  return requested_cell_iter->second.get();
+  // or nullptr if the cell does not exist
+  return storage_->Find(pos);
 }
 
 Cell* Sheet::GetConcreteCell(Position pos) {
@@ -129,6 +305,170 @@ Cell* Sheet::GetConcreteCell(Position pos) {
       static_cast<const Sheet&>(*this).GetConcreteCell(pos));
 }
 
+void Sheet::ForEachCellInRange(Range range,
+                               const std::function<void(Cell&)>& func) {
+  storage_->ForEachInRange(range, [&func](Position, const Cell& cell) {
+    func(const_cast<Cell&>(cell));
+  });
+}
+
+void Sheet::Recalculate() {
+  // Every dirty cell is marked, so the dirty cells an edit leaves are
+  // found without a pass over the whole sheet
+  const std::vector<Cell*> dirty_cells = TakeDirtyCells();
+  if (thread_pool_ != nullptr) { return RecalculateInParallel(dirty_cells); }
+  // The cells referenced by a dirty cell are already evaluated
+  // by the time it is reached, so every evaluation is one level deep
+  for (const Cell* cell : dirty_cells) { cell->GetValueView(); }
+}
+
+void Sheet::MarkDirty(Position pos) {
+  dirty_cells_.push_back(pos);
+  // Edits with no recalculation in between may mark a cell again and again
+  if (dirty_cells_.size() >= dirty_cells_limit_) { CompactDirtyCells(); }
+}
+
+Cell& Sheet::FindOrCreateCell(Position pos) {
+  if (Cell* cell = storage_->Find(pos)) { return *cell; }
+  // A new cell has to take its place in the recalculation order
+  InvalidateRecalculationOrder();
+  return storage_->FindOrCreate(pos, *this);
+}
+
+void Sheet::MarkPossiblyUnused(Position pos) {
+  possibly_unused_cells_.push_back(pos);
+}
+
+void Sheet::EraseUnusedCells() {
+  for (const Position pos : possibly_unused_cells_) {
+    const Cell* cell = storage_->Find(pos);
+    // An empty cell is kept only for the formulas referencing it
+    if (cell != nullptr && !cell->HasText() && !cell->IsReferenced()) {
+      storage_->Erase(pos);
+      InvalidateRecalculationOrder();
+    }
+  }
+  possibly_unused_cells_.clear();
+}
+
+void Sheet::InvalidateRecalculationOrder() {
+  recalculation_order_valid_ = false;
+}
+
+const std::vector<Cell*>& Sheet::GetRecalculationOrder() {
+  if (!recalculation_order_valid_) { BuildRecalculationOrder(); }
+  return recalculation_order_;
+}
+
+void Sheet::SetRecalculationThreads(std::size_t threads) {
+  thread_pool_ = threads > 1 ? std::make_unique<ThreadPool>(threads) : nullptr;
+}
+
+void Sheet::SetTextInterning(bool enabled) { text_interning_ = enabled; }
+
+bool Sheet::IsTextInterning() const { return text_interning_; }
+
+std::int64_t Sheet::TakeFirstTopologicalIndex() {
+  return --first_topological_index_;
+}
+
+std::int64_t Sheet::TakeLastTopologicalIndex() {
+  return last_topological_index_++;
+}
+
+std::uint64_t Sheet::TakeVisitMark() { return ++last_visit_mark_; }
+
+FormulaTable& Sheet::GetFormulaTable() { return formula_table_; }
+
+RangeIndex& Sheet::GetRangeIndex() { return range_index_; }
+
+SlabAllocator& Sheet::GetAllocator() { return allocator_; }
+
+std::vector<Cell*>& Sheet::GetInvalidationWorklist() {
+  return invalidation_worklist_;
+}
+
+TextTable& Sheet::GetTextTable() { return text_table_; }
+
+void Sheet::RecalculateInParallel(const std::vector<Cell*>& dirty_cells) {
+  // Levels narrower than that are not worth waking the workers up
+  constexpr std::size_t MIN_PARALLEL_LEVEL = 256;
+
+  // Split the dirty cells into dependency levels: a cell references
+  // only cells of lower levels, so cells of one level are independent
+  std::vector<std::vector<const Cell*>> levels;
+  std::unordered_map<const Cell*, std::size_t> level_of;
+  for (const Cell* cell : dirty_cells) {
+    std::size_t level = 0;
+    cell->ForEachDependency([&](const Cell& dependency) {
+      const auto dependency_level = level_of.find(&dependency);
+      if (dependency_level != level_of.end()) {
+        level = std::max(level, dependency_level->second + 1);
+      }
+    });
+    level_of[cell] = level;
+    if (level == levels.size()) { levels.emplace_back(); }
+    levels[level].push_back(cell);
+  }
+
+  // Every cache is written by exactly one thread, and the cells it reads
+  // belong to finished levels, whose results ParallelFor has published
+  for (const auto& level : levels) {
+    if (level.size() < MIN_PARALLEL_LEVEL) {
+      for (const Cell* cell : level) { cell->GetValueView(); }
+      continue;
+    }
+    thread_pool_->ParallelFor(level.size(), [&level](std::size_t i) {
+      level[i]->GetValueView();
+    });
+  }
+}
+
+void Sheet::BuildRecalculationOrder() {
+  recalculation_order_.clear();
+  storage_->ForEach([&](Position, const Cell& cell) {
+    recalculation_order_.push_back(const_cast<Cell*>(&cell));
+  });
+  // Every edit keeps the topological indices of the cells up to date
+  std::sort(recalculation_order_.begin(), recalculation_order_.end(),
+            [](const Cell* lhs, const Cell* rhs) {
+              return lhs->GetTopologicalIndex() < rhs->GetTopologicalIndex();
+            });
+  recalculation_order_valid_ = true;
+}
+
+std::vector<Cell*> Sheet::TakeDirtyCells() {
+  std::vector<Cell*> cells;
+  cells.reserve(dirty_cells_.size());
+  for (const Position pos : dirty_cells_) {
+    Cell* cell = storage_->Find(pos);
+    // Reads may have evaluated the cell since it was marked
+    if (cell != nullptr && !cell->IsCacheValid()) { cells.push_back(cell); }
+  }
+  dirty_cells_.clear();
+  // No two cells share a topological index, so the same cell
+  // marked several times ends up in a run
+  std::sort(cells.begin(), cells.end(), [](const Cell* lhs, const Cell* rhs) {
+    return lhs->GetTopologicalIndex() < rhs->GetTopologicalIndex();
+  });
+  cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+  return cells;
+}
+
+void Sheet::CompactDirtyCells() {
+  constexpr std::size_t MIN_DIRTY_CELLS_LIMIT = 1024;
+  for (const Cell* cell : TakeDirtyCells()) {
+    dirty_cells_.push_back(cell->GetPosition());
+  }
+  // At least as many marks again before the next compaction
+  dirty_cells_limit_ = std::max(MIN_DIRTY_CELLS_LIMIT, 2 * dirty_cells_.size());
+}
+
 std::unique_ptr<SheetInterface> CreateSheet() {
   return std::make_unique<Sheet>();
 }
+
+std::unique_ptr<SheetInterface> CreateSheet(
+    std::unique_ptr<CellStorage> storage) {
+  return std::make_unique<Sheet>(std::move(storage));
+}
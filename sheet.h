@@ -2,21 +2,40 @@
 
 #include "cell.h"
 #include "common.h"
+#include "cell_storage.h"
+#include "column_values.h"
+#include "printable_area.h"
+#include "range_index.h"
+#include "slab_allocator.h"
+#include "text_table.h"
+#include "thread_pool.h"
 
 #include <functional>
 #include <unordered_map>
 #include <algorithm>
+#include <cstdint>
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <vector>
 
 class Sheet : public SheetInterface {
   public:
 
+  Sheet();
+
+  explicit Sheet(std::unique_ptr<CellStorage> storage);
+
   ~Sheet();
 
   void SetCell(Position pos, std::string text) override;
 
+  // Sets the texts of many cells as one edit: the dependency graph
+  // is rewired, checked for cycles and invalidated once for the batch.
+  // Throws without changing anything if a position is invalid,
+  // a formula is incorrect or the batch introduces a cycle
+  void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
   const CellInterface* GetCell(Position pos) const override;
 
   CellInterface* GetCell(Position pos) override;
@@ -25,33 +44,158 @@ class Sheet : public SheetInterface {
 
   Size GetPrintableSize() const override;
 
+  // Bytes of memory the cells of the sheet take, with their storage
+  std::size_t GetMemoryUsage() const;
+
+  // Gives back the memory that erased cells and formulas have left in
+  // the storage and the indices, and drops the cached column values
+  void ShrinkToFit();
+
   void PrintValues(std::ostream& output) const override;
 
   void PrintTexts(std::ostream& output) const override;
 
+  std::optional<FormulaError> GetRangeValues(
+      Range range, std::vector<double>& values) const override;
+
+  // Values of rows [row_begin, row_end) of the column, stored by column.
+  // Formulas are evaluated as needed; the views stay valid until
+  // the next call. Not to be called from several threads at once
+  ColumnValues GetColumnValues(int col, int row_begin, int row_end) const;
+
+  // Must be called whenever the value of a cell may have changed
+  void InvalidateColumnValue(Position pos);
+
+  // Must be called whenever a cell gets or loses its text
+  void UpdatePrintableArea(Position pos, bool has_text);
+
   const Cell* GetConcreteCell(Position pos) const;
 
   Cell* GetConcreteCell(Position pos);
 
+  // Returns the cell at the position, creating an empty one if there is none
+  Cell& FindOrCreateCell(Position pos);
+
+  // Must be called whenever a cell may have lost its text or the last
+  // formula referencing it. Cells left with neither are erased once
+  // the edit is over
+  void MarkPossiblyUnused(Position pos);
+
+  // Calls func for every existing cell of the range
+  void ForEachCellInRange(Range range, const std::function<void(Cell&)>& func);
+
+  // Evaluates every formula whose value is not cached, iterating
+  // the cells in topological order instead of recursing through references.
+  // Only the cells marked dirty since the last call are visited
+  void Recalculate();
+
+  // Must be called whenever a formula loses its cached value
+  void MarkDirty(Position pos);
+
+  // Must be called whenever cells or dependencies between them change
+  void InvalidateRecalculationOrder();
+
+  // All the cells of the sheet, every cell follows the cells it references
+  const std::vector<Cell*>& GetRecalculationOrder();
+
+  // Sets the number of threads Recalculate evaluates independent
+  // formulas on, one means evaluating on the calling thread only
+  void SetRecalculationThreads(std::size_t threads);
+
+  // Makes the texts set from now on be kept once per distinct text in
+  // the text table of the sheet, which pays off when many cells repeat
+  // few texts. Texts set before keep their storage
+  void SetTextInterning(bool enabled);
+
+  bool IsTextInterning() const;
+
+  // Indices before and after all the indices taken so far, for cells
+  // that may move to the beginning or the end of the topological order
+  std::int64_t TakeFirstTopologicalIndex();
+
+  std::int64_t TakeLastTopologicalIndex();
+
+  // A mark no cell carries yet, for searches over the dependency graph
+  std::uint64_t TakeVisitMark();
+
+  // Formulas of the cells of the sheet, shared between cells
+  FormulaTable& GetFormulaTable();
+
+  // Formulas of the sheet by the ranges they aggregate
+  RangeIndex& GetRangeIndex();
+
+  // Holds the contents of the cells
+  SlabAllocator& GetAllocator();
+
+  // Cells whose dependents are left to invalidate, empty between edits
+  std::vector<Cell*>& GetInvalidationWorklist();
+
+  // Texts of the cells, shared between cells, if interning is enabled
+  TextTable& GetTextTable();
+
   private:
 
-  class SheetHasher {
-    public:
-    size_t operator()(const Position pos) const {
-      return std::hash<std::string>()(pos.ToString());
-    }
-  };
-
-  class SheetKeyEqual {
-    public:
-    bool operator()(const Position& lhs, const Position& rhs) const {
-      return lhs == rhs;
-    }
-  };
-
-  std::unordered_map<Position, std::unique_ptr<Cell>,
-                     SheetHasher,
-                     SheetKeyEqual> sheet_;
+  void BuildRecalculationOrder();
+
+  void EraseUnusedCells();
+
+  void RecalculateInParallel(const std::vector<Cell*>& dirty_cells);
+
+  // Takes the distinct cells marked dirty that still are, in topological
+  // order, and empties the marks
+  std::vector<Cell*> TakeDirtyCells();
+
+  // Drops the marks of cells that are gone, evaluated or marked twice
+  void CompactDirtyCells();
+
+  RangeIndex range_index_;
+
+  // Outlive the cells, whose contents they hold
+  SlabAllocator allocator_;
+  TextTable text_table_;
+  bool text_interning_ = false;
+
+  std::unique_ptr<CellStorage> storage_;
+
+  // Filled when read, from the storage above
+  mutable ColumnValueCache column_values_;
+
+  // The cells with a text
+  PrintableArea printable_area_;
+
+  // All the cells of the sheet, every cell follows the cells it references
+  std::vector<Cell*> recalculation_order_;
+
+  bool recalculation_order_valid_ = false;
+
+  // Cells to erase after the current edit unless they are still used
+  std::vector<Position> possibly_unused_cells_;
+
+  // Formulas that have lost their values since the last recalculation.
+  // Positions rather than cells, which may be erased in the meantime
+  std::vector<Position> dirty_cells_;
+
+  // Size past which the marks above are compacted
+  std::size_t dirty_cells_limit_ = 0;
+
+  // Reused by the invalidation of every edit to avoid allocations
+  std::vector<Cell*> invalidation_worklist_;
+
+  // Created only when more than one recalculation thread is requested
+  std::unique_ptr<ThreadPool> thread_pool_;
+
+  std::int64_t first_topological_index_ = 0;
+
+  std::int64_t last_topological_index_ = 0;
+
+  std::uint64_t last_visit_mark_ = 0;
+
+  FormulaTable formula_table_;
 };
 
+// Creates an empty table that keeps its cells in a hash table
 std::unique_ptr<SheetInterface> CreateSheet();
+
+// Creates an empty table that keeps its cells in the given storage
+std::unique_ptr<SheetInterface> CreateSheet(
+    std::unique_ptr<CellStorage> storage);
@@ -0,0 +1,75 @@
+#include "slab_allocator.h"
+
+#include <new>
+
+SlabAllocator::~SlabAllocator() {
+  for (SizeClass& size_class : classes_) { FreeSlabs(size_class, false); }
+}
+
+void* SlabAllocator::Allocate(std::size_t size) {
+  if (size > MAX_BLOCK_SIZE) { return ::operator new(size); }
+  const std::size_t index = GetClassIndex(size);
+  SizeClass& size_class = classes_[index];
+  if (size_class.free_blocks != nullptr) {
+    FreeBlock* block = size_class.free_blocks;
+    size_class.free_blocks = block->next;
+    ++size_class.used_blocks;
+    return block;
+  }
+  const std::size_t block_size = GetBlockSize(index);
+  if (size_class.end + block_size > SLAB_SIZE) {
+    std::byte* slab = static_cast<std::byte*>(::operator new(SLAB_SIZE));
+    try { size_class.slabs.push_back(slab); }
+    catch (...) {
+      ::operator delete(slab);
+      throw;
+    }
+    size_class.end = 0;
+  }
+  void* block = size_class.slabs.back() + size_class.end;
+  size_class.end += block_size;
+  ++size_class.used_blocks;
+  return block;
+}
+
+void SlabAllocator::Deallocate(void* block, std::size_t size) {
+  if (size > MAX_BLOCK_SIZE) {
+    ::operator delete(block);
+    return;
+  }
+  SizeClass& size_class = classes_[GetClassIndex(size)];
+  if (--size_class.used_blocks == 0) {
+    // Every block of the class is free, start over from the first slab
+    FreeSlabs(size_class, true);
+    return;
+  }
+  FreeBlock* freed = static_cast<FreeBlock*>(block);
+  freed->next = size_class.free_blocks;
+  size_class.free_blocks = freed;
+}
+
+void SlabAllocator::ReleaseEmptySlabs() {
+  for (SizeClass& size_class : classes_) {
+    if (size_class.used_blocks == 0) { FreeSlabs(size_class, false); }
+  }
+}
+
+std::size_t SlabAllocator::GetMemoryUsage() const {
+  std::size_t memory = 0;
+  for (const SizeClass& size_class : classes_) {
+    memory += size_class.slabs.size() * SLAB_SIZE
+              + size_class.slabs.capacity() * sizeof(std::byte*);
+  }
+  return memory;
+}
+
+void SlabAllocator::FreeSlabs(SizeClass& size_class, bool keep_first) {
+  const std::size_t kept = keep_first && !size_class.slabs.empty() ? 1 : 0;
+  for (std::size_t i = kept; i < size_class.slabs.size(); ++i) {
+    ::operator delete(size_class.slabs[i]);
+  }
+  size_class.slabs.resize(kept);
+  if (kept == 0) { std::vector<std::byte*>().swap(size_class.slabs); }
+  size_class.free_blocks = nullptr;
+  size_class.end = kept == 0 ? SLAB_SIZE : 0;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+// Memory for many small objects, carved out of large slabs instead of
+// being requested from operator new one object at a time. Blocks are
+// grouped in size classes; a freed block goes to the free list of its
+// class and is handed out again before the slabs grow. The slabs of a
+// class are given back once no block of the class is in use (the first
+// one is kept until ReleaseEmptySlabs, so that a class going back and
+// forth between zero and one object does not take a slab every time).
+// Blocks bigger than the size classes come from operator new.
+// Not thread-safe
+class SlabAllocator {
+  public:
+
+  SlabAllocator() = default;
+
+  SlabAllocator(const SlabAllocator&) = delete;
+
+  SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+  // Gives back all the slabs, the objects in them must be destroyed
+  ~SlabAllocator();
+
+  // Returns memory for an object of the size, aligned for any type
+  void* Allocate(std::size_t size);
+
+  // Takes back a block Allocate returned for the same size
+  void Deallocate(void* block, std::size_t size);
+
+  // Gives back the slabs kept with no blocks in use
+  void ReleaseEmptySlabs();
+
+  // Bytes of memory the slabs take
+  std::size_t GetMemoryUsage() const;
+
+  private:
+
+  static constexpr std::size_t SLAB_SIZE = std::size_t{ 64 } << 10;
+  static constexpr std::size_t GRANULE = alignof(std::max_align_t);
+  static constexpr std::size_t MAX_BLOCK_SIZE = 512;
+  static constexpr std::size_t CLASS_COUNT = MAX_BLOCK_SIZE / GRANULE;
+
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  struct SizeClass {
+    std::vector<std::byte*> slabs;
+    FreeBlock* free_blocks = nullptr;
+    // Offset in the last slab of the first block never handed out
+    std::size_t end = SLAB_SIZE;
+    std::size_t used_blocks = 0;
+  };
+
+  static std::size_t GetClassIndex(std::size_t size) {
+    return size == 0 ? 0 : (size - 1) / GRANULE;
+  }
+
+  static std::size_t GetBlockSize(std::size_t index) {
+    return (index + 1) * GRANULE;
+  }
+
+  // Gives back the slabs of the class, keeping the first one if asked
+  static void FreeSlabs(SizeClass& size_class, bool keep_first);
+
+  std::array<SizeClass, CLASS_COUNT> classes_;
+};
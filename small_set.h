@@ -0,0 +1,232 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <utility>
+
+#include "linear_probing.h"
+
+// Set of trivially copyable values, such as the cells an edge list
+// points to, that is small most of the time. Up to N values are kept
+// inline and searched linearly, so an empty or a small set allocates
+// nothing. A set outgrowing them moves to a heap table probed linearly,
+// and moves back inline once it shrinks below N.
+// A value-initialized T marks empty slots and must not be inserted
+template <typename T, std::size_t N>
+class SmallSet {
+  public:
+
+  static_assert(N > 0, "a set keeps at least one value inline");
+
+  // Walks the inline values or the slots of the table, skipping empty ones
+  class Iterator {
+    public:
+
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T*;
+    using reference = const T&;
+
+    Iterator(const T* current, const T* end) : current_(current), end_(end) {
+      SkipEmpty();
+    }
+
+    const T& operator*() const { return *current_; }
+
+    Iterator& operator++() {
+      ++current_;
+      SkipEmpty();
+      return *this;
+    }
+
+    bool operator==(const Iterator& rhs) const {
+      return current_ == rhs.current_;
+    }
+
+    bool operator!=(const Iterator& rhs) const { return !(*this == rhs); }
+
+    private:
+
+    void SkipEmpty() {
+      while (current_ != end_ && *current_ == T{}) { ++current_; }
+    }
+
+    const T* current_;
+    const T* end_;
+  };
+
+  SmallSet() = default;
+
+  SmallSet(const SmallSet& other) {
+    for (const T& value : other) { Insert(value); }
+  }
+
+  SmallSet(SmallSet&& other) noexcept { Swap(other); }
+
+  SmallSet& operator=(SmallSet other) noexcept {
+    Swap(other);
+    return *this;
+  }
+
+  ~SmallSet() { FreeTable(); }
+
+  // Returns false if the value is in the set already
+  bool Insert(T value) {
+    if (bits_ == 0) {
+      for (std::uint32_t i = 0; i < size_; ++i) {
+        if (storage_.values[i] == value) { return false; }
+      }
+      if (size_ < N) {
+        storage_.values[size_++] = value;
+        return true;
+      }
+      Rehash(BitsFor(N * 2));
+    }
+    else if ((size_ + 1) * 4 > GetCapacity() * 3) { Rehash(bits_ + 1); }
+    const std::size_t mask = GetCapacity() - 1;
+    std::size_t i = SlotFor(value);
+    for (; storage_.table[i] != T{}; i = (i + 1) & mask) {
+      if (storage_.table[i] == value) { return false; }
+    }
+    storage_.table[i] = value;
+    ++size_;
+    return true;
+  }
+
+  // Returns false if the value is not in the set
+  bool Erase(T value) {
+    if (bits_ == 0) {
+      for (std::uint32_t i = 0; i < size_; ++i) {
+        if (storage_.values[i] == value) {
+          // The order of the inline values does not matter
+          storage_.values[i] = storage_.values[--size_];
+          storage_.values[size_] = T{};
+          return true;
+        }
+      }
+      return false;
+    }
+    const std::size_t mask = GetCapacity() - 1;
+    T* table = storage_.table;
+    std::size_t hole = SlotFor(value);
+    for (; table[hole] != value; hole = (hole + 1) & mask) {
+      if (table[hole] == T{}) { return false; }
+    }
+    hole = ShiftProbeRunBack(
+        hole, mask, [table](std::size_t i) { return table[i] == T{}; },
+        [this, table](std::size_t i) { return SlotFor(table[i]); },
+        [table](std::size_t from, std::size_t to) { table[to] = table[from]; });
+    table[hole] = T{};
+    --size_;
+    // A set goes back inline one value below the inline capacity,
+    // so a set at the limit does not move on every other change
+    if (size_ < N) { MoveInline(); }
+    return true;
+  }
+
+  bool Contains(T value) const {
+    if (bits_ == 0) {
+      for (std::uint32_t i = 0; i < size_; ++i) {
+        if (storage_.values[i] == value) { return true; }
+      }
+      return false;
+    }
+    for (std::size_t i = SlotFor(value); storage_.table[i] != T{};
+         i = (i + 1) & (GetCapacity() - 1)) {
+      if (storage_.table[i] == value) { return true; }
+    }
+    return false;
+  }
+
+  void Clear() {
+    FreeTable();
+    std::fill(storage_.values, storage_.values + N, T{});
+    size_ = 0;
+    bits_ = 0;
+  }
+
+  std::size_t Size() const { return size_; }
+
+  bool Empty() const { return size_ == 0; }
+
+  // Bytes of heap memory the set holds, none while the values fit inline
+  std::size_t GetMemoryUsage() const { return GetCapacity() * sizeof(T); }
+
+  Iterator begin() const { return Iterator(First(), Last()); }
+
+  Iterator end() const { return Iterator(Last(), Last()); }
+
+  private:
+
+  // Slots of the heap table, zero while the values are inline
+  std::size_t GetCapacity() const {
+    return bits_ == 0 ? 0 : std::size_t{ 1 } << bits_;
+  }
+
+  const T* First() const {
+    return bits_ == 0 ? storage_.values : storage_.table;
+  }
+
+  const T* Last() const {
+    return bits_ == 0 ? storage_.values + size_
+                      : storage_.table + GetCapacity();
+  }
+
+  // Bits of the smallest table of at least n slots
+  static std::uint32_t BitsFor(std::size_t n) {
+    std::uint32_t bits = 1;
+    while ((std::size_t{ 1 } << bits) < n) { ++bits; }
+    return bits;
+  }
+
+  std::size_t SlotFor(T value) const {
+    // Fibonacci hashing: the top bits of the product depend on all
+    // the bits of the value, the low bits of aligned pointers included
+    const std::uint64_t key = std::hash<T>()(value);
+    return static_cast<std::size_t>(
+        (key * UINT64_C(0x9E3779B97F4A7C15)) >> (64 - bits_));
+  }
+
+  void Rehash(std::uint32_t bits) {
+    SmallSet rehashed;
+    rehashed.storage_.table = new T[std::size_t{ 1 } << bits]();
+    rehashed.bits_ = bits;
+    for (const T& value : *this) { rehashed.Insert(value); }
+    Swap(rehashed);
+  }
+
+  void MoveInline() {
+    T values[N]{};
+    std::uint32_t size = 0;
+    for (const T& value : *this) { values[size++] = value; }
+    FreeTable();
+    std::copy(values, values + N, storage_.values);
+    size_ = size;
+    bits_ = 0;
+  }
+
+  void FreeTable() {
+    if (bits_ != 0) { delete[] storage_.table; }
+  }
+
+  void Swap(SmallSet& other) noexcept {
+    std::swap(size_, other.size_);
+    std::swap(bits_, other.bits_);
+    std::swap(storage_, other.storage_);
+  }
+
+  // The inline values or the heap table, whichever bits_ says
+  union Storage {
+    T values[N];
+    T* table;
+  };
+
+  std::uint32_t size_ = 0;
+  // The heap table has 2^bits_ slots, zero while the values are inline
+  std::uint32_t bits_ = 0;
+  Storage storage_{};
+};
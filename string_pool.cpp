@@ -0,0 +1,50 @@
+#include "string_pool.h"
+
+std::uint32_t StringPool::Intern(std::string_view text) {
+  if (const auto it = ids_.find(text); it != ids_.end()) {
+    ++entries_[it->second].references;
+    return it->second;
+  }
+  std::uint32_t id = 0;
+  if (free_ids_.empty()) {
+    id = static_cast<std::uint32_t>(entries_.size());
+    entries_.emplace_back();
+  }
+  else {
+    id = free_ids_.back();
+    free_ids_.pop_back();
+  }
+  Entry& entry = entries_[id];
+  entry.text = text;
+  entry.references = 1;
+  ids_.emplace(entry.text, id);
+  return id;
+}
+
+void StringPool::Release(std::uint32_t id) {
+  Entry& entry = entries_[id];
+  if (--entry.references != 0) { return; }
+  ids_.erase(entry.text);
+  // Free the text right away, the slot may wait long for a new one
+  std::string().swap(entry.text);
+  free_ids_.push_back(id);
+}
+
+std::size_t StringPool::GetMemoryUsage() const {
+  std::size_t memory = entries_.size() * sizeof(Entry)
+                       + free_ids_.capacity() * sizeof(std::uint32_t)
+                       // A node and a bucket per string
+                       + ids_.size() * (sizeof(std::string_view)
+                                        + sizeof(std::uint32_t)
+                                        + 2 * sizeof(void*))
+                       // An empty table keeps its only bucket inline
+                       + (ids_.bucket_count() > 1
+                              ? ids_.bucket_count() * sizeof(void*)
+                              : 0);
+  for (const Entry& entry : entries_) {
+    if (entry.text.capacity() > std::string().capacity()) {
+      memory += entry.text.capacity() + 1;
+    }
+  }
+  return memory;
+}
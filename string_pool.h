@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Interned strings with 32-bit ids: equal strings are stored once,
+// however many holders refer to them. A string is counted once per
+// Intern and dropped when it has been released as many times; its id
+// is then given to the next new string
+class StringPool {
+  public:
+
+  // Returns the id of the string, adding it if there is none yet
+  std::uint32_t Intern(std::string_view text);
+
+  // Drops one reference to the string of the id
+  void Release(std::uint32_t id);
+
+  // The view stays valid until the string is dropped
+  std::string_view Get(std::uint32_t id) const { return entries_[id].text; }
+
+  // Number of distinct strings held
+  std::size_t GetSize() const { return ids_.size(); }
+
+  // Bytes of heap memory the pool holds
+  std::size_t GetMemoryUsage() const;
+
+  private:
+
+  struct Entry {
+    std::string text;
+    std::uint32_t references = 0;
+  };
+
+  // A deque does not move its elements as it grows,
+  // so the keys of the table may point into them
+  std::deque<Entry> entries_;
+  std::vector<std::uint32_t> free_ids_;
+  std::unordered_map<std::string_view, std::uint32_t> ids_;
+};
@@ -90,6 +90,19 @@ Position Position::FromString(std::string_view str) {
   return { row - 1, col - 1 };
 }
 
+bool Range::operator==(const Range rhs) const {
+  return first == rhs.first && last == rhs.last;
+}
+
+bool Range::Contains(const Position pos) const {
+  return pos.row >= first.row && pos.row <= last.row
+         && pos.col >= first.col && pos.col <= last.col;
+}
+
+std::string Range::ToString() const {
+  return first.ToString() + ':' + last.ToString();
+}
+
 bool Size::operator==(Size rhs) const {
   return rows == rhs.rows && cols == rhs.cols;
 }
@@ -0,0 +1,65 @@
+#include "text_table.h"
+
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+
+std::string_view GetVisibleText(std::string_view text) {
+  if (!text.empty() && text[0] == ESCAPE_SIGN) { text.remove_prefix(1); }
+  return text;
+}
+
+CellInterface::NumericValue ParseTextNumber(std::string_view text) {
+  if (text.empty()) { return 0.0; }
+  const auto first_char = text.find_first_not_of(" \t\n\v\f\r");
+  if (first_char == std::string_view::npos) {
+    return FormulaError::Category::Value;
+  }
+  text.remove_prefix(first_char);
+  // std::from_chars does not accept an explicit plus sign
+  if (text[0] == '+') {
+    text.remove_prefix(1);
+    if (text.empty() || text[0] == '-') {
+      return FormulaError::Category::Value;
+    }
+  }
+  double number = 0.0;
+  const auto [end, error] =
+      std::from_chars(text.data(), text.data() + text.size(), number);
+  if (end != text.data() + text.size()
+      || (error != std::errc() && error != std::errc::result_out_of_range)) {
+    return FormulaError::Category::Value;
+  }
+  if (error == std::errc::result_out_of_range) {
+    // Like std::istream and the numbers in formulas, accept numbers
+    // too small to represent and reject too big ones
+    number = std::strtod(std::string(text).c_str(), nullptr);
+  }
+  // Unlike std::istream, std::from_chars reads "inf" and "nan"
+  if (!std::isfinite(number)) { return FormulaError::Category::Value; }
+  return number;
+}
+
+std::uint32_t TextTable::Intern(std::string_view text) {
+  const std::size_t size = texts_.GetSize();
+  const std::uint32_t id = texts_.Intern(text);
+  // A new text takes a new id or the id of a dropped one
+  if (texts_.GetSize() != size) {
+    if (id == numbers_.size()) { numbers_.emplace_back(); }
+    numbers_[id] = ParseTextNumber(GetVisibleText(text));
+  }
+  return id;
+}
+
+void TextTable::ShrinkToFit() {
+  // The ids of the held texts must stay, only an empty table starts over
+  if (texts_.GetSize() != 0) { return; }
+  texts_ = StringPool();
+  std::vector<NumericValue>().swap(numbers_);
+}
+
+std::size_t TextTable::GetMemoryUsage() const {
+  return texts_.GetMemoryUsage()
+         + numbers_.capacity() * sizeof(NumericValue);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "common.h"
+#include "string_pool.h"
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// The text of a text cell as its value shows it, without the escape sign
+std::string_view GetVisibleText(std::string_view text);
+
+// Reads the visible text of a text cell as a formula operand, the way
+// std::istream reads a double (leading spaces and plus sign allowed,
+// nothing after the number), but without allocations and locale lookups
+CellInterface::NumericValue ParseTextNumber(std::string_view text);
+
+// Texts of the cells of a sheet, each distinct text stored once with the
+// number formulas read it as, so that a cell holds just a 32-bit id.
+// Equal texts have equal ids as long as they are held
+class TextTable {
+  public:
+
+  using NumericValue = CellInterface::NumericValue;
+
+  // Returns the id of the text, adding it if there is none yet
+  std::uint32_t Intern(std::string_view text);
+
+  // Drops one reference to the text of the id
+  void Release(std::uint32_t id) { texts_.Release(id); }
+
+  // The view stays valid until the text is dropped
+  std::string_view GetText(std::uint32_t id) const { return texts_.Get(id); }
+
+  const NumericValue& GetNumber(std::uint32_t id) const {
+    return numbers_[id];
+  }
+
+  // Number of distinct texts held
+  std::size_t GetSize() const { return texts_.GetSize(); }
+
+  // Bytes of heap memory the table holds
+  std::size_t GetMemoryUsage() const;
+
+  // Gives back the memory of the dropped texts if no text is held
+  void ShrinkToFit();
+
+  private:
+
+  StringPool texts_;
+  // By id, the numbers of dropped texts are stale
+  std::vector<NumericValue> numbers_;
+};
@@ -0,0 +1,86 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+
+// Tasks are taken in chunks to keep contention on the counter low
+constexpr std::size_t TASK_CHUNK = 64;
+
+} // end of namespace
+
+ThreadPool::ThreadPool(std::size_t threads) {
+  for (std::size_t i = 1; i < threads; ++i) {
+    workers_.emplace_back([this] { WorkerLoop(); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  batch_started_.notify_all();
+  for (auto& worker : workers_) { worker.join(); }
+}
+
+void ThreadPool::ParallelFor(std::size_t count,
+                             const std::function<void(std::size_t)>& task) {
+  {
+    std::lock_guard lock(mutex_);
+    task_ = &task;
+    task_count_ = count;
+    next_task_ = 0;
+    busy_workers_ = workers_.size();
+    ++batch_;
+  }
+  batch_started_.notify_all();
+
+  RunTasks();
+
+  // Workers report completion under the mutex, which also
+  // publishes their writes to this thread. The task must outlive
+  // the batch, so the wait comes before any exception is rethrown
+  std::unique_lock lock(mutex_);
+  batch_finished_.wait(lock, [this] { return busy_workers_ == 0; });
+  task_ = nullptr;
+  if (error_) { std::rethrow_exception(std::exchange(error_, nullptr)); }
+}
+
+void ThreadPool::WorkerLoop() {
+  std::size_t seen_batch = 0;
+  for (;;) {
+    {
+      std::unique_lock lock(mutex_);
+      batch_started_.wait(lock, [&] {
+        return stopping_ || batch_ != seen_batch;
+      });
+      if (stopping_) { return; }
+      seen_batch = batch_;
+    }
+
+    RunTasks();
+
+    std::lock_guard lock(mutex_);
+    if (--busy_workers_ == 0) { batch_finished_.notify_one(); }
+  }
+}
+
+void ThreadPool::RunTasks() {
+  for (;;) {
+    const std::size_t begin = next_task_.fetch_add(TASK_CHUNK);
+    if (begin >= task_count_) { return; }
+    const std::size_t end = std::min(task_count_, begin + TASK_CHUNK);
+    try {
+      for (std::size_t i = begin; i < end; ++i) { (*task_)(i); }
+    }
+    catch (...) {
+      // Leave no tasks for the other threads and keep the first error
+      next_task_ = task_count_;
+      std::lock_guard lock(mutex_);
+      if (!error_) { error_ = std::current_exception(); }
+      return;
+    }
+  }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads that run batches of independent tasks.
+// The calling thread takes part in every batch,
+// so a pool of N threads starts N - 1 workers
+class ThreadPool {
+  public:
+
+  explicit ThreadPool(std::size_t threads);
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool();
+
+  std::size_t GetThreadCount() const { return workers_.size() + 1; }
+
+  // Calls task(i) for every i in [0, count) on all the threads
+  // and returns once all the calls are finished. Everything written
+  // by the tasks is visible to the caller after the return.
+  // If a task throws, the tasks not started yet are skipped and the
+  // first exception is rethrown once the other threads are done
+  void ParallelFor(std::size_t count,
+                   const std::function<void(std::size_t)>& task);
+
+  private:
+
+  void WorkerLoop();
+
+  void RunTasks();
+
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable batch_started_;
+  std::condition_variable batch_finished_;
+
+  // Current batch, guarded by mutex_
+  const std::function<void(std::size_t)>* task_ = nullptr;
+  std::size_t task_count_ = 0;
+  std::size_t batch_ = 0;
+  std::size_t busy_workers_ = 0;
+  std::exception_ptr error_;
+  bool stopping_ = false;
+
+  // Index of the next task to take, shared by all the threads of the batch
+  std::atomic<std::size_t> next_task_{ 0 };
+};